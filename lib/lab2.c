@@ -1,290 +1,2992 @@
+#define _GNU_SOURCE
 #include "lab2.h"
+#include "lab2_policy.h"
+#include "lab2_io.h"
+#include "lab2_stats.h"
+#include "lab2_trace.h"
+#include "lab2_record.h"
+#include "lab2_mrc.h"
+#include "lab2_warm.h"
+#include "lab2_sketch.h"
+#include "lab2_tier.h"
+#include "lab2_spill.h"
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <stddef.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifndef O_DIRECT
 #define O_DIRECT 0
 #endif
 
-// Small cache configuration
-#define BLOCK_SIZE 512
-#define CACHE_CAPACITY 16
+// Defaults for handles opened without a configuration. They can be
+// overridden with LAB2_BLOCK_SIZE, LAB2_CAPACITY (blocks) or
+// LAB2_CACHE_SIZE (bytes, K/M/G suffixes), LAB2_POLICY, LAB2_SHARDS,
+// LAB2_READAHEAD (blocks, 0 disables readahead), LAB2_DIRTY_RATIO (percent),
+// LAB2_DIRTY_EXPIRE_MS, LAB2_DIRECT (bytes, 0 disables direct I/O),
+// LAB2_HUGEPAGES (0 or 1), LAB2_ADMISSION (none or tinylfu), LAB2_MRC
+// (0 or 1), LAB2_TIER_SIZE (bytes, 0 disables the compressed tier),
+// LAB2_SPILL_PATH and LAB2_SPILL_SIZE (bytes, 0 disables the spill file).
+// LAB2_STATS_INTERVAL_MS makes the flusher print the global counters to
+// stderr that often, and LAB2_TRACE names a file to record every block
+// access into (see lab2_record.h). LAB2_WARM_DIR names a directory where
+// every file saves the list of its cached blocks when its last handle is
+// closed, and which the next open of the same file loads them back from.
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_CAPACITY 16
+
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (1 << 20)
+
+// Descriptors index a table of handles that grows in chunks. Chunks never
+// move, so a lookup takes no lock.
+#define HANDLE_CHUNK 256
+#define MAX_HANDLES (4096 * HANDLE_CHUNK)
+// Block keys hold the low KEY_ID_BITS of a file id above the block number.
+#define KEY_ID_BITS 24
+#if KEY_ID_BITS > RECORD_FILE_BITS
+#error "traces would merge files that the cache keeps apart"
+#endif
+
+// Automatic sharding never leaves a shard with fewer blocks than this,
+// so small caches keep a single global eviction order.
+#define MIN_SHARD_BLOCKS 256
+#define MAX_SHARDS 1024
+
+// Evicted blocks are recycled in batches once no lock-free reader can
+// still be looking at them. Every shard owns this many spare frames on top
+// of its capacity, so that retired blocks do not stall misses.
+#define RETIRE_BATCH 32
+#define SPARE_BLOCKS (2 * RETIRE_BATCH)
+#if SPARE_BLOCKS > POLICY_SPARE
+#error "a shard can hold more blocks than its policy has room for"
+#endif
+
+// Frames of a pool with hugepages are mapped in multiples of this.
+#define HUGE_PAGE_SIZE (2 << 20)
 
-// Medium cache configuration
-// #define BLOCK_SIZE 2048 
-// #define CACHE_CAPACITY 64
+// Readahead. The window of a sequential stream starts at RA_MIN_BLOCKS and
+// doubles every time it is refilled, up to the handle's limit. Background
+// workers read each contiguous run of missing blocks with one preadv().
+#define RA_MIN_BLOCKS 4
+#define RA_DEFAULT_BYTES (256 << 10)
+#define RA_BATCH 64
+#define RA_RUNS 8
+#define RA_QUEUE 64
+#define RA_WORKERS 2
 
-// Large cache configuration
-// #define BLOCK_SIZE 4096
-// #define CACHE_CAPACITY 128
+// Background write-back. The flusher wakes up every FLUSH_INTERVAL_MS, or
+// when a shard crosses its dirty limit, and cleans (a) every dirty block
+// among the coldest 1/CLEAN_RESERVE_DIV of a shard, so that evictions find
+// clean victims, (b) the oldest dirty blocks while a shard is above its
+// dirty ratio, and (c) blocks that have been dirty for longer than the
+// expiry age.
+#define DEFAULT_DIRTY_RATIO 10
+#define DEFAULT_DIRTY_EXPIRE_MS 3000
+#define FLUSH_INTERVAL_MS 100
+#define CLEAN_RESERVE_DIV 16
+#define MIN_CLEAN_RESERVE 4
+#define WB_BATCH 256
+#define FLUSH_BATCH 1024
 
+// Direct I/O. The block-aligned middle of a read or write that spans at
+// least the handle's threshold moves between the caller's buffer and the
+// disk without touching the cache, DIRECT_CHUNK bytes per request and up
+// to DIRECT_BATCH requests in flight.
+#define DEFAULT_DIRECT_BYTES (256 << 10)
+#define DIRECT_CHUNK (1 << 20)
+#define DIRECT_BATCH 16
+
+// One in HIT_SAMPLE lock-free hits of a thread is timed.
+#define HIT_SAMPLE 64
+
+// The miss ratio curve estimate tracks one sampled block per MRC_KEYS_DIV
+// blocks of the cache, within these bounds, and starts at a rate that
+// samples MRC_MIN_KEYS blocks of a working set the size of the cache.
+#define MRC_KEYS_DIV 64
+#define MRC_MIN_KEYS 4096
+#define MRC_MAX_KEYS 32768
+
+// Warm start. A manifest is loaded WARM_CHUNK blocks at a time, each chunk
+// sorted by position so that neighbours coalesce into large reads, and
+// never holds more blocks than the cache.
+#define WARM_CHUNK 1024
+
+// A miss in a read that covers several blocks loads up to this many of the
+// following missing blocks of the call with it.
+#define MISS_BATCH 64
+
+// A miss gives up with EIO once this many write-backs of dirty victims
+// have failed, rather than keep trying a device that refuses writes.
+#define MISS_WB_RETRIES 4
+
+// What loaded a block ahead of its first access, which tells how to count
+// that access.
+enum {
+    ORIGIN_DEMAND,
+    ORIGIN_READAHEAD, // the first access is a readahead hit
+    ORIGIN_BATCH,     // loaded along with a miss of the same call
+    ORIGIN_WARM,      // loaded from a warm-start manifest
+    ORIGIN_TIER,      // restored from the compressed tier by a miss
+};
+
+enum {
+    BLOCK_LOADING = 1,   // read from disk in progress, data not valid yet
+    BLOCK_WRITEBACK = 2, // write to disk in progress
+    BLOCK_EVICTING = 4,  // chosen as a victim, detached from the policy
+    BLOCK_PROBATION = 8, // refused by admission, on the shard's probation list
+};
 
 typedef struct CacheBlock {
+    struct Lab2File *file;
     off_t block_number;
     char *data;
+    // Sequence counter for lock-free readers: odd while the frame is being
+    // loaded or modified, and for good once the block is retired.
+    _Atomic uint32_t seq;
     bool dirty;
-    struct CacheBlock *next_hash;
+    uint8_t state;
+    int refs;
+    int writers;                    // writable pins, see lab2_get_block_rw()
+    _Atomic uint8_t origin;
+    uint64_t dirty_since;           // ms, CLOCK_MONOTONIC
+    struct CacheBlock *dirty_prev;  // shard's dirty list, oldest first
+    struct CacheBlock *dirty_next;
+    uint32_t index_slot;            // where the shard's index holds it
+    uint32_t spill_slot;            // slot + 1 of the spill file it loads from
+    struct CacheBlock *file_prev;
+    struct CacheBlock *file_next;
+    struct CacheBlock *retire_next; // retired or free list
+    uint64_t retire_epoch;
+    PolicyNode node;                // its links chain the probation list instead
 } CacheBlock;
 
+// An open file. All opens of one file, by (device, inode), share it, and
+// with it the cached blocks, their write-back and the file size.
 typedef struct Lab2File {
     int fd;
-    off_t file_size;
-    off_t offset;
-    size_t cache_count;
-    CacheBlock *hash_table[CACHE_CAPACITY];
+    int slot;               // names the counters of its I/O, reused once it is closed
+    uint32_t id;            // never reused
+    dev_t dev;
+    ino_t ino;
+    int handles;            // open on it, under files_lock
+    struct Lab2File *next;  // open files, under files_lock
+    _Atomic off_t file_size;
+    CacheBlock **blocks;    // resident blocks per shard, under the shard lock
+    int ra_inflight;        // readahead requests queued or running, under ra_lock
+    // Blocks of a warm-start manifest, under ra_lock. Whoever holds the
+    // file's warm request owns the array and frees it once warm_next
+    // reaches warm_count.
+    uint64_t *warm;
+    size_t warm_count;
+    size_t warm_next;
+    char *warm_path;        // manifest of LAB2_WARM_DIR, NULL without one
+    // Odd while a direct write is replacing blocks on disk. Loads that
+    // overlap one must not publish what they read.
+    _Atomic uint32_t direct_seq;
 } Lab2File;
 
-static Lab2File *files[256];
-static int file_index;
+// What a descriptor names: one open of a file, with its own offset,
+// readahead stream and settings.
+typedef struct Lab2Handle {
+    Lab2File *file;
+    int slot;               // names the counters of its accesses
+    pthread_mutex_t lock;   // serializes offset-based calls on the handle
+    off_t offset;
+    pthread_mutex_t stream_lock;
+    // Stream detection, under stream_lock.
+    off_t ra_next;          // block a sequential reader asks for next
+    off_t ra_end;           // first block not handed to readahead yet
+    size_t ra_window;       // 0 while the access pattern looks random
+    size_t ra_max;
+    size_t direct_min;      // 0 when direct I/O is off
+    uint64_t stats_base[NSTATS]; // its counters when it was opened
+} Lab2Handle;
+
+// Block index of a shard: open addressing in the style of Swiss tables.
+// Slots come in groups that fill one cache line, INDEX_GROUP frame numbers
+// (indexes into pool.headers) behind a control byte each. A control byte
+// holds 7 bits of the key's hash, or says the slot is empty or was
+// deleted, so a lookup compares a whole group's bytes at once and only
+// looks at the blocks whose byte matches. Groups are probed quadratically,
+// and a probe ends at the first group with an empty slot.
+#define INDEX_GROUP 12
+#define GROUP_SLOTS ((1u << INDEX_GROUP) - 1)
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define CTRL_EMPTY_LO 0x8080808080808080ULL
+#define CTRL_EMPTY_HI 0xfefefefe80808080ULL // bytes past the last slot read as deleted
+
+typedef struct IndexGroup {
+    _Atomic uint64_t ctrl[2];
+    _Atomic uint32_t frame[INDEX_GROUP];
+} __attribute__((aligned(64))) IndexGroup;
+
+// A slice of the buffer pool with its own lock, index and policy. Blocks
+// are spread over shards by key hash, so lookups, loads and evictions of
+// unrelated blocks proceed in parallel.
+typedef struct Shard {
+    pthread_mutex_t lock;
+    pthread_cond_t io_done;
+    size_t capacity;
+    size_t count;
+    Policy *policy;
+    struct IndexGroup *index;        // walked without the lock
+    size_t index_mask;               // groups - 1
+    size_t index_empty;              // empty slots left
+    uint32_t *index_scratch;         // frame numbers, for rebuilds
+    CacheBlock *retired;             // evicted, waiting for a grace period
+    size_t nretired;
+    CacheBlock *free_blocks;         // unused slots of the shard's arena slice
+    CacheBlock *dirty_head;
+    CacheBlock *dirty_tail;
+    size_t ndirty;
+    size_t dirty_limit;
+    size_t pinned;                   // blocks pinned through lab2_get_block*()
+    size_t clean_reserve;
+    PolicyList probation;            // newest first
+    Tier *tier;                      // compressed copies of its victims
+    Spill *spill;                    // its region of the spill file
+} __attribute__((aligned(64))) Shard;
+
+// One buffer pool shared by every open file. Blocks are keyed by
+// (file, block_number), so all handles compete for the same capacity.
+typedef struct BufferPool {
+    bool ready;
+    size_t block_size;
+    size_t capacity;
+    size_t nshards;
+    lab2_policy policy_kind;
+    lab2_admission admission;
+    Sketch *sketch;        // access frequencies, with TinyLFU admission
+    size_t tier_bytes;
+    size_t spill_bytes;
+    char *spill_path;
+    int spill_fd;
+    Shard *shards;
+    int open_files;
+    // Block headers and frames are allocated once, when the pool is built.
+    // Each shard gets a contiguous slice, so misses and evictions never
+    // call into the heap.
+    CacheBlock *headers;
+    char *frames;
+    size_t frames_len;     // of the mapping
+    size_t nslots;
+    unsigned dirty_ratio;
+    uint64_t dirty_expire_ms;
+    lab2_hugepages hugepages;
+    lab2_mrc mrc;
+} BufferPool;
+
+// A readahead request, or, with `warm`, the file's warm-start manifest.
+typedef struct RaRequest {
+    Lab2File *file;
+    off_t start;
+    size_t count;
+    bool warm;
+} RaRequest;
+
+typedef struct BlockRange {
+    off_t start;
+    size_t count;
+} BlockRange;
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ra_done = PTHREAD_COND_INITIALIZER;
+static RaRequest ra_queue[RA_QUEUE];
+static size_t ra_head, ra_len;
+static bool ra_started;
+
+// The flusher holds flusher_lock for a whole pass, so the pool cannot be
+// torn down under it.
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned stats_interval_ms; // LAB2_STATS_INTERVAL_MS, 0 for no dump
+static uint64_t mrc_base;          // block accesses before the curve estimate started
+static const char *trace_path;     // LAB2_TRACE
+static const char *warm_dir;       // LAB2_WARM_DIR
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static bool flusher_started;
+static atomic_bool flusher_kicked;
+
+// Numbers below `max` to hand out, the ones given back first. Under
+// files_lock.
+typedef struct SlotList {
+    int *free;
+    size_t nfree, cap;
+    int next;               // lowest never handed out
+    int max;
+} SlotList;
+
+typedef struct HandleChunk {
+    Lab2Handle *_Atomic h[HANDLE_CHUNK];
+} HandleChunk;
+
+static HandleChunk *_Atomic handles[MAX_HANDLES / HANDLE_CHUNK];
+static SlotList handle_slots = { .max = MAX_HANDLES };
+static SlotList stat_slots = { .max = STATS_FILES };
+static Lab2File *open_list;
+static uint32_t next_file_id;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static BufferPool pool;
+static lab2_config defaults = {
+    .block_size = DEFAULT_BLOCK_SIZE,
+    .capacity_blocks = DEFAULT_CAPACITY,
+    .policy = LAB2_POLICY_RANDOM,
+    .dirty_ratio = DEFAULT_DIRTY_RATIO,
+    .dirty_expire_ms = DEFAULT_DIRTY_EXPIRE_MS,
+    .hugepages = LAB2_HUGEPAGES_OFF,
+    .admission = LAB2_ADMISSION_NONE,
+    .mrc = LAB2_MRC_OFF,
+    .tier_bytes = LAB2_TIER_OFF,
+    .spill_bytes = LAB2_SPILL_OFF,
+};
+
+// Epoch-based reclamation. A reader publishes the global epoch in its
+// record while it walks the index without locks, and 0 when it is done.
+// The epoch only advances once every active reader has caught up with it,
+// so a block retired in epoch e is unreachable once the epoch is e + 2.
+typedef struct EpochRecord {
+    _Atomic uint64_t epoch;
+    _Atomic bool in_use;
+    struct EpochRecord *next;
+} __attribute__((aligned(64))) EpochRecord;
+
+static _Atomic uint64_t global_epoch = 1;
+static EpochRecord *_Atomic epoch_records;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static __thread EpochRecord *my_epoch;
+
+#define block_of(n) ((CacheBlock *)((char *)(n) - offsetof(CacheBlock, node)))
+
+static void epoch_release(void *arg) {
+    EpochRecord *r = arg;
+    atomic_store_explicit(&r->epoch, 0, memory_order_release);
+    atomic_store_explicit(&r->in_use, false, memory_order_release);
+}
+
+static void epoch_key_init(void) {
+    pthread_key_create(&epoch_key, epoch_release);
+}
+
+// Records are never freed; those of exited threads are reused.
+static EpochRecord *epoch_record(void) {
+    EpochRecord *r = my_epoch;
+    if (r) return r;
+    pthread_once(&epoch_once, epoch_key_init);
+    for (r = atomic_load_explicit(&epoch_records, memory_order_acquire); r; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, true)) break;
+    }
+    if (!r) {
+        if (posix_memalign((void **)&r, 64, sizeof(EpochRecord))) return NULL;
+        atomic_init(&r->epoch, 0);
+        atomic_init(&r->in_use, true);
+        r->next = atomic_load_explicit(&epoch_records, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&epoch_records, &r->next, r,
+                                                      memory_order_release,
+                                                      memory_order_relaxed)) {
+        }
+    }
+    pthread_setspecific(epoch_key, r);
+    my_epoch = r;
+    return r;
+}
+
+static void epoch_enter(EpochRecord *r) {
+    uint64_t e = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    for (;;) {
+        atomic_store_explicit(&r->epoch, e, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t now = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+        if (now == e) return;
+        e = now;
+    }
+}
+
+static void epoch_exit(EpochRecord *r) {
+    atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+// Moves the global epoch forward if no reader lags behind, and returns it.
+static uint64_t epoch_advance(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t e = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    for (EpochRecord *r = atomic_load_explicit(&epoch_records, memory_order_acquire); r;
+         r = r->next) {
+        uint64_t seen = atomic_load_explicit(&r->epoch, memory_order_acquire);
+        if (seen && seen != e) return e;
+    }
+    if (atomic_compare_exchange_strong(&global_epoch, &e, e + 1)) return e + 1;
+    return e;
+}
+
+// Seqlock write side, shard lock held. A block that is still odd (being
+// loaded, or new) stays odd until seq_write_end().
+static void seq_write_begin(CacheBlock *b) {
+    uint32_t seq = atomic_load_explicit(&b->seq, memory_order_relaxed);
+    if (seq & 1) return;
+    atomic_store_explicit(&b->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void seq_write_end(CacheBlock *b) {
+    uint32_t seq = atomic_load_explicit(&b->seq, memory_order_relaxed);
+    atomic_store_explicit(&b->seq, seq + 1, memory_order_release);
+}
+
+static uint64_t block_key(Lab2File *f, off_t block_number) {
+    return ((uint64_t)f->id << (64 - KEY_ID_BITS)) ^ (uint64_t)block_number;
+}
+
+// Feeds a block access of a caller to the trace, if one is recorded, and
+// to the miss ratio curve estimate.
+static void note_access(Lab2File *f, off_t block_number, uint64_t flags) {
+    record_access(f->id, block_number, flags);
+    mrc_access(block_key(f, block_number));
+    if (pool.sketch) sketch_add(pool.sketch, block_key(f, block_number));
+}
+
+static Shard *shard_of(uint64_t hash) {
+    return &pool.shards[(hash >> 32) & (pool.nshards - 1)];
+}
+
+static size_t shard_index(Shard *s) {
+    return (size_t)(s - pool.shards);
+}
+
+#ifndef __SSE2__
+static unsigned bytes_equal(uint64_t x, uint8_t c) {
+    uint64_t t = x ^ (0x0101010101010101ULL * c);
+    // The top bit of every byte of t that is zero, without carries between
+    // bytes, gathered into the low eight bits.
+    uint64_t z = ~(((t & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | t | 0x7f7f7f7f7f7f7f7fULL);
+    return (unsigned)(((z >> 7) * 0x0102040810204080ULL) >> 56);
+}
+#endif
+
+// Bit i is set for every slot i of the group whose control byte is c.
+static unsigned group_match(uint64_t lo, uint64_t hi, uint8_t c) {
+#ifdef __SSE2__
+    __m128i v = _mm_set_epi64x((long long)hi, (long long)lo);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)c))) & GROUP_SLOTS;
+#else
+    return (bytes_equal(lo, c) | bytes_equal(hi, c) << 8) & GROUP_SLOTS;
+#endif
+}
+
+static uint8_t hash_tag(uint64_t hash) {
+    return (uint8_t)(hash >> 57);
+}
+
+// Safe both under the shard lock and inside an epoch. A control byte is
+// published after its frame number, and frames are only reused once no
+// reader can be looking at them. A slot that changes under a lock-free
+// reader makes it miss, or find a block that is no longer resident, whose
+// sequence number tells it to retry; never a wrong block.
+static CacheBlock *lookup(Shard *s, uint64_t hash, Lab2File *f, off_t block_num) {
+    uint8_t tag = hash_tag(hash);
+    size_t g = hash & s->index_mask;
+    for (size_t step = 1; step <= s->index_mask + 1; step++) {
+        IndexGroup *grp = &s->index[g];
+        uint64_t lo = atomic_load_explicit(&grp->ctrl[0], memory_order_acquire);
+        uint64_t hi = atomic_load_explicit(&grp->ctrl[1], memory_order_acquire);
+        for (unsigned m = group_match(lo, hi, tag); m; m &= m - 1) {
+            uint32_t i = atomic_load_explicit(&grp->frame[__builtin_ctz(m)], memory_order_acquire);
+            CacheBlock *b = &pool.headers[i];
+            if (b->block_number == block_num && b->file == f) return b;
+        }
+        if (group_match(lo, hi, CTRL_EMPTY)) return NULL;
+        g = (g + step) & s->index_mask;
+    }
+    return NULL;
+}
 
-static unsigned hash_off(off_t block_number) {
-    return (unsigned)(block_number % CACHE_CAPACITY);
+// Shard lock held.
+static void ctrl_set(IndexGroup *grp, unsigned slot, uint8_t c) {
+    _Atomic uint64_t *w = &grp->ctrl[slot / 8];
+    unsigned shift = (slot % 8) * 8;
+    uint64_t v = atomic_load_explicit(w, memory_order_relaxed);
+    v = (v & ~(0xffULL << shift)) | ((uint64_t)c << shift);
+    atomic_store_explicit(w, v, memory_order_release);
 }
 
-static void remove_from_hash(Lab2File *f, CacheBlock *b) {
-    unsigned i = hash_off(b->block_number);
-    CacheBlock *p = f->hash_table[i], *prevp = NULL;
-    while (p) {
-        if (p == b) {
-            if (!prevp) f->hash_table[i] = p->next_hash;
-            else prevp->next_hash = p->next_hash;
+// Puts a block that is not in the index into the first empty or deleted
+// slot along its probe sequence. Shard lock held.
+static void index_place(Shard *s, uint64_t hash, CacheBlock *b) {
+    size_t g = hash & s->index_mask;
+    for (size_t step = 1;; step++) {
+        IndexGroup *grp = &s->index[g];
+        uint64_t lo = atomic_load_explicit(&grp->ctrl[0], memory_order_relaxed);
+        uint64_t hi = atomic_load_explicit(&grp->ctrl[1], memory_order_relaxed);
+        unsigned empty = group_match(lo, hi, CTRL_EMPTY);
+        unsigned m = empty | group_match(lo, hi, CTRL_DELETED);
+        if (m) {
+            unsigned slot = __builtin_ctz(m);
+            if (empty & (1u << slot)) s->index_empty--;
+            atomic_store_explicit(&grp->frame[slot], (uint32_t)(b - pool.headers),
+                                  memory_order_release);
+            ctrl_set(grp, slot, hash_tag(hash));
+            b->index_slot = (uint32_t)(g * INDEX_GROUP + slot);
             return;
         }
-        prevp = p;
-        p = p->next_hash;
+        g = (g + step) & s->index_mask;
+    }
+}
+
+// Clears the deleted slots, which make misses probe further, by putting
+// every block back in. Lock-free readers meanwhile miss and take the lock.
+static void index_rebuild(Shard *s) {
+    size_t n = 0;
+    for (size_t g = 0; g <= s->index_mask; g++) {
+        IndexGroup *grp = &s->index[g];
+        uint64_t lo = atomic_load_explicit(&grp->ctrl[0], memory_order_relaxed);
+        uint64_t hi = atomic_load_explicit(&grp->ctrl[1], memory_order_relaxed);
+        unsigned full = GROUP_SLOTS & ~(group_match(lo, hi, CTRL_EMPTY) |
+                                        group_match(lo, hi, CTRL_DELETED));
+        for (; full; full &= full - 1)
+            s->index_scratch[n++] =
+                atomic_load_explicit(&grp->frame[__builtin_ctz(full)], memory_order_relaxed);
+        atomic_store_explicit(&grp->ctrl[0], CTRL_EMPTY_LO, memory_order_release);
+        atomic_store_explicit(&grp->ctrl[1], CTRL_EMPTY_HI, memory_order_release);
+    }
+    s->index_empty = (s->index_mask + 1) * INDEX_GROUP;
+    for (size_t i = 0; i < n; i++) {
+        CacheBlock *b = &pool.headers[s->index_scratch[i]];
+        index_place(s, mix64(b->node.key), b);
+    }
+}
+
+static void insert_into_hash(Shard *s, uint64_t hash, CacheBlock *b) {
+    if (s->index_empty < (s->index_mask + 1) * INDEX_GROUP / 8) index_rebuild(s);
+    index_place(s, hash, b);
+}
+
+// A group with an empty slot has not been full since the index was last
+// cleared, so no probe went past it and the slot can be empty again.
+static void remove_from_hash(Shard *s, CacheBlock *b) {
+    IndexGroup *grp = &s->index[b->index_slot / INDEX_GROUP];
+    uint64_t lo = atomic_load_explicit(&grp->ctrl[0], memory_order_relaxed);
+    uint64_t hi = atomic_load_explicit(&grp->ctrl[1], memory_order_relaxed);
+    if (group_match(lo, hi, CTRL_EMPTY)) {
+        ctrl_set(grp, b->index_slot % INDEX_GROUP, CTRL_EMPTY);
+        s->index_empty++;
+    } else {
+        ctrl_set(grp, b->index_slot % INDEX_GROUP, CTRL_DELETED);
     }
 }
 
-static CacheBlock* evict_block(Lab2File *f) {
-    if (f->cache_count == 0) return NULL;
-    
-    unsigned bucket = rand() % CACHE_CAPACITY;
-    unsigned original_bucket = bucket;
-    CacheBlock *b = NULL;
-    CacheBlock *prev = NULL;
+static void unlink_from_file(Shard *s, CacheBlock *b) {
+    CacheBlock **head = &b->file->blocks[shard_index(s)];
+    if (b->file_prev) b->file_prev->file_next = b->file_next;
+    else *head = b->file_next;
+    if (b->file_next) b->file_next->file_prev = b->file_prev;
+}
+
+static bool block_evictable(const PolicyNode *n) {
+    return block_of(n)->refs == 0;
+}
+
+static void prep_write(IoRequest *r, struct iovec *iov, CacheBlock *b) {
+    iov->iov_base = b->data;
+    iov->iov_len = pool.block_size;
+    *r = (IoRequest){ b->file->fd, IO_WRITE, b->block_number * (off_t)pool.block_size, iov, 1, 0 };
+}
+
+// Writes one block; `kind` is the write-back counter it counts towards.
+// Returns -1 with errno set if the write failed or fell short.
+static int write_block(CacheBlock *b, int kind) {
+    struct iovec iov;
+    IoRequest r;
+    prep_write(&r, &iov, b);
+    io_run(&r, 1);
+    stats_add(b->file->slot, kind, 1);
+    if (r.result > 0) stats_add(b->file->slot, STAT_DISK_WRITE, r.result);
+    if (r.result == (ssize_t)pool.block_size) return 0;
+    errno = r.result < 0 ? (int)-r.result : EIO;
+    return -1;
+}
 
-    while (!f->hash_table[bucket] && bucket < CACHE_CAPACITY) bucket++;
-    if (bucket == CACHE_CAPACITY) {
-        bucket = 0;
-        while (!f->hash_table[bucket] && bucket < original_bucket) bucket++;
+// Describes consecutive blocks of one file as a single vectored read; iov
+// must have room for n entries. A block in the spill file is read from
+// there, on its own.
+static void prep_read(IoRequest *r, struct iovec *iov, CacheBlock **run, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        iov[i].iov_base = run[i]->data;
+        iov[i].iov_len = pool.block_size;
     }
+    *r = (IoRequest){ run[0]->file->fd, IO_READ, run[0]->block_number * (off_t)pool.block_size,
+                      iov, (int)n, 0 };
+    if (run[0]->spill_slot) {
+        const Spill *sp = shard_of(mix64(run[0]->node.key))->spill;
+        r->fd = sp->fd;
+        r->offset = spill_offset(sp, run[0]->spill_slot - 1);
+    }
+}
 
-    if (!f->hash_table[bucket]) return NULL;
+static void complete_spill(const IoRequest *r, CacheBlock *b);
 
-    b = f->hash_table[bucket];
-    if (b->dirty) {
-        off_t off = b->block_number * BLOCK_SIZE;
-        pwrite(f->fd, b->data, BLOCK_SIZE, off);
+// Whatever a finished read did not cover, past the end of the file or
+// after an error, is zero-filled.
+static void complete_read(const IoRequest *r, CacheBlock **run, size_t n) {
+    if (run[0]->spill_slot) {
+        complete_spill(r, run[0]);
+        return;
+    }
+    size_t got = r->result < 0 ? 0 : (size_t)r->result;
+    if (got) stats_add(run[0]->file->slot, STAT_DISK_READ, got);
+    for (size_t i = 0; i < n; i++) {
+        size_t have = got > pool.block_size ? pool.block_size : got;
+        if (have < pool.block_size) memset(run[i]->data + have, 0, pool.block_size - have);
+        got -= have;
     }
+}
 
-    f->hash_table[bucket] = b->next_hash;
-    f->cache_count--;
-    return b;
+// Runs read requests for blocks of f. A direct write may replace blocks of
+// the file on disk while they are being read, so the reads are repeated
+// until none of them overlapped one.
+static void load_blocks(Lab2File *f, IoRequest *reqs, size_t n) {
+    for (;;) {
+        uint32_t seq = atomic_load(&f->direct_seq);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        io_run(reqs, n);
+        if (atomic_load(&f->direct_seq) == seq) return;
+    }
+}
+
+static void read_blocks(CacheBlock **run, size_t n) {
+    struct iovec iov[RA_BATCH];
+    IoRequest r;
+    prep_read(&r, iov, run, n);
+    load_blocks(run[0]->file, &r, 1);
+    complete_read(&r, run, n);
+}
+
+// A block the spill file did not return whole is read from the origin
+// after all.
+static void complete_spill(const IoRequest *r, CacheBlock *b) {
+    if (r->result == (ssize_t)pool.block_size) {
+        stats_add(b->file->slot, STAT_SPILL_HITS, 1);
+        return;
+    }
+    uint32_t slot = b->spill_slot;
+    b->spill_slot = 0;
+    read_blocks(&b, 1);
+    b->spill_slot = slot;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void flusher_kick(void);
+
+// Dirty state changes go through these two, which keep the shard's dirty
+// list and count. Shard lock held.
+static void mark_dirty(Shard *s, CacheBlock *b) {
+    if (b->dirty) return;
+    b->dirty = true;
+    b->dirty_since = now_ms();
+    b->dirty_next = NULL;
+    b->dirty_prev = s->dirty_tail;
+    if (s->dirty_tail) s->dirty_tail->dirty_next = b;
+    else s->dirty_head = b;
+    s->dirty_tail = b;
+    if (++s->ndirty > s->dirty_limit) flusher_kick();
+}
+
+static void mark_clean(Shard *s, CacheBlock *b) {
+    if (!b->dirty) return;
+    b->dirty = false;
+    if (b->dirty_prev) b->dirty_prev->dirty_next = b->dirty_next;
+    else s->dirty_head = b->dirty_next;
+    if (b->dirty_next) b->dirty_next->dirty_prev = b->dirty_prev;
+    else s->dirty_tail = b->dirty_prev;
+    s->ndirty--;
+}
+
+// Recycles the retired blocks that no reader can reach any more.
+static void reclaim_retired(Shard *s) {
+    uint64_t e = epoch_advance();
+    CacheBlock **pp = &s->retired;
+    while (*pp) {
+        CacheBlock *b = *pp;
+        if (b->retire_epoch + 2 <= e) {
+            *pp = b->retire_next;
+            s->nretired--;
+            b->retire_next = s->free_blocks;
+            s->free_blocks = b;
+        } else {
+            pp = &b->retire_next;
+        }
+    }
+}
+
+// Admission (TinyLFU). With a sketch, a block that takes the place of
+// another only joins the policy if it has been accessed more often than
+// the block the policy would evict next. Otherwise it goes on probation:
+// it stays cached for the access that loaded it, outside the policy, and
+// is the first to go. A one-pass scan then cycles through a few frames
+// rather than flush the working set. Shard lock held for all of these.
+static bool admit(Shard *s, uint64_t key) {
+    PolicyNode *cold;
+    if (!policy_coldest(s->policy, &cold, 1)) return true;
+    return sketch_estimate(pool.sketch, key) > sketch_estimate(pool.sketch, cold->key);
 }
 
-static CacheBlock* find_block(Lab2File *f, off_t block_num) {
-    unsigned i = hash_off(block_num);
-    CacheBlock *b = f->hash_table[i];
-    while (b) {
-        if (b->block_number == block_num) return b;
-        b = b->next_hash;
+static void probation_push(Shard *s, CacheBlock *b) {
+    PolicyNode *n = &b->node, *head = &s->probation.head;
+    atomic_store_explicit(&n->accessed, 0, memory_order_relaxed);
+    n->prev = head;
+    n->next = head->next;
+    head->next->prev = n;
+    head->next = n;
+    s->probation.size++;
+    b->state |= BLOCK_PROBATION;
+}
+
+static void probation_remove(Shard *s, CacheBlock *b) {
+    PolicyNode *n = &b->node;
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->prev = n->next = NULL;
+    s->probation.size--;
+    b->state &= ~BLOCK_PROBATION;
+}
+
+// A block on probation that is accessed again joins the policy once it
+// passes admission.
+static void probation_hit(Shard *s, CacheBlock *b) {
+    if (!admit(s, b->node.key)) return;
+    probation_remove(s, b);
+    policy_insert(s->policy, &b->node);
+}
+
+// The oldest unpinned block on probation, detached. Blocks that lock-free
+// readers touched meanwhile get a second chance at admission first.
+static PolicyNode *probation_victim(Shard *s) {
+    PolicyNode *head = &s->probation.head, *n = head->prev;
+    while (n != head) {
+        CacheBlock *b = block_of(n);
+        PolicyNode *prev = n->prev;
+        if (b->refs) {
+            n = prev;
+            continue;
+        }
+        if (atomic_load_explicit(&n->accessed, memory_order_relaxed) && admit(s, n->key)) {
+            probation_remove(s, b);
+            policy_insert(s->policy, n);
+            n = prev;
+            continue;
+        }
+        probation_remove(s, b);
+        return n;
     }
     return NULL;
 }
 
-static CacheBlock* load_block(Lab2File *f, off_t block_num) {
-    if (f->cache_count >= CACHE_CAPACITY) {
-        CacheBlock *victim = evict_block(f);
-        if (victim) {
-            free(victim->data);
-            free(victim);
+// Removes a block that nobody references. Shard lock held. Lock-free
+// readers may still hold a pointer to it, so it is retired rather than
+// freed: its odd sequence number makes every such reader retry.
+static void drop_block(Shard *s, CacheBlock *b) {
+    mark_clean(s, b);
+    remove_from_hash(s, b);
+    unlink_from_file(s, b);
+    if (b->state & BLOCK_PROBATION) probation_remove(s, b);
+    else if (!(b->state & BLOCK_EVICTING)) policy_remove(s->policy, &b->node);
+    s->count--;
+    seq_write_begin(b);
+    b->retire_epoch = atomic_load(&global_epoch);
+    b->retire_next = s->retired;
+    s->retired = b;
+    if (++s->nretired >= RETIRE_BATCH) reclaim_retired(s);
+}
+
+// Copies a clean victim into the spill file with the shard unlocked.
+// Returns false if the block got dirtied or pinned meanwhile, so that it
+// has to stay; a full or failing spill file just does without it.
+static bool spill_victim(Shard *s, CacheBlock *b) {
+    uint32_t slot;
+    if (!spill_reserve(s->spill, &slot)) return true;
+    struct iovec iov = { b->data, pool.block_size };
+    IoRequest r = { s->spill->fd, IO_WRITE, spill_offset(s->spill, slot), &iov, 1, 0 };
+    b->state |= BLOCK_WRITEBACK;
+    b->refs++;
+    pthread_mutex_unlock(&s->lock);
+    io_run(&r, 1);
+    pthread_mutex_lock(&s->lock);
+    b->refs--;
+    b->state &= ~BLOCK_WRITEBACK;
+    pthread_cond_broadcast(&s->io_done);
+    bool stays = b->dirty || b->refs;
+    if (stays || r.result != (ssize_t)pool.block_size) {
+        spill_release(s->spill, slot);
+        return !stays;
+    }
+    spill_commit(s->spill, slot, b->node.key);
+    stats_add(b->file->slot, STAT_SPILL_STORES, 1);
+    return true;
+}
+
+// Compresses a clean victim for the tier with the shard unlocked, and
+// stores it once relocked. Returns false if the block got dirtied or
+// pinned meanwhile, so that it has to stay.
+static bool tier_victim(Shard *s, CacheBlock *b) {
+    const uint8_t *packed;
+    b->state |= BLOCK_WRITEBACK;
+    b->refs++;
+    pthread_mutex_unlock(&s->lock);
+    size_t len = tier_compress(s->tier, b->data, &packed);
+    pthread_mutex_lock(&s->lock);
+    b->refs--;
+    b->state &= ~BLOCK_WRITEBACK;
+    pthread_cond_broadcast(&s->io_done);
+    if (b->dirty || b->refs) return false;
+    if (len) {
+        tier_insert(s->tier, b->node.key, packed, len);
+        stats_add(b->file->slot, STAT_TIER_STORES, 1);
+        stats_add(b->file->slot, STAT_TIER_BYTES, len);
+    }
+    return true;
+}
+
+// Frees one frame of the shard. Returns 1 once it made progress, 0 if
+// every block is pinned, and -1 if the write-back of a dirty victim
+// failed. A dirty victim is written back with the shard unlocked, and so
+// are the copies of one for the spill file and the tier; it stays in the
+// index meanwhile, and is handed back to the policy if it gets dirtied or
+// pinned again before the work completes, or if its write failed.
+static int evict_one(Shard *s, uint64_t incoming) {
+    PolicyNode *n = probation_victim(s);
+    if (!n) n = policy_victim(s->policy, incoming);
+    if (!n) return 0;
+
+    CacheBlock *b = block_of(n);
+    uint64_t wrote = 0;
+    int err = 0;
+    b->state |= BLOCK_EVICTING;
+    if (b->dirty) {
+        // What the flusher is there to avoid: a miss waiting for a write.
+        // The clean reserve ran out, so get the flusher going.
+        flusher_kick();
+        mark_clean(s, b);
+        b->state |= BLOCK_WRITEBACK;
+        b->refs++;
+        pthread_mutex_unlock(&s->lock);
+        uint64_t t0 = now_ns();
+        err = write_block(b, STAT_WB_FOREGROUND);
+        wrote = now_ns() - t0;
+        stats_latency(LAB2_LAT_EVICT_WRITE, wrote);
+        pthread_mutex_lock(&s->lock);
+        b->refs--;
+        b->state &= ~BLOCK_WRITEBACK;
+        if (err) mark_dirty(s, b);
+        pthread_cond_broadcast(&s->io_done);
+    }
+    if (b->dirty || b->refs || (s->spill && !spill_victim(s, b)) ||
+        (s->tier && !tier_victim(s, b))) {
+        b->state &= ~BLOCK_EVICTING;
+        policy_insert(s->policy, &b->node);
+        return err ? -1 : 1;
+    }
+    stats_add(b->file->slot, STAT_EVICTIONS, 1);
+    TRACE3(evict, b->file->slot, b->block_number, wrote);
+    drop_block(s, b);
+    pthread_cond_broadcast(&s->io_done);
+    return 1;
+}
+
+// Looks up (f, block_num) and inserts a new block on a miss. Returns true
+// if the block was resident. A new block is LOADING and pinned when
+// `loading` is set; with `restore` as well, one the compressed tier holds
+// is restored on the spot and counts as resident, and one the spill file
+// holds gets its spill_slot to be read from there. Without `wait` a miss
+// that would overfill the shard or wait for a frame gives up and sets *bp
+// to NULL. So does one that could not write back dirty victims, with errno
+// set to EIO. Shard lock held.
+static bool lookup_or_insert(Shard *s, uint64_t hash, Lab2File *f, off_t block_num,
+                             bool loading, bool restore, bool wait, CacheBlock **bp) {
+    uint64_t key = block_key(f, block_num);
+    CacheBlock *b;
+    bool full = false;
+    int failed = 0;
+
+    *bp = NULL;
+    for (;;) {
+        b = lookup(s, hash, f, block_num);
+        if (b) {
+            *bp = b;
+            return true;
         }
+        if (s->count >= s->capacity) {
+            full = true;
+            int ret = evict_one(s, key);
+            if (ret > 0 || (ret < 0 && ++failed < MISS_WB_RETRIES)) continue;
+            if (ret < 0) {
+                errno = EIO;
+                return false;
+            }
+            if (!wait) return false;
+        }
+        if (!s->free_blocks && s->retired) reclaim_retired(s);
+        if (s->free_blocks) break;
+        if (!wait) return false;
+        // Every spare frame is retired (or pinned over capacity) and a
+        // reader is holding the epoch back; it will not take long.
+        pthread_mutex_unlock(&s->lock);
+        sched_yield();
+        pthread_mutex_lock(&s->lock);
     }
-    CacheBlock *b = malloc(sizeof(CacheBlock));
-    posix_memalign((void**)&b->data, BLOCK_SIZE, BLOCK_SIZE);
+
+    b = s->free_blocks;
+    s->free_blocks = b->retire_next;
+    b->file = f;
     b->block_number = block_num;
     b->dirty = false;
-    b->next_hash = NULL;
-    {
-        off_t off = block_num * BLOCK_SIZE;
-        ssize_t r = pread(f->fd, b->data, BLOCK_SIZE, off);
-        if (r < 0) memset(b->data, 0, BLOCK_SIZE);
-        else if (r < BLOCK_SIZE) memset(b->data + r, 0, BLOCK_SIZE - r);
-    }
-    {
-        unsigned i = hash_off(block_num);
-        b->next_hash = f->hash_table[i];
-        f->hash_table[i] = b;
-    }
-    f->cache_count++;
+    b->spill_slot = 0;
+    b->state = loading ? BLOCK_LOADING : 0;
+    b->refs = loading ? 1 : 0;
+    atomic_store_explicit(&b->origin, ORIGIN_DEMAND, memory_order_relaxed);
+    insert_into_hash(s, hash, b);
+    CacheBlock **head = &f->blocks[shard_index(s)];
+    b->file_prev = NULL;
+    b->file_next = *head;
+    if (*head) (*head)->file_prev = b;
+    *head = b;
+    b->node.key = key;
+    if (full && pool.sketch && !admit(s, key)) probation_push(s, b);
+    else policy_insert(s->policy, &b->node);
+    s->count++;
+    *bp = b;
+    // The tiers give the block up either way, since the frame is about to
+    // be filled or overwritten.
+    restore = restore && loading;
+    uint32_t slot;
+    bool spilled = s->spill && spill_take(s->spill, key, &slot);
+    if (s->tier && tier_take(s->tier, key, restore ? b->data : NULL) && restore) {
+        if (spilled) spill_release(s->spill, slot);
+        b->state &= ~BLOCK_LOADING;
+        b->refs = 0;
+        seq_write_end(b);
+        atomic_store_explicit(&b->origin, ORIGIN_TIER, memory_order_relaxed);
+        return true;
+    }
+    if (spilled && restore) b->spill_slot = slot + 1;
+    else if (spilled) spill_release(s->spill, slot);
+    return false;
+}
+
+// Publishes a block whose read has completed. Shard lock held.
+static void finish_load(Shard *s, CacheBlock *b) {
+    if (b->spill_slot) {
+        spill_release(s->spill, b->spill_slot - 1);
+        b->spill_slot = 0;
+    }
+    b->state &= ~BLOCK_LOADING;
+    b->refs--;
+    seq_write_end(b);
+    pthread_cond_broadcast(&s->io_done);
+}
+
+// Counts an access that found the block resident. The first access to a
+// block that was loaded ahead of it is a readahead hit, or, if it was
+// loaded along with a miss of the same call or restored from the tier, part
+// of a miss. Accesses count towards the handle that made them.
+static void count_hit(Lab2Handle *h, CacheBlock *b) {
+    uint8_t origin = atomic_load_explicit(&b->origin, memory_order_relaxed);
+    if (origin) origin = atomic_exchange_explicit(&b->origin, ORIGIN_DEMAND, memory_order_relaxed);
+    if (origin == ORIGIN_BATCH || origin == ORIGIN_TIER) {
+        stats_add(h->slot, STAT_MISSES, 1);
+        if (origin == ORIGIN_TIER) stats_add(h->slot, STAT_TIER_HITS, 1);
+        return;
+    }
+    stats_add(h->slot, STAT_HITS, 1);
+    TRACE2(hit, h->file->slot, b->block_number);
+    if (origin == ORIGIN_READAHEAD) stats_add(h->slot, STAT_READAHEAD_HITS, 1);
+    if (origin == ORIGIN_WARM) stats_add(h->slot, STAT_WARM_HITS, 1);
+}
+
+// Returns the block for (f, block_num) with its shard locked; the caller
+// copies data in or out and unlocks *sp. With `fill` a miss reads the block
+// from disk, otherwise the caller must overwrite the whole frame. Returns
+// NULL with errno set, and no lock held, if a miss found no frame.
+static CacheBlock *acquire_block(Lab2Handle *h, off_t block_num, bool fill, Shard **sp) {
+    Lab2File *f = h->file;
+    uint64_t hash = mix64(block_key(f, block_num));
+    Shard *s = shard_of(hash);
+    CacheBlock *b;
+
+    pthread_mutex_lock(&s->lock);
+    if (lookup_or_insert(s, hash, f, block_num, fill, true, true, &b)) {
+        if (b->state & BLOCK_LOADING) {
+            b->refs++;
+            while (b->state & BLOCK_LOADING) pthread_cond_wait(&s->io_done, &s->lock);
+            b->refs--;
+        }
+        if (b->state & BLOCK_PROBATION) probation_hit(s, b);
+        else if (!(b->state & BLOCK_EVICTING)) policy_hit(s->policy, &b->node);
+        count_hit(h, b);
+    } else if (!b) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    } else if (fill) {
+        stats_add(h->slot, STAT_MISSES, 1);
+        pthread_mutex_unlock(&s->lock);
+        uint64_t t0 = now_ns();
+        read_blocks(&b, 1);
+        uint64_t ns = now_ns() - t0;
+        stats_latency(LAB2_LAT_MISS, ns);
+        TRACE4(miss, f->slot, block_num, 1, ns);
+        pthread_mutex_lock(&s->lock);
+        finish_load(s, b);
+    } else {
+        stats_add(h->slot, STAT_MISSES, 1);
+    }
+    *sp = s;
     return b;
 }
 
-static Lab2File* get_file(int idx) {
-    if (idx < 0 || idx >= 256) return NULL;
-    return files[idx];
+// Hit path without locks: copies part of a resident block if no writer,
+// load or eviction interferes, and returns false otherwise so that the
+// caller falls back to acquire_block(). The hit reaches the policy through
+// policy_touch().
+static bool read_optimistic(Lab2Handle *h, off_t block_num, size_t off, void *dst, size_t len) {
+    EpochRecord *r = epoch_record();
+    if (!r) return false;
+    Lab2File *f = h->file;
+    uint64_t hash = mix64(block_key(f, block_num));
+    Shard *s = shard_of(hash);
+    bool ok = false;
+
+    epoch_enter(r);
+    CacheBlock *b = lookup(s, hash, f, block_num);
+    if (b) {
+        uint32_t seq = atomic_load_explicit(&b->seq, memory_order_acquire);
+        if (!(seq & 1)) {
+            memcpy(dst, b->data + off, len);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&b->seq, memory_order_relaxed) == seq) {
+                policy_touch(&b->node);
+                count_hit(h, b);
+                ok = true;
+            }
+        }
+    }
+    epoch_exit(r);
+    return ok;
+}
+
+// Frames are written to disk without the shard lock, so they must not be
+// modified meanwhile. The reference keeps an evicting write-back from
+// dropping the block under us. Shard lock held.
+static void wait_writeback(Shard *s, CacheBlock *b) {
+    if (!(b->state & BLOCK_WRITEBACK)) return;
+    b->refs++;
+    while (b->state & BLOCK_WRITEBACK) pthread_cond_wait(&s->io_done, &s->lock);
+    b->refs--;
 }
 
-int lab2_open(const char *path) {
-    static bool seed_initialized = false;
-    if (!seed_initialized) {
-        srand(time(NULL));
-        seed_initialized = true;
+// Loads the missing blocks of the ranges, which must be in increasing
+// order. Blocks that are already resident split the ranges into runs, and
+// up to RA_RUNS runs go to the I/O backend as one batch. A shard without a
+// free frame ends the request, since readahead must never wait for or
+// overfill the cache. Without `evict` blocks of a full shard are skipped
+// rather than take the place of others.
+static void prefetch_ranges(Lab2File *f, const BlockRange *r, size_t nr, uint8_t origin,
+                            bool evict) {
+    size_t ri = 0;
+    off_t bn = nr ? r[0].start : 0;
+    bool stop = false;
+    while (ri < nr && !stop) {
+        CacheBlock *blocks[RA_RUNS * RA_BATCH];
+        struct iovec iov[RA_RUNS * RA_BATCH];
+        IoRequest reqs[RA_RUNS];
+        size_t first[RA_RUNS], len[RA_RUNS];
+        size_t nruns = 0, nblocks = 0;
+
+        while (ri < nr && nruns < RA_RUNS && !stop) {
+            off_t end = r[ri].start + (off_t)r[ri].count;
+            if (bn >= end) {
+                if (++ri < nr) bn = r[ri].start;
+                continue;
+            }
+            size_t n = 0;
+            for (; bn < end && n < RA_BATCH; bn++) {
+                uint64_t hash = mix64(block_key(f, bn));
+                Shard *s = shard_of(hash);
+                CacheBlock *b;
+                pthread_mutex_lock(&s->lock);
+                if (!evict && s->count >= s->capacity) {
+                    pthread_mutex_unlock(&s->lock);
+                    bn++;
+                    break;
+                }
+                // Once a run is going to disk, its blocks in the tiers
+                // cost nothing to read along with it.
+                bool resident = lookup_or_insert(s, hash, f, bn, true, n == 0, false, &b);
+                if (b && !resident) atomic_store_explicit(&b->origin, origin, memory_order_relaxed);
+                pthread_mutex_unlock(&s->lock);
+                if (!b) {
+                    stop = true;
+                    break;
+                }
+                if (resident) {
+                    bn++;
+                    break;
+                }
+                blocks[nblocks + n++] = b;
+                // A block from the spill file is a run of its own.
+                if (b->spill_slot) {
+                    bn++;
+                    break;
+                }
+            }
+            if (!n) continue;
+            prep_read(&reqs[nruns], &iov[nblocks], &blocks[nblocks], n);
+            first[nruns] = nblocks;
+            len[nruns++] = n;
+            nblocks += n;
+        }
+
+        load_blocks(f, reqs, nruns);
+        for (size_t i = 0; i < nruns; i++) complete_read(&reqs[i], &blocks[first[i]], len[i]);
+        for (size_t i = 0; i < nblocks; i++) {
+            Shard *s = shard_of(mix64(blocks[i]->node.key));
+            pthread_mutex_lock(&s->lock);
+            finish_load(s, blocks[i]);
+            pthread_mutex_unlock(&s->lock);
+        }
     }
+}
 
-    int real_fd = open(path, O_CREAT | O_RDWR | O_DIRECT, 0666);
-    if (real_fd < 0) return -1;
-    Lab2File *lf = malloc(sizeof(Lab2File));
-    memset(lf, 0, sizeof(Lab2File));
-    lf->fd = real_fd;
-    lf->offset = 0;
-    lf->cache_count = 0;
-    memset(lf->hash_table, 0, sizeof(lf->hash_table));
-    lf->file_size = lseek(real_fd, 0, SEEK_END);
-    files[file_index] = lf;
-    file_index++;
-    return file_index - 1;
+static void prefetch(Lab2File *f, off_t start, size_t count, uint8_t origin) {
+    BlockRange r = { start, count };
+    prefetch_ranges(f, &r, 1, origin, true);
 }
 
-int lab2_close(int fd) {
-    Lab2File *f = get_file(fd);
-    if (!f) return -1;
+// Loads the next chunk of the file's warm-start blocks into free frames,
+// or frees the list and returns false once it is done. ra_lock held; it is
+// dropped while loading.
+static bool warm_step(Lab2File *f) {
+    if (f->warm_next == f->warm_count) {
+        free(f->warm);
+        f->warm = NULL;
+        f->warm_count = f->warm_next = 0;
+        return false;
+    }
+    const uint64_t *e = f->warm + f->warm_next;
+    size_t n = f->warm_count - f->warm_next;
+    if (n > WARM_CHUNK) n = WARM_CHUNK;
+    f->warm_next += n;
+    pthread_mutex_unlock(&ra_lock);
+
+    BlockRange r[WARM_CHUNK];
+    size_t nr = 0;
+    for (size_t i = 0; i < n; i++) {
+        off_t bn = (off_t)e[i];
+        if (nr && bn < r[nr - 1].start + (off_t)r[nr - 1].count) continue;
+        if (nr && bn == r[nr - 1].start + (off_t)r[nr - 1].count) r[nr - 1].count++;
+        else r[nr++] = (BlockRange){ bn, 1 };
+    }
+    TRACE3(readahead, f->slot, r[0].start, n);
+    prefetch_ranges(f, r, nr, ORIGIN_WARM, false);
+    pthread_mutex_lock(&ra_lock);
+    return true;
+}
+
+// ra_lock held.
+static bool ra_push(RaRequest r) {
+    if (!ra_started || ra_len == RA_QUEUE) return false;
+    ra_queue[(ra_head + ra_len++) % RA_QUEUE] = r;
+    pthread_cond_signal(&ra_work);
+    return true;
+}
+
+static void *ra_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&ra_lock);
     for (;;) {
-        CacheBlock *b = f->hash_table[0];
-        if (!b) break;
-        if (b->dirty) {
-            off_t off = b->block_number * BLOCK_SIZE;
-            pwrite(f->fd, b->data, BLOCK_SIZE, off);
+        while (!ra_len) pthread_cond_wait(&ra_work, &ra_lock);
+        RaRequest r = ra_queue[ra_head];
+        ra_head = (ra_head + 1) % RA_QUEUE;
+        ra_len--;
+        if (r.warm) {
+            // Readers' requests go first between chunks. With the queue
+            // full the worker keeps at it instead.
+            bool more = warm_step(r.file);
+            if (more && ra_push(r)) continue;
+            while (more) more = warm_step(r.file);
+        } else {
+            pthread_mutex_unlock(&ra_lock);
+            TRACE3(readahead, r.file->slot, r.start, r.count);
+            prefetch(r.file, r.start, r.count, ORIGIN_READAHEAD);
+            pthread_mutex_lock(&ra_lock);
         }
-        remove_from_hash(f, b);
-        free(b->data);
-        free(b);
+        r.file->ra_inflight--;
+        pthread_cond_broadcast(&ra_done);
     }
-    close(f->fd);
-    free(f);
-    files[fd] = NULL;
-    return 0;
+    return NULL;
 }
 
-ssize_t lab2_read(int fd, void *buf, size_t count) {
-    Lab2File *f = get_file(fd);
-    if (!f) return -1;
+// Starts the workers with the first request. ra_lock held.
+static void ra_start(void) {
+    if (ra_started) return;
+    for (int i = 0; i < RA_WORKERS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, ra_worker, NULL) == 0) {
+            pthread_detach(tid);
+            ra_started = true;
+        }
+    }
+}
 
-    if (f->offset >= f->file_size) {
-        return 0;
+// Queues a readahead request. A full queue drops the request, the reader
+// then simply misses.
+static bool ra_submit(Lab2File *f, off_t start, size_t count) {
+    pthread_mutex_lock(&ra_lock);
+    ra_start();
+    bool ok = ra_push((RaRequest){ f, start, count, false });
+    if (ok) f->ra_inflight++;
+    pthread_mutex_unlock(&ra_lock);
+    return ok;
+}
+
+// Hands a warm-start list to the workers, which free it. A file loads
+// one manifest at a time.
+static int warm_submit(Lab2File *f, uint64_t *blocks, size_t n) {
+    int err = 0;
+    pthread_mutex_lock(&ra_lock);
+    ra_start();
+    if (f->warm) {
+        errno = EBUSY;
+        err = -1;
+    } else if (!ra_push((RaRequest){ f, 0, 0, true })) {
+        errno = EAGAIN;
+        err = -1;
+    } else {
+        f->warm = blocks;
+        f->warm_count = n;
+        f->warm_next = 0;
+        f->ra_inflight++;
     }
+    pthread_mutex_unlock(&ra_lock);
+    if (err) free(blocks);
+    return err;
+}
 
-    if (f->offset + count > f->file_size) {
-        count = f->file_size - f->offset;
+// Drops the queued requests of a file and waits for the running ones. A
+// warm-start list that a worker is loading is cut short.
+static void ra_cancel(Lab2File *f) {
+    pthread_mutex_lock(&ra_lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < ra_len; i++) {
+        RaRequest r = ra_queue[(ra_head + i) % RA_QUEUE];
+        if (r.file != f) {
+            ra_queue[(ra_head + kept++) % RA_QUEUE] = r;
+            continue;
+        }
+        if (r.warm) {
+            f->warm_next = f->warm_count;
+            warm_step(f); // frees the list
+        }
+        f->ra_inflight--;
     }
+    ra_len = kept;
+    f->warm_next = f->warm_count;
+    while (f->ra_inflight) pthread_cond_wait(&ra_done, &ra_lock);
+    pthread_mutex_unlock(&ra_lock);
+}
 
-    size_t total = 0;
-    char *p = buf;
-    while (count > 0) {
-        off_t bn = f->offset / BLOCK_SIZE;
-        size_t off = f->offset % BLOCK_SIZE;
-        size_t can_read = BLOCK_SIZE - off;
-        if (can_read > count) {
-            can_read = count;
+// Called once per read with the range of blocks it covers: a read that
+// starts where the previous one ended (or in its last block) keeps the
+// stream going, anything else closes the window. Returns whether the window
+// is open, in which case the reader calls ra_advance() for every block.
+// Positional readers may share a handle; a read that finds another one
+// updating the stream leaves it alone rather than queue up behind it.
+static bool ra_update(Lab2Handle *h, off_t first, off_t last) {
+    if (!h->ra_max || pthread_mutex_trylock(&h->stream_lock)) return false;
+    if (first == h->ra_next || first + 1 == h->ra_next) {
+        if (!h->ra_window) h->ra_window = RA_MIN_BLOCKS < h->ra_max ? RA_MIN_BLOCKS : h->ra_max;
+    } else {
+        h->ra_window = 0;
+        h->ra_end = 0;
+    }
+    h->ra_next = last + 1;
+    bool open = h->ra_window != 0;
+    pthread_mutex_unlock(&h->stream_lock);
+    return open;
+}
+
+// Keeps the window ahead of a sequential reader that is at block bn: once
+// less than half of it is left, the rest is queued and the window grows.
+// `limit` is the first block past the end of the file. stream_lock held.
+static void ra_refill(Lab2Handle *h, off_t bn, off_t limit) {
+    if (!h->ra_window) return;
+    if (h->ra_end <= bn) h->ra_end = bn + 1;
+    if (h->ra_end - bn > (off_t)(h->ra_window / 2)) return;
+    off_t to = bn + 1 + (off_t)h->ra_window;
+    if (to > limit) to = limit;
+    if (to > h->ra_end && !ra_submit(h->file, h->ra_end, to - h->ra_end)) return;
+    if (to > h->ra_end) h->ra_end = to;
+    h->ra_window = 2 * h->ra_window < h->ra_max ? 2 * h->ra_window : h->ra_max;
+}
+
+static void ra_advance(Lab2Handle *h, off_t bn, off_t limit) {
+    pthread_mutex_lock(&h->stream_lock);
+    ra_refill(h, bn, limit);
+    pthread_mutex_unlock(&h->stream_lock);
+}
+
+// Marks a dirty block clean and pins it for write_back(). Shard lock held.
+static void start_writeback(Shard *s, CacheBlock *b) {
+    mark_clean(s, b);
+    b->state |= BLOCK_WRITEBACK;
+    b->refs++;
+}
+
+static int cmp_block_pos(const void *a, const void *b) {
+    const CacheBlock *x = *(CacheBlock *const *)a, *y = *(CacheBlock *const *)b;
+    if (x->file->id != y->file->id) return x->file->id < y->file->id ? -1 : 1;
+    return (x->block_number > y->block_number) - (x->block_number < y->block_number);
+}
+
+// Writes blocks taken with start_writeback() and releases them. The batch
+// is sorted by file and position, and every contiguous run of up to
+// WB_BATCH blocks becomes one vectored write. Blocks whose write failed are
+// dirty again. `kind` is the write-back counter the blocks count towards.
+// No lock held.
+static int write_back(CacheBlock **batch, size_t n, int kind) {
+    IoRequest reqs[WB_BATCH];
+    struct iovec iov[WB_BATCH];
+    int err = 0;
+
+    if (!n) return 0;
+
+    qsort(batch, n, sizeof(CacheBlock *), cmp_block_pos);
+    for (size_t done = 0; done < n;) {
+        size_t k = n - done < WB_BATCH ? n - done : WB_BATCH;
+        size_t nreq = 0;
+        for (size_t i = 0; i < k; i++) {
+            CacheBlock *b = batch[done + i];
+            CacheBlock *prev = i ? batch[done + i - 1] : NULL;
+            stats_add(b->file->slot, kind, 1);
+            iov[i].iov_base = b->data;
+            iov[i].iov_len = pool.block_size;
+            if (prev && prev->file == b->file && prev->block_number + 1 == b->block_number) {
+                reqs[nreq - 1].iovcnt++;
+                continue;
+            }
+            reqs[nreq++] = (IoRequest){ b->file->fd, IO_WRITE,
+                                        b->block_number * (off_t)pool.block_size, &iov[i], 1, 0 };
         }
-        CacheBlock *b = find_block(f, bn);
-        if (!b) {
-            b = load_block(f, bn);
+        uint64_t t0 = now_ns();
+        io_run(reqs, nreq);
+        uint64_t ns = now_ns() - t0;
+        stats_latency(LAB2_LAT_WRITEBACK, ns);
+        TRACE3(writeback, k, nreq, ns);
+
+        size_t i = 0;
+        for (size_t r = 0; r < nreq; r++) {
+            bool ok = reqs[r].result == (ssize_t)(reqs[r].iovcnt * pool.block_size);
+            if (!ok) err = reqs[r].result < 0 ? (int)-reqs[r].result : EIO;
+            int slot = batch[done + i]->file->slot;
+            stats_add(slot, STAT_WB_REQUESTS, 1);
+            if (reqs[r].result > 0) stats_add(slot, STAT_DISK_WRITE, reqs[r].result);
+            for (int j = 0; j < reqs[r].iovcnt; j++, i++) {
+                CacheBlock *b = batch[done + i];
+                Shard *s = shard_of(mix64(b->node.key));
+                pthread_mutex_lock(&s->lock);
+                b->state &= ~BLOCK_WRITEBACK;
+                b->refs--;
+                if (!ok) mark_dirty(s, b);
+                pthread_cond_broadcast(&s->io_done);
+                pthread_mutex_unlock(&s->lock);
+            }
         }
-        memcpy(p, b->data + off, can_read);
-        total += can_read;
-        p += can_read;
-        f->offset += can_read;
-        count -= can_read;
+        done += k;
     }
-    return total;
+    if (!err) return 0;
+    errno = err;
+    return -1;
 }
 
-ssize_t lab2_write(int fd, const void *buf, size_t count) {
-    Lab2File *f = get_file(fd);
-    if (!f) return -1;
-    size_t total = 0;
-    const char *p = buf;
-    while (count > 0) {
-        off_t bn = f->offset / BLOCK_SIZE;
-        size_t off = f->offset % BLOCK_SIZE;
-        size_t can_write = BLOCK_SIZE - off;
-        if (can_write > count) can_write = count;
-        CacheBlock *b = find_block(f, bn);
-        if (!b) {
-            if (off != 0 || can_write < BLOCK_SIZE) b = load_block(f, bn);
-            else {
-                if (f->cache_count >= CACHE_CAPACITY) {
-                    CacheBlock *victim = evict_block(f);
-                    if (victim) {
-                        free(victim->data);
-                        free(victim);
-                    }
-                }
-                b = malloc(sizeof(CacheBlock));
-                posix_memalign((void**)&b->data, BLOCK_SIZE, BLOCK_SIZE);
-                memset(b->data, 0, BLOCK_SIZE);
-                b->block_number = bn;
-                b->dirty = false;
-                b->next_hash = NULL;
-                {
-                    unsigned i = hash_off(bn);
-                    b->next_hash = f->hash_table[i];
-                    f->hash_table[i] = b;
-                }
-                f->cache_count++;
+// Writes back every dirty block of the file. Blocks are pinned and marked
+// clean under their shard lock, then written in batches without holding
+// any lock.
+static int flush_file(Lab2File *f) {
+    CacheBlock **batch = NULL;
+    size_t n = 0, cap = 0;
+    int err = 0;
+
+    for (size_t i = 0; i < pool.nshards; i++) {
+        Shard *s = &pool.shards[i];
+        pthread_mutex_lock(&s->lock);
+    rescan:
+        for (CacheBlock *b = f->blocks[i]; b; b = b->file_next) {
+            if (b->state & BLOCK_WRITEBACK) {
+                pthread_cond_wait(&s->io_done, &s->lock);
+                goto rescan;
             }
         }
-        memcpy(b->data + off, p, can_write);
-        b->dirty = true;
-        total += can_write;
-        p += can_write;
-        f->offset += can_write;
-        if (f->offset > f->file_size) f->file_size = f->offset;
-        count -= can_write;
-        if (f->cache_count > CACHE_CAPACITY) {
-            CacheBlock *victim = evict_block(f);
-            if (victim) {
-                free(victim->data);
-                free(victim);
+        for (CacheBlock *b = f->blocks[i]; b; b = b->file_next) {
+            if (!b->dirty || b->writers) continue;
+            if (n == cap) {
+                size_t ncap = cap ? 2 * cap : 64;
+                CacheBlock **grown = realloc(batch, ncap * sizeof(CacheBlock *));
+                if (!grown) {
+                    err = ENOMEM;
+                    break;
+                }
+                batch = grown;
+                cap = ncap;
             }
+            start_writeback(s, b);
+            batch[n++] = b;
         }
+        pthread_mutex_unlock(&s->lock);
     }
-    return total;
+
+    if (write_back(batch, n, STAT_WB_SYNC) < 0 && !err) err = errno;
+    free(batch);
+    if (!err) return 0;
+    errno = err;
+    return -1;
 }
 
-off_t lab2_lseek(int fd, off_t offset, int whence) {
-    Lab2File *f = get_file(fd);
-    if (!f) return -1;
-    off_t new_off;
-    if (whence == SEEK_SET) new_off = offset;
-    else if (whence == SEEK_CUR) new_off = f->offset + offset;
-    else if (whence == SEEK_END) new_off = f->file_size + offset;
-    else return -1;
-    if (new_off < 0) return -1;
-    f->offset = new_off;
-    return f->offset;
+// Picks the blocks the flusher should write from one shard, at most `max`.
+// Returning `max` means the shard may have more.
+static size_t collect_dirty(Shard *s, CacheBlock **batch, size_t max) {
+    PolicyNode *cold[FLUSH_BATCH];
+    size_t n = 0;
+
+    pthread_mutex_lock(&s->lock);
+    uint64_t now = now_ms();
+    size_t k = s->clean_reserve < max ? s->clean_reserve : max;
+    k = policy_coldest(s->policy, cold, k);
+    for (size_t i = 0; i < k; i++) {
+        CacheBlock *b = block_of(cold[i]);
+        if (b->dirty && !(b->state & BLOCK_WRITEBACK) && !b->writers) {
+            start_writeback(s, b);
+            batch[n++] = b;
+        }
+    }
+    // Once over the limit, go down to half of it so that writers do not
+    // kick the flusher for every block they dirty.
+    size_t target = s->ndirty > s->dirty_limit ? s->dirty_limit / 2 : s->dirty_limit;
+    CacheBlock *b = s->dirty_head;
+    while (b && n < max && (s->ndirty > target || now - b->dirty_since >= pool.dirty_expire_ms)) {
+        CacheBlock *next = b->dirty_next;
+        if (!(b->state & BLOCK_WRITEBACK) && !b->writers) {
+            start_writeback(s, b);
+            batch[n++] = b;
+        }
+        b = next;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return n;
 }
 
-int lab2_fsync(int fd) {
-    Lab2File *f = get_file(fd);
-    if (!f) return -1;
-    CacheBlock *b = f->hash_table[0];
-    while (b) {
-        if (b->dirty) {
-            off_t off = b->block_number * BLOCK_SIZE;
-            pwrite(f->fd, b->data, BLOCK_SIZE, off);
-            b->dirty = false;
+// Gathers candidates from every shard before writing, so that runs of a
+// file that are spread over shards by the hash still coalesce.
+static void flush_pool(void) {
+    CacheBlock *batch[FLUSH_BATCH];
+    size_t i = 0;
+    while (i < pool.nshards) {
+        size_t n = 0;
+        while (i < pool.nshards && n < FLUSH_BATCH) {
+            size_t room = FLUSH_BATCH - n;
+            size_t got = collect_dirty(&pool.shards[i], batch + n, room);
+            n += got;
+            if (got < room) i++;
         }
-        b = b->next_hash;
+        write_back(batch, n, STAT_WB_BACKGROUND);
+    }
+}
+
+// Block accesses that went through the cache so far.
+static uint64_t accesses(void) {
+    uint64_t c[NSTATS];
+    stats_sum(-1, c);
+    return c[STAT_HITS] + c[STAT_MISSES];
+}
+
+// Counters a handle keeps for itself; the rest belong to its file.
+static bool access_counter(int i) {
+    switch (i) {
+    case STAT_HITS:
+    case STAT_MISSES:
+    case STAT_READAHEAD_HITS:
+    case STAT_WARM_HITS:
+    case STAT_TIER_HITS:
+        return true;
+    }
+    return false;
+}
+
+static void handle_stats(const Lab2Handle *h, uint64_t c[NSTATS]) {
+    uint64_t fc[NSTATS];
+    stats_sum(h->slot, c);
+    stats_sum(h->file->slot, fc);
+    for (int i = 0; i < NSTATS; i++)
+        if (!access_counter(i)) c[i] = fc[i];
+}
+
+static void fill_stats(lab2_stats *st, const uint64_t c[NSTATS]) {
+    memset(st, 0, sizeof(*st));
+    st->hits = c[STAT_HITS];
+    st->misses = c[STAT_MISSES];
+    st->readahead_hits = c[STAT_READAHEAD_HITS];
+    st->warm_hits = c[STAT_WARM_HITS];
+    st->evictions = c[STAT_EVICTIONS];
+    st->tier_hits = c[STAT_TIER_HITS];
+    st->tier_stores = c[STAT_TIER_STORES];
+    st->tier_bytes = c[STAT_TIER_BYTES];
+    st->spill_hits = c[STAT_SPILL_HITS];
+    st->spill_stores = c[STAT_SPILL_STORES];
+    st->writeback_foreground = c[STAT_WB_FOREGROUND];
+    st->writeback_background = c[STAT_WB_BACKGROUND];
+    st->writeback_sync = c[STAT_WB_SYNC];
+    st->writeback_requests = c[STAT_WB_REQUESTS];
+    st->disk_read_bytes = c[STAT_DISK_READ];
+    st->disk_write_bytes = c[STAT_DISK_WRITE];
+    st->direct_read_bytes = c[STAT_DIRECT_READ];
+    st->direct_write_bytes = c[STAT_DIRECT_WRITE];
+}
+
+// One line of global counters on stderr. It reads the per-thread counters,
+// which takes no lock, and the curve estimate, whose lock is innermost.
+static void dump_stats(void) {
+    uint64_t c[NSTATS];
+    stats_sum(-1, c);
+    lab2_stats st;
+    fill_stats(&st, c);
+    unsigned long long lookups = st.hits + st.misses;
+    fprintf(stderr,
+            "lab2: hits %llu misses %llu (%.2f%% hit) readahead hits %llu warm hits %llu "
+            "evictions %llu tier hits %llu stores %llu (%llu bytes) spill hits %llu stores %llu write-backs %llu/%llu/%llu fg/bg/sync in %llu writes, "
+            "disk read %llu written %llu direct read %llu written %llu\n",
+            st.hits, st.misses, lookups ? 100.0 * st.hits / lookups : 0.0, st.readahead_hits,
+            st.warm_hits, st.evictions, st.tier_hits, st.tier_stores, st.tier_bytes,
+            st.spill_hits, st.spill_stores,
+            st.writeback_foreground, st.writeback_background,
+            st.writeback_sync, st.writeback_requests, st.disk_read_bytes, st.disk_write_bytes, st.direct_read_bytes,
+            st.direct_write_bytes);
+    // The estimated curve, as a step function, at a few multiples of the
+    // current size.
+    lab2_mrc_point curve[64];
+    size_t n = pool.ready ? mrc_curve(curve, 64, pool.block_size, accesses() - mrc_base) : 0;
+    if (n) {
+        static const double scale[] = { 0.5, 1, 2, 4 };
+        double at[4];
+        for (int k = 0; k < 4; k++) {
+            at[k] = 1.0;
+            for (size_t i = 0; i < n && curve[i].cache_blocks <= scale[k] * pool.capacity; i++)
+                at[k] = curve[i].miss_ratio;
+        }
+        fprintf(stderr, "lab2: estimated LRU miss ratio at 0.5x/1x/2x/4x the cache: "
+                        "%.2f%% %.2f%% %.2f%% %.2f%%\n",
+                100 * at[0], 100 * at[1], 100 * at[2], 100 * at[3]);
+    }
+    static const char *names[LAB2_LAT_OPS] = { "hit", "miss", "evict write", "write-back",
+                                               "direct read", "direct write" };
+    for (int op = 0; op < LAB2_LAT_OPS; op++) {
+        lab2_latency l;
+        stats_latency_get(op, &l);
+        if (!l.count) continue;
+        fprintf(stderr, "lab2: %s latency: %llu timed, mean %llu ns, p50 %llu p99 %llu p99.9 %llu max %llu\n",
+                names[op], l.count, l.mean_ns, l.p50_ns, l.p99_ns, l.p999_ns, l.max_ns);
+    }
+}
+
+static void *flusher(void *arg) {
+    (void)arg;
+    uint64_t last_dump = now_ms();
+    pthread_mutex_lock(&flusher_lock);
+    for (;;) {
+        if (!atomic_exchange(&flusher_kicked, false)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&flusher_wake, &flusher_lock, &ts);
+            atomic_store(&flusher_kicked, false);
+        }
+        if (pool.ready) flush_pool();
+        if (stats_interval_ms && now_ms() - last_dump >= stats_interval_ms) {
+            last_dump = now_ms();
+            dump_stats();
+        }
+    }
+    return NULL;
+}
+
+// Called by writers that push a shard over its dirty limit. A wakeup lost
+// to the race with the flusher going to sleep costs one interval.
+static void flusher_kick(void) {
+    if (!atomic_exchange_explicit(&flusher_kicked, true, memory_order_relaxed))
+        pthread_cond_signal(&flusher_wake);
+}
+
+static Lab2Handle *get_handle(int fd) {
+    if (fd < 0 || fd >= MAX_HANDLES) return NULL;
+    HandleChunk *c = atomic_load_explicit(&handles[fd / HANDLE_CHUNK], memory_order_acquire);
+    return c ? atomic_load_explicit(&c->h[fd % HANDLE_CHUNK], memory_order_acquire) : NULL;
+}
+
+static Lab2File *get_file(int fd) {
+    Lab2Handle *h = get_handle(fd);
+    return h ? h->file : NULL;
+}
+
+// Returns -1 once all `max` are taken.
+static int slot_get(SlotList *l) {
+    if (l->nfree) return l->free[--l->nfree];
+    return l->next < l->max ? l->next++ : -1;
+}
+
+// A slot that cannot be remembered is lost, which only matters after
+// millions of them.
+static void slot_put(SlotList *l, int slot) {
+    if (l->nfree == l->cap) {
+        size_t cap = l->cap ? 2 * l->cap : 64;
+        int *free = realloc(l->free, cap * sizeof(int));
+        if (!free) return;
+        l->free = free;
+        l->cap = cap;
+    }
+    l->free[l->nfree++] = slot;
+}
+
+static void update_size(Lab2File *f, off_t end) {
+    off_t cur = atomic_load_explicit(&f->file_size, memory_order_relaxed);
+    while (end > cur &&
+           !atomic_compare_exchange_weak_explicit(&f->file_size, &cur, end,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+static int parse_size(const char *s, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s) return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    if (*end) return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+
+static void load_env_defaults(void) {
+    const char *v;
+    size_t n;
+    if ((v = getenv("LAB2_BLOCK_SIZE")) && parse_size(v, &n) == 0) defaults.block_size = n;
+    if ((v = getenv("LAB2_CAPACITY")) && parse_size(v, &n) == 0) {
+        defaults.capacity_blocks = n;
+        defaults.capacity_bytes = 0;
+    }
+    if ((v = getenv("LAB2_CACHE_SIZE")) && parse_size(v, &n) == 0) {
+        defaults.capacity_bytes = n;
+        defaults.capacity_blocks = 0;
+    }
+    if ((v = getenv("LAB2_POLICY"))) policy_parse(v, &defaults.policy);
+    if ((v = getenv("LAB2_SHARDS")) && parse_size(v, &n) == 0) defaults.shards = n;
+    if ((v = getenv("LAB2_READAHEAD")) && parse_size(v, &n) == 0)
+        defaults.readahead_blocks = n ? n : LAB2_READAHEAD_OFF;
+    if ((v = getenv("LAB2_DIRTY_RATIO")) && parse_size(v, &n) == 0) defaults.dirty_ratio = n;
+    if ((v = getenv("LAB2_DIRTY_EXPIRE_MS")) && parse_size(v, &n) == 0) defaults.dirty_expire_ms = n;
+    if ((v = getenv("LAB2_DIRECT")) && parse_size(v, &n) == 0)
+        defaults.direct_bytes = n ? n : LAB2_DIRECT_OFF;
+    if ((v = getenv("LAB2_HUGEPAGES")) && parse_size(v, &n) == 0)
+        defaults.hugepages = n ? LAB2_HUGEPAGES_ON : LAB2_HUGEPAGES_OFF;
+    if ((v = getenv("LAB2_MRC")) && parse_size(v, &n) == 0)
+        defaults.mrc = n ? LAB2_MRC_ON : LAB2_MRC_OFF;
+    if ((v = getenv("LAB2_TIER_SIZE")) && parse_size(v, &n) == 0)
+        defaults.tier_bytes = n ? n : LAB2_TIER_OFF;
+    if ((v = getenv("LAB2_SPILL_PATH")) && *v) defaults.spill_path = v;
+    if ((v = getenv("LAB2_SPILL_SIZE")) && parse_size(v, &n) == 0)
+        defaults.spill_bytes = n ? n : LAB2_SPILL_OFF;
+    if ((v = getenv("LAB2_ADMISSION"))) {
+        if (!strcmp(v, "tinylfu")) defaults.admission = LAB2_ADMISSION_TINYLFU;
+        else if (!strcmp(v, "none")) defaults.admission = LAB2_ADMISSION_NONE;
+    }
+    if ((v = getenv("LAB2_STATS_INTERVAL_MS")) && parse_size(v, &n) == 0) stats_interval_ms = n;
+    if ((v = getenv("LAB2_TRACE")) && *v) trace_path = v;
+    if ((v = getenv("LAB2_WARM_DIR")) && *v) warm_dir = v;
+}
+
+void lab2_config_default(lab2_config *cfg) {
+    pthread_once(&env_once, load_env_defaults);
+    pthread_mutex_lock(&files_lock);
+    *cfg = defaults;
+    pthread_mutex_unlock(&files_lock);
+}
+
+int lab2_set_default_policy(lab2_policy policy) {
+    if (!policy_name(policy)) return -1;
+    pthread_once(&env_once, load_env_defaults);
+    pthread_mutex_lock(&files_lock);
+    defaults.policy = policy;
+    pthread_mutex_unlock(&files_lock);
+    return 0;
+}
+
+static size_t auto_shards(size_t capacity) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t want = cpus > 0 ? (size_t)cpus * 4 : 4;
+    size_t n = 1;
+    while (n < want && n < MAX_SHARDS && capacity / (n * 2) >= MIN_SHARD_BLOCKS) n <<= 1;
+    return n;
+}
+
+// Fills in zero fields from the process defaults and checks the result.
+// On success out->capacity_blocks and out->shards hold the final values.
+// readahead_blocks stays 0 if unset, since its default depends on the
+// block size of the pool the handle ends up in.
+static int resolve_config(const lab2_config *in, lab2_config *out) {
+    lab2_config cfg;
+    lab2_config_default(&cfg);
+    if (in) {
+        if (in->block_size) cfg.block_size = in->block_size;
+        if (in->capacity_blocks || in->capacity_bytes) {
+            cfg.capacity_blocks = in->capacity_blocks;
+            cfg.capacity_bytes = in->capacity_bytes;
+        }
+        if (in->policy) cfg.policy = in->policy;
+        if (in->shards) cfg.shards = in->shards;
+        if (in->readahead_blocks) cfg.readahead_blocks = in->readahead_blocks;
+        if (in->dirty_ratio) cfg.dirty_ratio = in->dirty_ratio;
+        if (in->dirty_expire_ms) cfg.dirty_expire_ms = in->dirty_expire_ms;
+        if (in->direct_bytes) cfg.direct_bytes = in->direct_bytes;
+        if (in->hugepages) cfg.hugepages = in->hugepages;
+        if (in->admission) cfg.admission = in->admission;
+        if (in->tier_bytes) cfg.tier_bytes = in->tier_bytes;
+        if (in->spill_bytes) cfg.spill_bytes = in->spill_bytes;
+        if (in->spill_path) cfg.spill_path = in->spill_path;
+        if (in->mrc) cfg.mrc = in->mrc;
+    }
+
+    if (cfg.block_size < MIN_BLOCK_SIZE || cfg.block_size > MAX_BLOCK_SIZE ||
+        (cfg.block_size & (cfg.block_size - 1)))
+        return -1;
+    if (!policy_name(cfg.policy)) return -1;
+    if (!cfg.dirty_ratio || cfg.dirty_ratio > 100 || !cfg.dirty_expire_ms) return -1;
+    if (cfg.hugepages != LAB2_HUGEPAGES_OFF && cfg.hugepages != LAB2_HUGEPAGES_ON) return -1;
+    if (cfg.admission != LAB2_ADMISSION_NONE && cfg.admission != LAB2_ADMISSION_TINYLFU) return -1;
+    if (cfg.mrc != LAB2_MRC_OFF && cfg.mrc != LAB2_MRC_ON) return -1;
+
+    if (!cfg.capacity_blocks) cfg.capacity_blocks = cfg.capacity_bytes / cfg.block_size;
+    if (!cfg.capacity_blocks) cfg.capacity_blocks = 1;
+    cfg.capacity_bytes = cfg.capacity_blocks * cfg.block_size;
+
+    if (!cfg.direct_bytes) cfg.direct_bytes = DEFAULT_DIRECT_BYTES;
+
+    if (!cfg.shards) cfg.shards = auto_shards(cfg.capacity_blocks);
+    if (cfg.shards > MAX_SHARDS || cfg.shards > cfg.capacity_blocks ||
+        (cfg.shards & (cfg.shards - 1)))
+        return -1;
+    // Every shard's part of the tier has to hold a block or two.
+    if (cfg.tier_bytes != LAB2_TIER_OFF && cfg.tier_bytes / cfg.shards < 2 * cfg.block_size)
+        return -1;
+    // So does its part of the spill file, which needs a path.
+    if (cfg.spill_bytes != LAB2_SPILL_OFF &&
+        (!cfg.spill_path || !*cfg.spill_path || cfg.spill_bytes / cfg.shards < 2 * cfg.block_size))
+        return -1;
+
+    *out = cfg;
+    return 0;
+}
+
+// Only called with no file open, so no reader can see retired blocks.
+static void pool_teardown(void) {
+    for (size_t i = 0; i < pool.nshards; i++) {
+        Shard *s = &pool.shards[i];
+        if (s->policy) policy_destroy(s->policy);
+        tier_destroy(s->tier);
+        spill_destroy(s->spill);
+        free(s->index);
+        free(s->index_scratch);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->io_done);
+    }
+    free(pool.shards);
+    sketch_destroy(pool.sketch);
+    pool.sketch = NULL;
+    if (pool.spill_fd >= 0) close(pool.spill_fd);
+    pool.spill_fd = -1;
+    free(pool.spill_path);
+    pool.spill_path = NULL;
+    io_set_buffers(NULL, 0);
+    free(pool.headers);
+    if (pool.frames) munmap(pool.frames, pool.frames_len);
+    pool.shards = NULL;
+    pool.headers = NULL;
+    pool.frames = NULL;
+    pool.ready = false;
+}
+
+// Maps the frames as one anonymous region. With hugepages it takes 2 MiB
+// pages from the hugetlb pool, or, when that is empty, is aligned to 2 MiB
+// and handed to transparent huge pages, so that a large cache costs a TLB
+// entry per 2 MiB of hits rather than per 4 KiB.
+static char *map_frames(size_t len, bool huge, size_t *mapped) {
+    int prot = PROT_READ | PROT_WRITE, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (!huge) {
+        void *p = mmap(NULL, len, prot, flags, -1, 0);
+        *mapped = len;
+        return p == MAP_FAILED ? NULL : p;
+    }
+    len = (len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    *mapped = len;
+#ifdef MAP_HUGETLB
+    void *p = mmap(NULL, len, prot, flags | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return p;
+#endif
+    char *raw = mmap(NULL, len + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *start = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (start > raw) munmap(raw, start - raw);
+    munmap(start + len, raw + HUGE_PAGE_SIZE - start);
+    madvise(start, len, MADV_HUGEPAGE);
+    return start;
+}
+
+// Carves the arena into per-shard free lists. Retired blocks keep an odd
+// sequence number for good, so slots start out odd as well. Headers live
+// in their own dense array, away from the frames.
+static int arena_setup(const lab2_config *cfg) {
+    size_t nslots = cfg->capacity_blocks + pool.nshards * SPARE_BLOCKS;
+    pool.headers = calloc(nslots, sizeof(CacheBlock));
+    if (!pool.headers) return -1;
+    pool.frames = map_frames(nslots * cfg->block_size, cfg->hugepages == LAB2_HUGEPAGES_ON,
+                             &pool.frames_len);
+    if (!pool.frames) return -1;
+    pool.nslots = nslots;
+
+    size_t slot = 0;
+    for (size_t i = 0; i < pool.nshards; i++) {
+        Shard *s = &pool.shards[i];
+        size_t n = s->capacity + SPARE_BLOCKS;
+        for (size_t j = 0; j < n; j++, slot++) {
+            CacheBlock *b = &pool.headers[slot];
+            b->data = pool.frames + slot * cfg->block_size;
+            atomic_init(&b->seq, 1);
+            b->retire_next = s->free_blocks;
+            s->free_blocks = b;
+        }
+    }
+    io_set_buffers(pool.frames, nslots * cfg->block_size);
+    return 0;
+}
+
+static int pool_build(const lab2_config *cfg) {
+    size_t nshards = cfg->shards;
+    if (posix_memalign((void **)&pool.shards, 64, nshards * sizeof(Shard))) return -1;
+    memset(pool.shards, 0, nshards * sizeof(Shard));
+    pool.nshards = nshards;
+    pool.spill_fd = -1;
+    size_t spill_slots = 0;
+    if (cfg->spill_bytes != LAB2_SPILL_OFF) {
+        spill_slots = cfg->spill_bytes / nshards / cfg->block_size;
+        pool.spill_fd = spill_open(cfg->spill_path, spill_slots * nshards * cfg->block_size);
+        pool.spill_path = strdup(cfg->spill_path);
+        if (pool.spill_fd < 0 || !pool.spill_path) {
+            pool_teardown();
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < nshards; i++) {
+        Shard *s = &pool.shards[i];
+        size_t cap = cfg->capacity_blocks / nshards + (i < cfg->capacity_blocks % nshards);
+        // Every frame of the shard fits into half of the index.
+        size_t groups = 1;
+        while (groups * INDEX_GROUP < 2 * (cap + SPARE_BLOCKS)) groups <<= 1;
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->io_done, NULL);
+        s->capacity = cap;
+        s->probation.head.next = s->probation.head.prev = &s->probation.head;
+        if (posix_memalign((void **)&s->index, 64, groups * sizeof(IndexGroup))) s->index = NULL;
+        for (size_t g = 0; s->index && g < groups; g++) {
+            atomic_init(&s->index[g].ctrl[0], CTRL_EMPTY_LO);
+            atomic_init(&s->index[g].ctrl[1], CTRL_EMPTY_HI);
+        }
+        s->index_mask = groups - 1;
+        s->index_empty = groups * INDEX_GROUP;
+        s->index_scratch = malloc((cap + SPARE_BLOCKS) * sizeof(uint32_t));
+        s->policy = policy_create(cfg->policy, cap);
+        if (cfg->tier_bytes != LAB2_TIER_OFF)
+            s->tier = tier_create(cfg->tier_bytes / nshards, cfg->block_size);
+        if (spill_slots)
+            s->spill = spill_create(pool.spill_fd, (off_t)(i * spill_slots * cfg->block_size),
+                                    spill_slots, cfg->block_size);
+        if (!s->index || !s->index_scratch || !s->policy ||
+            (cfg->tier_bytes != LAB2_TIER_OFF && !s->tier) || (spill_slots && !s->spill)) {
+            pool_teardown();
+            return -1;
+        }
+        s->policy->evictable = block_evictable;
+        s->dirty_limit = cap * cfg->dirty_ratio / 100;
+        s->clean_reserve = cap / CLEAN_RESERVE_DIV;
+        if (s->clean_reserve < MIN_CLEAN_RESERVE) s->clean_reserve = MIN_CLEAN_RESERVE;
+        if (s->clean_reserve > cap) s->clean_reserve = cap;
+    }
+    if (cfg->admission == LAB2_ADMISSION_TINYLFU &&
+        !(pool.sketch = sketch_create(cfg->capacity_blocks))) {
+        pool_teardown();
+        return -1;
+    }
+    if (arena_setup(cfg) < 0) {
+        pool_teardown();
+        return -1;
+    }
+    pool.block_size = cfg->block_size;
+    pool.capacity = cfg->capacity_blocks;
+    pool.policy_kind = cfg->policy;
+    pool.admission = cfg->admission;
+    pool.tier_bytes = cfg->tier_bytes;
+    pool.spill_bytes = cfg->spill_bytes;
+    pool.dirty_ratio = cfg->dirty_ratio;
+    pool.dirty_expire_ms = cfg->dirty_expire_ms;
+    pool.hugepages = cfg->hugepages;
+    pool.mrc = cfg->mrc;
+    pool.ready = true;
+    if (trace_path) record_start(trace_path, pool.block_size);
+    size_t keys = cfg->capacity_blocks / MRC_KEYS_DIV;
+    mrc_base = accesses();
+    if (cfg->mrc == LAB2_MRC_ON)
+        mrc_reset(keys < MRC_MIN_KEYS ? MRC_MIN_KEYS : keys > MRC_MAX_KEYS ? MRC_MAX_KEYS : keys,
+                  (double)MRC_MIN_KEYS / cfg->capacity_blocks);
+    else
+        mrc_reset(0, 0);
+    return 0;
+}
+
+// Whether the live pool has the pool-level settings of cfg. With `in`,
+// only those it sets count, and a capacity it gives in bytes counts in
+// the pool's block size. files_lock held.
+static bool pool_fits(const lab2_config *in, const lab2_config *cfg) {
+    static const lab2_config all = {
+        .block_size = 1, .capacity_blocks = 1, .policy = 1, .shards = 1, .dirty_ratio = 1,
+        .dirty_expire_ms = 1, .hugepages = 1, .admission = 1, .tier_bytes = 1,
+        .spill_bytes = 1, .spill_path = "", .mrc = 1,
+    };
+    if (!in) in = &all;
+    size_t cap = cfg->capacity_blocks;
+    if (!in->capacity_blocks && in->capacity_bytes && !in->block_size) {
+        cap = in->capacity_bytes / pool.block_size;
+        if (!cap) cap = 1;
+    }
+    return (!in->block_size || cfg->block_size == pool.block_size) &&
+           (!(in->capacity_blocks || in->capacity_bytes) || cap == pool.capacity) &&
+           (!in->policy || cfg->policy == pool.policy_kind) &&
+           (!in->shards || cfg->shards == pool.nshards) &&
+           (!in->dirty_ratio || cfg->dirty_ratio == pool.dirty_ratio) &&
+           (!in->dirty_expire_ms || cfg->dirty_expire_ms == pool.dirty_expire_ms) &&
+           (!in->hugepages || cfg->hugepages == pool.hugepages) &&
+           (!in->admission || cfg->admission == pool.admission) &&
+           (!in->mrc || cfg->mrc == pool.mrc) &&
+           (!in->tier_bytes || cfg->tier_bytes == pool.tier_bytes) &&
+           (!in->spill_bytes || cfg->spill_bytes == pool.spill_bytes) &&
+           (!in->spill_path || !pool.spill_path || !strcmp(pool.spill_path, cfg->spill_path));
+}
+
+// The pool is built by the first open, and rebuilt by an open with other
+// settings while no file is open. With files open, an open only has to
+// agree with the pool on the fields it sets, and fails with EBUSY if it
+// does not. files_lock held.
+static int pool_setup(const lab2_config *in, const lab2_config *cfg) {
+    static const lab2_config unset;
+    if (pool.ready) {
+        if (!pool.open_files && pool_fits(NULL, cfg)) return 0;
+        if (pool.open_files && pool_fits(in ? in : &unset, cfg)) return 0;
+        if (pool.open_files) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&flusher_lock);
+    if (pool.ready) pool_teardown();
+    int err = pool_build(cfg);
+    pthread_mutex_unlock(&flusher_lock);
+
+    if (!err && !flusher_started) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, flusher, NULL) == 0) {
+            pthread_detach(tid);
+            flusher_started = true;
+        }
+    }
+    return err;
+}
+
+static int cmp_warmth(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a >> WARM_RECENCY_SHIFT;
+    uint64_t y = *(const uint64_t *)b >> WARM_RECENCY_SHIFT;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Lists the cached blocks of the file, warmest first: blocks the policy has
+// seen hit again, then by their place in their shard's eviction order,
+// scaled to the shard's size so that shards compare.
+static int collect_manifest(Lab2File *f, uint64_t **out, size_t *count) {
+    size_t max = 0;
+    for (size_t i = 0; i < pool.nshards; i++)
+        if (pool.shards[i].capacity > max) max = pool.shards[i].capacity;
+    max += SPARE_BLOCKS;
+    PolicyNode **order = malloc(max * sizeof(PolicyNode *));
+    uint64_t *e = NULL;
+    size_t n = 0, cap = 0;
+    int err = order ? 0 : -1;
+
+    for (size_t i = 0; i < pool.nshards && !err; i++) {
+        Shard *s = &pool.shards[i];
+        pthread_mutex_lock(&s->lock);
+        size_t k = policy_coldest(s->policy, order, max);
+        for (size_t j = 0; j < k; j++) {
+            CacheBlock *b = block_of(order[j]);
+            if (b->file != f) continue;
+            if (n == cap) {
+                size_t ncap = cap ? 2 * cap : 1024;
+                uint64_t *grown = realloc(e, ncap * sizeof(uint64_t));
+                if (!grown) {
+                    err = -1;
+                    break;
+                }
+                e = grown;
+                cap = ncap;
+            }
+            uint64_t recency = (j + 1) * WARM_RECENCY_MAX / k;
+            e[n++] = warm_entry(b->block_number, recency,
+                                policy_frequent(&b->node) ? WARM_FREQUENT : 0);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(order);
+    if (err) {
+        free(e);
+        return -1;
+    }
+    qsort(e, n, sizeof(uint64_t), cmp_warmth);
+    *out = e;
+    *count = n;
+    return 0;
+}
+
+// Stamps the manifest with the file as it is now, so call it once the
+// blocks are on disk.
+static int save_manifest(Lab2File *f, const char *path, const uint64_t *e, size_t n) {
+    WarmHeader h = {
+        .magic = WARM_MAGIC,
+        .version = WARM_VERSION,
+        .block_size = (uint32_t)pool.block_size,
+        .count = n,
+    };
+    if (warm_identity(f->fd, &h) < 0) return -1;
+    return warm_write(path, &h, e);
+}
+
+// The manifest only steers what gets read, so one that slipped past the
+// checks costs wasted reads, never wrong data.
+static ssize_t load_manifest(Lab2File *f, const char *path) {
+    WarmHeader h, cur;
+    uint64_t *e = warm_read(path, &h);
+    if (!e) return -1;
+    if (h.block_size != pool.block_size || warm_identity(f->fd, &cur) < 0 ||
+        !warm_same_file(&h, &cur)) {
+        free(e);
+        errno = ESTALE;
+        return -1;
+    }
+    off_t size = atomic_load_explicit(&f->file_size, memory_order_relaxed);
+    uint64_t limit = (uint64_t)(size + pool.block_size - 1) / pool.block_size;
+    size_t n = 0;
+    for (size_t i = 0; i < h.count && n < pool.capacity; i++) {
+        uint64_t bn = warm_block(e[i]);
+        if (bn < limit) e[n++] = bn;
+    }
+    if (!n) {
+        free(e);
+        return 0;
+    }
+    for (size_t i = 0; i < n; i += WARM_CHUNK)
+        qsort(e + i, n - i < WARM_CHUNK ? n - i : WARM_CHUNK, sizeof(uint64_t), cmp_u64);
+    if (warm_submit(f, e, n) < 0) return -1;
+    return (ssize_t)n;
+}
+
+// Manifests in LAB2_WARM_DIR are named after a hash of the file's
+// canonical path.
+static char *warm_path_of(const char *path) {
+    char *real = realpath(path, NULL);
+    if (!real) return NULL;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *c = real; *c; c++) h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+    free(real);
+    size_t len = strlen(warm_dir) + 24;
+    char *out = malloc(len);
+    if (out) snprintf(out, len, "%s/%016llx.warm", warm_dir, (unsigned long long)h);
+    return out;
+}
+
+// Empties the tiers. files_lock held, so the pool stays.
+static void tiers_clear(void) {
+    for (size_t i = 0; i < pool.nshards; i++) {
+        Shard *s = &pool.shards[i];
+        pthread_mutex_lock(&s->lock);
+        if (s->tier) tier_clear(s->tier);
+        if (s->spill) spill_clear(s->spill);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// Takes a descriptor and makes sure its chunk of the table exists; the
+// handle is stored once it is ready. files_lock held.
+static int handle_reserve(void) {
+    int fd = slot_get(&handle_slots);
+    if (fd < 0) {
+        errno = EMFILE;
+        return -1;
+    }
+    if (!atomic_load_explicit(&handles[fd / HANDLE_CHUNK], memory_order_relaxed)) {
+        HandleChunk *c = calloc(1, sizeof(*c));
+        if (!c) {
+            slot_put(&handle_slots, fd);
+            return -1;
+        }
+        atomic_store_explicit(&handles[fd / HANDLE_CHUNK], c, memory_order_release);
+    }
+    return fd;
+}
+
+// Picks the id of a new file. Block keys keep only KEY_ID_BITS of it, so an
+// id whose keys an open file uses is skipped, and the tiers, whose copies
+// outlive the files they came from, are emptied whenever the keys wrap.
+// files_lock held.
+static uint32_t file_id(void) {
+    const uint32_t mask = (1u << KEY_ID_BITS) - 1;
+    for (;;) {
+        uint32_t id = next_file_id++;
+        if (id && !(id & mask)) tiers_clear();
+        Lab2File *f = open_list;
+        while (f && ((f->id ^ id) & mask)) f = f->next;
+        if (!f) return id;
+    }
+}
+
+// Returns the file at path for a new handle: the open one with the same
+// device and inode, or a new one, in which case *fresh is set. files_lock
+// held.
+static Lab2File *file_get(const char *path, bool *fresh) {
+    int real_fd = open(path, O_CREAT | O_RDWR | O_DIRECT, 0666);
+    if (real_fd < 0) return NULL;
+    struct stat st;
+    if (fstat(real_fd, &st) < 0) {
+        close(real_fd);
+        return NULL;
+    }
+    *fresh = false;
+    for (Lab2File *f = open_list; f; f = f->next) {
+        if (f->dev == st.st_dev && f->ino == st.st_ino) {
+            close(real_fd);
+            f->handles++;
+            return f;
+        }
+    }
+
+    int slot = slot_get(&stat_slots);
+    Lab2File *lf = slot < 0 ? NULL : calloc(1, sizeof(Lab2File));
+    if (lf) lf->blocks = calloc(pool.nshards, sizeof(CacheBlock *));
+    if (!lf || !lf->blocks) {
+        int err = slot < 0 ? EMFILE : ENOMEM;
+        if (slot >= 0) slot_put(&stat_slots, slot);
+        free(lf);
+        close(real_fd);
+        errno = err;
+        return NULL;
+    }
+    lf->fd = real_fd;
+    lf->slot = slot;
+    lf->id = file_id();
+    lf->dev = st.st_dev;
+    lf->ino = st.st_ino;
+    lf->handles = 1;
+    atomic_init(&lf->file_size, st.st_size);
+    if (warm_dir) lf->warm_path = warm_path_of(path);
+    lf->next = open_list;
+    open_list = lf;
+    *fresh = true;
+    return lf;
+}
+
+int lab2_open_ex(const char *path, const lab2_config *cfg) {
+    lab2_config resolved;
+    if (resolve_config(cfg, &resolved) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    Lab2Handle *h = calloc(1, sizeof(Lab2Handle));
+    if (!h) return -1;
+
+    pthread_mutex_lock(&files_lock);
+    int fd = pool_setup(cfg, &resolved) < 0 ? -1 : handle_reserve();
+    h->slot = fd < 0 ? -1 : slot_get(&stat_slots);
+    if (fd >= 0 && h->slot < 0) errno = EMFILE;
+    bool fresh = false;
+    Lab2File *f = h->slot < 0 ? NULL : file_get(path, &fresh);
+    if (!f) {
+        int err = errno;
+        if (h->slot >= 0) slot_put(&stat_slots, h->slot);
+        if (fd >= 0) slot_put(&handle_slots, fd);
+        pthread_mutex_unlock(&files_lock);
+        free(h);
+        errno = err;
+        return -1;
+    }
+    h->file = f;
+    // Readahead never claims more than half of the cache.
+    size_t ra = resolved.readahead_blocks;
+    if (!ra) {
+        ra = RA_DEFAULT_BYTES / pool.block_size;
+        if (ra < RA_MIN_BLOCKS) ra = RA_MIN_BLOCKS;
+    }
+    h->ra_max = ra == LAB2_READAHEAD_OFF ? 0 : ra;
+    if (h->ra_max > pool.capacity / 2) h->ra_max = pool.capacity / 2;
+    h->direct_min = resolved.direct_bytes == LAB2_DIRECT_OFF ? 0 : resolved.direct_bytes;
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_mutex_init(&h->stream_lock, NULL);
+    handle_stats(h, h->stats_base);
+    pool.open_files++;
+    HandleChunk *c = atomic_load_explicit(&handles[fd / HANDLE_CHUNK], memory_order_relaxed);
+    atomic_store_explicit(&c->h[fd % HANDLE_CHUNK], h, memory_order_release);
+    pthread_mutex_unlock(&files_lock);
+    if (fresh && f->warm_path) load_manifest(f, f->warm_path);
+    return fd;
+}
+
+int lab2_open(const char *path) {
+    return lab2_open_ex(path, NULL);
+}
+
+int lab2_close(int fd) {
+    pthread_mutex_lock(&files_lock);
+    Lab2Handle *h = get_handle(fd);
+    if (!h) {
+        pthread_mutex_unlock(&files_lock);
+        return -1;
+    }
+    HandleChunk *c = atomic_load_explicit(&handles[fd / HANDLE_CHUNK], memory_order_relaxed);
+    atomic_store_explicit(&c->h[fd % HANDLE_CHUNK], NULL, memory_order_release);
+    slot_put(&handle_slots, fd);
+    slot_put(&stat_slots, h->slot);
+    pthread_mutex_unlock(&files_lock);
+    Lab2File *f = h->file;
+    pthread_mutex_destroy(&h->lock);
+    pthread_mutex_destroy(&h->stream_lock);
+    free(h);
+
+    // Every close writes back the file's dirty blocks, and reports a
+    // failure like close(2) would, with the descriptor gone all the same.
+    // The handle's reference keeps the file alive until then.
+    int err = flush_file(f) < 0 ? errno : 0;
+    pthread_mutex_lock(&files_lock);
+    bool last = --f->handles == 0;
+    if (last) {
+        Lab2File **p = &open_list;
+        while (*p != f) p = &(*p)->next;
+        *p = f->next;
+    } else {
+        pool.open_files--;
+    }
+    pthread_mutex_unlock(&files_lock);
+    if (!last) goto out;
+
+    ra_cancel(f);
+    uint64_t *warm = NULL;
+    size_t nwarm = 0;
+    bool save = f->warm_path && collect_manifest(f, &warm, &nwarm) == 0;
+    for (size_t i = 0; i < pool.nshards; i++) {
+        Shard *s = &pool.shards[i];
+        pthread_mutex_lock(&s->lock);
+        while (f->blocks[i]) {
+            CacheBlock *b = f->blocks[i];
+            if (b->refs) {
+                pthread_cond_wait(&s->io_done, &s->lock);
+                continue;
+            }
+            if (b->dirty) {
+                // Written with the shard unlocked, as evict_one() does. The
+                // file is going away, so a block that fails to write is
+                // dropped regardless and the close fails.
+                mark_clean(s, b);
+                b->state |= BLOCK_WRITEBACK;
+                b->refs++;
+                pthread_mutex_unlock(&s->lock);
+                if (write_block(b, STAT_WB_SYNC) < 0 && !err) err = errno;
+                pthread_mutex_lock(&s->lock);
+                b->refs--;
+                b->state &= ~BLOCK_WRITEBACK;
+                pthread_cond_broadcast(&s->io_done);
+            }
+            drop_block(s, b);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (save) save_manifest(f, f->warm_path, warm, nwarm);
+    free(warm);
+    free(f->warm_path);
+    close(f->fd);
+    free(f->blocks);
+    int slot = f->slot;
+    free(f);
+
+    pthread_mutex_lock(&files_lock);
+    slot_put(&stat_slots, slot);
+    pool.open_files--;
+    pthread_mutex_unlock(&files_lock);
+    record_flush();
+out:
+    if (!err) return 0;
+    errno = err;
+    return -1;
+}
+
+// ---------------------------------------------------------------------------
+// Direct I/O. Bulk transfers skip the frames: a read overlays the cached
+// blocks that are newer than the disk onto what the device returned, and a
+// write drops the cached copies of the range before it goes to disk.
+// ---------------------------------------------------------------------------
+
+// O_DIRECT wants the memory aligned to the device's logical block size,
+// which the block size of the cache already has to be a multiple of.
+static size_t direct_align(void) {
+    return pool.block_size < 4096 ? pool.block_size : 4096;
+}
+
+// Returns the length of the whole-block middle part of [pos, pos + count)
+// if it is worth bypassing the cache, with its distance from pos in *head,
+// and 0 otherwise.
+static size_t direct_span(Lab2Handle *h, const char *p, size_t count, off_t pos, size_t *head) {
+    if (!h->direct_min) return 0;
+    size_t skip = (pool.block_size - pos % pool.block_size) % pool.block_size;
+    if (skip >= count) return 0;
+    size_t span = (count - skip) / pool.block_size * pool.block_size;
+    if (span < h->direct_min || (uintptr_t)(p + skip) % direct_align()) return 0;
+    *head = skip;
+    return span;
+}
+
+// Moves len bytes between p and the file at off. Returns how many bytes
+// were transferred, which is only short for a read that reaches the end of
+// the file, or -1 on error.
+static ssize_t direct_io(Lab2File *f, int op, char *p, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        IoRequest reqs[DIRECT_BATCH];
+        struct iovec iov[DIRECT_BATCH];
+        size_t n = 0, queued = done;
+        for (; n < DIRECT_BATCH && queued < len; n++) {
+            size_t chunk = len - queued < DIRECT_CHUNK ? len - queued : DIRECT_CHUNK;
+            iov[n] = (struct iovec){ p + queued, chunk };
+            reqs[n] = (IoRequest){ .fd = f->fd, .op = op, .offset = off + (off_t)queued,
+                                   .iov = &iov[n], .iovcnt = 1 };
+            queued += chunk;
+        }
+        io_run(reqs, n);
+        for (size_t i = 0; i < n; i++) {
+            if (reqs[i].result < 0) return -1;
+            stats_add(f->slot, op == IO_READ ? STAT_DISK_READ : STAT_DISK_WRITE, reqs[i].result);
+            done += reqs[i].result;
+            if ((size_t)reqs[i].result < iov[i].iov_len) return op == IO_READ ? (ssize_t)done : -1;
+        }
+    }
+    return done;
+}
+
+static void unpin_blocks(CacheBlock **blocks, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        Shard *s = shard_of(mix64(blocks[i]->node.key));
+        pthread_mutex_lock(&s->lock);
+        blocks[i]->refs--;
+        pthread_cond_broadcast(&s->io_done);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// Reads whole blocks at pos into p past the cache. Dirty blocks, and
+// blocks whose write-back has not completed, are newer than the disk: they
+// are pinned before the read, so that neither eviction nor write-back can
+// slip them out in between, and copied over the result. Other resident
+// blocks match the disk, unless a write that runs concurrently with this
+// call changes them, in which case either version is a valid result.
+// Returns false, having read nothing, if the caller has to use the cache
+// instead.
+static bool read_direct(Lab2File *f, char *p, size_t len, off_t pos) {
+    off_t first = pos / pool.block_size;
+    size_t n = len / pool.block_size;
+    CacheBlock **newer = NULL;
+    size_t nnewer = 0, cap = 0;
+    bool ok = true;
+    for (size_t i = 0; i < n && ok; i++) {
+        uint64_t hash = mix64(block_key(f, first + (off_t)i));
+        Shard *s = shard_of(hash);
+        pthread_mutex_lock(&s->lock);
+        CacheBlock *b = lookup(s, hash, f, first + (off_t)i);
+        if (b && (b->dirty || (b->state & BLOCK_WRITEBACK))) {
+            if (nnewer == cap) {
+                size_t grow = cap ? 2 * cap : 64;
+                CacheBlock **tmp = realloc(newer, grow * sizeof(*tmp));
+                if (tmp) {
+                    newer = tmp;
+                    cap = grow;
+                }
+            }
+            if (nnewer < cap) {
+                b->refs++;
+                newer[nnewer++] = b;
+            } else {
+                ok = false;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    uint64_t t0 = now_ns();
+    ssize_t got = ok ? direct_io(f, IO_READ, p, len, pos) : -1;
+    if (got >= 0) {
+        memset(p + got, 0, len - got);
+        for (size_t i = 0; i < nnewer; i++) {
+            CacheBlock *b = newer[i];
+            Shard *s = shard_of(mix64(b->node.key));
+            pthread_mutex_lock(&s->lock);
+            memcpy(p + (size_t)(b->block_number - first) * pool.block_size, b->data,
+                   pool.block_size);
+            pthread_mutex_unlock(&s->lock);
+        }
+        uint64_t ns = now_ns() - t0;
+        stats_add(f->slot, STAT_DIRECT_READ, len);
+        stats_latency(LAB2_LAT_DIRECT_READ, ns);
+        TRACE4(direct, f->slot, 0, len, ns);
+    }
+    unpin_blocks(newer, nnewer);
+    free(newer);
+    return got >= 0;
+}
+
+// Writes whole blocks from p to pos past the cache. Cached copies of the
+// range are dropped first, dirty ones and those in the tiers included, as
+// the write replaces them.
+// A block that is loading, being written back, being evicted or pinned
+// cannot be dropped; the caller then writes the range through the cache,
+// which also overwrites everything dropped so far. Probation blocks are
+// clean blocks like any other and go.
+static bool write_direct(Lab2File *f, const char *p, size_t len, off_t pos) {
+    off_t first = pos / pool.block_size;
+    size_t n = len / pool.block_size;
+    // Taken odd before the range is scanned, so that a load which inserts
+    // a block after the scan sees it and reads again.
+    atomic_fetch_add(&f->direct_seq, 1);
+    bool busy = false;
+    for (size_t i = 0; i < n && !busy; i++) {
+        uint64_t hash = mix64(block_key(f, first + (off_t)i));
+        Shard *s = shard_of(hash);
+        pthread_mutex_lock(&s->lock);
+        CacheBlock *b = lookup(s, hash, f, first + (off_t)i);
+        if (b) {
+            if (b->refs || (b->state & (BLOCK_LOADING | BLOCK_WRITEBACK | BLOCK_EVICTING)))
+                busy = true;
+            else drop_block(s, b);
+        }
+        uint64_t key = block_key(f, first + (off_t)i);
+        uint32_t slot;
+        if (s->tier) tier_take(s->tier, key, NULL);
+        if (s->spill && spill_take(s->spill, key, &slot)) spill_release(s->spill, slot);
+        pthread_mutex_unlock(&s->lock);
+    }
+    uint64_t t0 = now_ns();
+    ssize_t done = busy ? -1 : direct_io(f, IO_WRITE, (char *)p, len, pos);
+    uint64_t ns = now_ns() - t0;
+    atomic_fetch_add(&f->direct_seq, 1);
+    if (done < 0) return false;
+    stats_add(f->slot, STAT_DIRECT_WRITE, len);
+    stats_latency(LAB2_LAT_DIRECT_WRITE, ns);
+    TRACE4(direct, f->slot, 1, len, ns);
+    update_size(f, pos + (off_t)len);
+    return true;
+}
+
+// Logs the blocks of a direct transfer, which never reach the cache.
+static void record_direct(Lab2File *f, off_t pos, size_t len, uint64_t flags) {
+    if (!atomic_load_explicit(&record_on, memory_order_relaxed)) return;
+    off_t last = (pos + (off_t)len - 1) / (off_t)pool.block_size;
+    for (off_t bn = pos / (off_t)pool.block_size; bn <= last; bn++)
+        record_append(f->id, bn, flags | RECORD_DIRECT);
+}
+
+// One read call, which may scatter into several buffers.
+typedef struct ReadCall {
+    Lab2Handle *h;
+    Lab2File *f;
+    off_t pos;      // next byte to read
+    off_t limit;    // first block past the end of the file
+    off_t last;     // last block of the call
+    off_t batched;  // first block past the last batched load
+    bool stream;    // readahead window open
+} ReadCall;
+
+// Loads the missing blocks of the call from block bn on, up to MISS_BATCH
+// at a time, so that a miss in a multi-block read costs one I/O instead of
+// one per block. The batch never takes more than a quarter of the cache.
+static void load_ahead(ReadCall *c, off_t bn) {
+    size_t n = (size_t)(c->last - bn + 1);
+    if (n > MISS_BATCH) n = MISS_BATCH;
+    if (n > pool.capacity / 4) n = pool.capacity / 4;
+    c->batched = bn + (off_t)n;
+    if (n < 2) return;
+    uint64_t t0 = now_ns();
+    prefetch(c->f, bn, n, ORIGIN_BATCH);
+    uint64_t ns = now_ns() - t0;
+    stats_latency(LAB2_LAT_MISS, ns);
+    TRACE4(miss, c->f->slot, bn, n, ns);
+}
+
+static __thread unsigned hit_tick;
+
+// Returns false, with errno set, if a block could not be loaded.
+static bool read_cached(ReadCall *c, char *p, size_t count) {
+    Lab2File *f = c->f;
+    while (count > 0) {
+        off_t bn = c->pos / pool.block_size;
+        size_t off = c->pos % pool.block_size;
+        size_t can_read = pool.block_size - off;
+        if (can_read > count) {
+            can_read = count;
+        }
+        if (c->stream) ra_advance(c->h, bn, c->limit);
+        note_access(f, bn, 0);
+        bool timed = ++hit_tick % HIT_SAMPLE == 0;
+        uint64_t t0 = timed ? now_ns() : 0;
+        if (read_optimistic(c->h, bn, off, p, can_read)) {
+            if (timed) stats_latency(LAB2_LAT_HIT, now_ns() - t0);
+        } else {
+            if (bn >= c->batched) load_ahead(c, bn);
+            Shard *s;
+            CacheBlock *b = acquire_block(c->h, bn, true, &s);
+            if (!b) return false;
+            memcpy(p, b->data + off, can_read);
+            pthread_mutex_unlock(&s->lock);
+        }
+        p += can_read;
+        c->pos += can_read;
+        count -= can_read;
+    }
+    return true;
+}
+
+static bool read_segment(ReadCall *c, char *p, size_t count) {
+    size_t head = 0;
+    size_t span = direct_span(c->h, p, count, c->pos, &head);
+    if (!span) return read_cached(c, p, count);
+    if (!read_cached(c, p, head)) return false;
+    if (read_direct(c->f, p + head, span, c->pos)) {
+        record_direct(c->f, c->pos, span, 0);
+        c->pos += span;
+        c->batched = c->pos / pool.block_size;
+    } else if (!read_cached(c, p + head, span)) {
+        return false;
+    }
+    return read_cached(c, p + head + span, count - head - span);
+}
+
+// Reads up to `count` bytes at pos into the buffers. Returns how many bytes
+// were read, which is short at the end of the file, or if a block could
+// not be loaded; then it is -1 with errno set if nothing was read.
+static ssize_t read_at(Lab2Handle *h, const struct iovec *iov, int iovcnt, size_t count, off_t pos) {
+    Lab2File *f = h->file;
+    off_t file_size = atomic_load_explicit(&f->file_size, memory_order_relaxed);
+    if (pos >= file_size || !count) return 0;
+    if (pos + (off_t)count > file_size) count = file_size - pos;
+
+    ReadCall c = {
+        .h = h,
+        .f = f,
+        .pos = pos,
+        .limit = (file_size + pool.block_size - 1) / pool.block_size,
+        .last = (pos + (off_t)count - 1) / pool.block_size,
+        .batched = 0,
+    };
+    c.stream = ra_update(h, pos / pool.block_size, c.last);
+    size_t left = count;
+    for (int i = 0; i < iovcnt && left; i++) {
+        size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        if (!read_segment(&c, iov[i].iov_base, n)) return c.pos > pos ? c.pos - pos : -1;
+        left -= n;
+    }
+    return count;
+}
+
+// Returns how many bytes it wrote, which is short, with errno set, only if
+// a block could not be loaded.
+static size_t write_cached(Lab2Handle *h, const char *p, size_t count, off_t pos) {
+    Lab2File *f = h->file;
+    size_t done = 0;
+    while (done < count) {
+        off_t bn = pos / pool.block_size;
+        size_t off = pos % pool.block_size;
+        size_t can_write = pool.block_size - off;
+        if (can_write > count - done) can_write = count - done;
+        bool partial = off != 0 || can_write < pool.block_size;
+        note_access(f, bn, RECORD_WRITE);
+        Shard *s;
+        CacheBlock *b = acquire_block(h, bn, partial, &s);
+        if (!b) break;
+        wait_writeback(s, b);
+        seq_write_begin(b);
+        memcpy(b->data + off, p, can_write);
+        if (!b->writers) seq_write_end(b);
+        mark_dirty(s, b);
+        pthread_mutex_unlock(&s->lock);
+        p += can_write;
+        pos += can_write;
+        update_size(f, pos);
+        done += can_write;
+    }
+    return done;
+}
+
+// Returns how many bytes it wrote, like write_cached().
+static size_t write_segment(Lab2Handle *h, const char *p, size_t count, off_t pos) {
+    Lab2File *f = h->file;
+    size_t head = 0;
+    size_t span = direct_span(h, p, count, pos, &head);
+    if (!span) return write_cached(h, p, count, pos);
+    size_t done = write_cached(h, p, head, pos);
+    if (done < head) return done;
+    if (write_direct(f, p + head, span, pos + (off_t)head)) {
+        record_direct(f, pos + (off_t)head, span, RECORD_WRITE);
+        done += span;
+    } else {
+        size_t n = write_cached(h, p + head, span, pos + (off_t)head);
+        done += n;
+        if (n < span) return done;
+    }
+    return done + write_cached(h, p + done, count - done, pos + (off_t)done);
+}
+
+// Returns how many bytes were written, which is short only if a block
+// could not be loaded; then it is -1 with errno set if nothing was written.
+static ssize_t write_at(Lab2Handle *h, const struct iovec *iov, int iovcnt, off_t pos) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t n = write_segment(h, iov[i].iov_base, iov[i].iov_len, pos + (off_t)total);
+        total += n;
+        if (n < iov[i].iov_len) return total ? (ssize_t)total : -1;
+    }
+    return total;
+}
+
+// Checks the arguments of a vectored call and returns the total length,
+// or -1.
+static ssize_t iov_total(const struct iovec *iov, int iovcnt, off_t pos) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX || pos < 0 || (iovcnt && !iov)) return -1;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > (size_t)SSIZE_MAX - total) return -1;
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+// Pins block bn of f for the caller. A writable pin keeps the block's
+// sequence odd, so lock-free readers take the locked path while the caller
+// may be changing the frame, and keeps write-back away from it. The pins
+// of all callers together may take up to half of a shard, or one block of
+// a smaller one, so that misses still find frames.
+static size_t pin_limit(const Shard *s) {
+    return s->capacity / 2 ? s->capacity / 2 : 1;
+}
+
+static CacheBlock *pin_block(Lab2Handle *h, off_t bn, bool writable) {
+    Lab2File *f = h->file;
+    if (bn < 0) return NULL;
+    if (!writable) {
+        off_t size = atomic_load_explicit(&f->file_size, memory_order_relaxed);
+        if (bn >= (size + (off_t)pool.block_size - 1) / (off_t)pool.block_size) return NULL;
+    }
+    // A quick look first, so that a full shard does not load the block;
+    // the limit only holds under the lock the pin is taken with.
+    Shard *s = shard_of(mix64(block_key(f, bn)));
+    pthread_mutex_lock(&s->lock);
+    bool full = s->pinned >= pin_limit(s);
+    pthread_mutex_unlock(&s->lock);
+    if (full) return NULL;
+
+    note_access(f, bn, writable ? RECORD_WRITE : 0);
+    CacheBlock *b = acquire_block(h, bn, true, &s);
+    if (!b) return NULL;
+    if (s->pinned >= pin_limit(s)) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    b->refs++;
+    s->pinned++;
+    if (writable) {
+        wait_writeback(s, b);
+        if (!b->writers++) seq_write_begin(b);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return b;
+}
+
+// Releases a pin taken by pin_block(), given the frame it handed out. A
+// writable pin leaves the block dirty and the file at least as long as the
+// end of the block.
+static int unpin_block(Lab2File *f, const void *data, bool writable) {
+    const char *p = data;
+    size_t span = pool.nslots * pool.block_size;
+    if (!p || p < pool.frames || p >= pool.frames + span ||
+        (size_t)(p - pool.frames) % pool.block_size)
+        return -1;
+    CacheBlock *b = &pool.headers[(size_t)(p - pool.frames) / pool.block_size];
+    Shard *s = shard_of(mix64(b->node.key));
+    pthread_mutex_lock(&s->lock);
+    if (b->file != f || !b->refs || !s->pinned || (writable && !b->writers)) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    b->refs--;
+    s->pinned--;
+    if (writable) {
+        if (!--b->writers) seq_write_end(b);
+        mark_dirty(s, b);
+        update_size(f, (b->block_number + 1) * (off_t)pool.block_size);
+    }
+    pthread_cond_broadcast(&s->io_done);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+ssize_t lab2_read(int fd, void *buf, size_t count) {
+    Lab2Handle *h = get_handle(fd);
+    if (!h) return -1;
+    if (count > SSIZE_MAX) count = SSIZE_MAX;
+    struct iovec iov = { buf, count };
+    pthread_mutex_lock(&h->lock);
+    ssize_t n = read_at(h, &iov, 1, count, h->offset);
+    if (n > 0) h->offset += n;
+    pthread_mutex_unlock(&h->lock);
+    return n;
+}
+
+ssize_t lab2_write(int fd, const void *buf, size_t count) {
+    Lab2Handle *h = get_handle(fd);
+    if (!h) return -1;
+    if (count > SSIZE_MAX) count = SSIZE_MAX;
+    struct iovec iov = { (void *)buf, count };
+    pthread_mutex_lock(&h->lock);
+    ssize_t n = write_at(h, &iov, 1, h->offset);
+    if (n > 0) h->offset += n;
+    pthread_mutex_unlock(&h->lock);
+    return n;
+}
+
+ssize_t lab2_pread(int fd, void *buf, size_t count, off_t offset) {
+    struct iovec iov = { buf, count };
+    return lab2_preadv(fd, &iov, 1, offset);
+}
+
+ssize_t lab2_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    struct iovec iov = { (void *)buf, count };
+    return lab2_pwritev(fd, &iov, 1, offset);
+}
+
+ssize_t lab2_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    Lab2Handle *h = get_handle(fd);
+    ssize_t total = iov_total(iov, iovcnt, offset);
+    if (!h || total < 0) return -1;
+    return read_at(h, iov, iovcnt, total, offset);
+}
+
+ssize_t lab2_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    Lab2Handle *h = get_handle(fd);
+    ssize_t total = iov_total(iov, iovcnt, offset);
+    if (!h || total < 0) return -1;
+    return write_at(h, iov, iovcnt, offset);
+}
+
+const void *lab2_get_block(int fd, off_t block) {
+    Lab2Handle *h = get_handle(fd);
+    CacheBlock *b = h ? pin_block(h, block, false) : NULL;
+    return b ? b->data : NULL;
+}
+
+void *lab2_get_block_rw(int fd, off_t block) {
+    Lab2Handle *h = get_handle(fd);
+    CacheBlock *b = h ? pin_block(h, block, true) : NULL;
+    return b ? b->data : NULL;
+}
+
+int lab2_put_block(int fd, const void *data) {
+    Lab2File *f = get_file(fd);
+    return f ? unpin_block(f, data, false) : -1;
+}
+
+int lab2_put_block_rw(int fd, void *data) {
+    Lab2File *f = get_file(fd);
+    return f ? unpin_block(f, data, true) : -1;
+}
+
+ssize_t lab2_get_blocks(int fd, off_t first, struct iovec *iov, size_t count, bool writable) {
+    Lab2Handle *h = get_handle(fd);
+    if (!h || first < 0 || (count && !iov)) return -1;
+    Lab2File *f = h->file;
+    // Missing blocks are read in runs rather than one by one.
+    if (count > 1) prefetch(f, first, count < MISS_BATCH ? count : MISS_BATCH, ORIGIN_BATCH);
+    size_t n = 0;
+    for (; n < count; n++) {
+        if (n && n % MISS_BATCH == 0) {
+            size_t left = count - n;
+            prefetch(f, first + (off_t)n, left < MISS_BATCH ? left : MISS_BATCH, ORIGIN_BATCH);
+        }
+        CacheBlock *b = pin_block(h, first + (off_t)n, writable);
+        if (!b) break;
+        iov[n] = (struct iovec){ b->data, pool.block_size };
+    }
+    return n || !count ? (ssize_t)n : -1;
+}
+
+int lab2_put_blocks(int fd, const struct iovec *iov, size_t count, bool writable) {
+    Lab2File *f = get_file(fd);
+    if (!f) return -1;
+    int err = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unpin_block(f, iov[i].iov_base, writable) < 0) err = -1;
+    }
+    return err;
+}
+
+off_t lab2_lseek(int fd, off_t offset, int whence) {
+    Lab2Handle *h = get_handle(fd);
+    if (!h) return -1;
+    pthread_mutex_lock(&h->lock);
+    off_t new_off;
+    if (whence == SEEK_SET) new_off = offset;
+    else if (whence == SEEK_CUR) new_off = h->offset + offset;
+    else if (whence == SEEK_END) new_off = atomic_load(&h->file->file_size) + offset;
+    else new_off = -1;
+    if (new_off >= 0) h->offset = new_off;
+    pthread_mutex_unlock(&h->lock);
+    return new_off < 0 ? -1 : new_off;
+}
+
+int lab2_fsync(int fd) {
+    Lab2File *f = get_file(fd);
+    if (!f) return -1;
+    int err = flush_file(f);
+    if (fsync(f->fd) < 0) err = -1;
+    return err;
+}
+
+int lab2_save_manifest(int fd, const char *manifest) {
+    Lab2File *f = get_file(fd);
+    if (!f) return -1;
+    uint64_t *e;
+    size_t n;
+    if (flush_file(f) < 0 || collect_manifest(f, &e, &n) < 0) return -1;
+    int err = save_manifest(f, manifest, e, n);
+    free(e);
+    return err;
+}
+
+ssize_t lab2_load_manifest(int fd, const char *manifest) {
+    Lab2File *f = get_file(fd);
+    if (!f) return -1;
+    return load_manifest(f, manifest);
+}
+
+void lab2_get_stats(lab2_stats *st) {
+    uint64_t c[NSTATS];
+    stats_sum(-1, c);
+    fill_stats(st, c);
+    pthread_mutex_lock(&files_lock);
+    for (size_t i = 0; pool.ready && i < pool.nshards; i++) {
+        Shard *s = &pool.shards[i];
+        pthread_mutex_lock(&s->lock);
+        st->dirty_blocks += s->ndirty;
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&files_lock);
+}
+
+int lab2_get_latency(lab2_latency_op op, lab2_latency *out) {
+    if (op < 0 || op >= LAB2_LAT_OPS) return -1;
+    stats_latency_get(op, out);
+    return 0;
+}
+
+int lab2_get_mrc(lab2_mrc_point *points, size_t max) {
+    if (!points && max) return -1;
+    pthread_mutex_lock(&files_lock);
+    size_t n = pool.ready ? mrc_curve(points, max, pool.block_size, accesses() - mrc_base) : 0;
+    pthread_mutex_unlock(&files_lock);
+    return (int)n;
+}
+
+int lab2_get_file_stats(int fd, lab2_stats *st) {
+    Lab2Handle *h = get_handle(fd);
+    if (!h) return -1;
+    Lab2File *f = h->file;
+    uint64_t c[NSTATS];
+    handle_stats(h, c);
+    for (int i = 0; i < NSTATS; i++) c[i] -= h->stats_base[i];
+    fill_stats(st, c);
+    for (size_t i = 0; i < pool.nshards; i++) {
+        Shard *s = &pool.shards[i];
+        pthread_mutex_lock(&s->lock);
+        for (CacheBlock *b = f->blocks[i]; b; b = b->file_next) st->dirty_blocks += b->dirty;
+        pthread_mutex_unlock(&s->lock);
     }
-    fsync(f->fd);
     return 0;
 }
@@ -4,7 +4,158 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+typedef enum lab2_policy {
+    LAB2_POLICY_DEFAULT, // the process default, see LAB2_POLICY
+    LAB2_POLICY_RANDOM,
+    LAB2_POLICY_LRU,
+    LAB2_POLICY_CLOCK,
+    LAB2_POLICY_2Q,
+    LAB2_POLICY_ARC,
+    LAB2_POLICY_S3FIFO,
+} lab2_policy;
+
+// Whether the frames of the cache are backed by 2 MiB pages. With them on,
+// the pool takes hugetlb pages if the system has enough reserved, and
+// transparent huge pages otherwise.
+typedef enum lab2_hugepages {
+    LAB2_HUGEPAGES_DEFAULT, // the process default, see LAB2_HUGEPAGES
+    LAB2_HUGEPAGES_OFF,
+    LAB2_HUGEPAGES_ON,
+} lab2_hugepages;
+
+// Which blocks the cache takes in once it is full. With TinyLFU a block
+// only displaces the policy's next victim if it was accessed more often,
+// going by a small frequency sketch of recent accesses; the others are
+// cached on probation and evicted first, so that one-off scans do not
+// wash out the working set.
+typedef enum lab2_admission {
+    LAB2_ADMISSION_DEFAULT, // the process default, see LAB2_ADMISSION
+    LAB2_ADMISSION_NONE,
+    LAB2_ADMISSION_TINYLFU,
+} lab2_admission;
+
+// Whether the pool estimates its miss ratio curve, see lab2_get_mrc().
+typedef enum lab2_mrc {
+    LAB2_MRC_DEFAULT, // the process default, see LAB2_MRC
+    LAB2_MRC_OFF,
+    LAB2_MRC_ON,
+} lab2_mrc;
+
+#define LAB2_READAHEAD_OFF ((size_t)-1)
+#define LAB2_DIRECT_OFF ((size_t)-1)
+#define LAB2_TIER_OFF ((size_t)-1)
+#define LAB2_SPILL_OFF ((size_t)-1)
+
+// Zero fields fall back to the process defaults. capacity_blocks takes
+// precedence over capacity_bytes when both are set. shards must be a power
+// of two; 0 picks one from the CPU count. readahead_blocks caps the
+// readahead window of sequential readers. The background flusher keeps
+// dirty blocks under dirty_ratio percent of the cache and writes any block
+// dirty for longer than dirty_expire_ms. Reads and writes whose
+// block-aligned part spans at least direct_bytes, with a buffer aligned to
+// the block size (or to 4 KiB for larger blocks), bypass the cache for
+// that part. tier_bytes is the memory for compressed copies of evicted
+// blocks, which spare a disk read on their next miss. It is split between
+// the shards and comes on top of the cache, with an index of 128 to 256
+// bytes per block_size of tier. spill_bytes of a file at spill_path, best
+// on a faster device than the files opened, hold evicted blocks as they
+// are, for the same purpose; the file is preallocated and its contents are
+// discarded when the pool is built, and a process that finds it in use by
+// another fails with EBUSY. Its index takes 16 to 32 bytes per block in
+// memory. mrc turns on the estimate of lab2_get_mrc().
+//
+// readahead_blocks and direct_bytes apply to the handle being opened. All
+// other fields belong to the pool that every open file shares. An open
+// with settings the pool does not have rebuilds it while no file is open.
+// While files are open, an open fails with EBUSY if a field it sets
+// differs from the pool's; fields left at zero take the pool's.
+typedef struct lab2_config {
+    size_t block_size;
+    size_t capacity_blocks;
+    size_t capacity_bytes;
+    lab2_policy policy;
+    size_t shards;
+    size_t readahead_blocks;
+    unsigned dirty_ratio;
+    unsigned dirty_expire_ms;
+    size_t direct_bytes;
+    lab2_hugepages hugepages;
+    lab2_admission admission;
+    size_t tier_bytes;
+    size_t spill_bytes;
+    const char *spill_path;
+    lab2_mrc mrc;
+} lab2_config;
+
+// Counters since the process started (lab2_get_stats) or since the handle
+// was opened (lab2_get_file_stats). A handle counts its own hits and
+// misses, while evictions, write-backs and disk traffic are its file's,
+// shared with every other handle of the file. Every thread counts into its
+// own records, and the calls add them up, so keeping them costs next to
+// nothing.
+typedef struct lab2_stats {
+    unsigned long long hits;                 // block accesses served from the cache
+    unsigned long long misses;
+    unsigned long long readahead_hits;       // first hits on blocks readahead loaded
+    unsigned long long warm_hits;            // first hits on blocks a manifest loaded
+    unsigned long long evictions;
+    unsigned long long tier_hits;            // misses the compressed tier served, not the disk
+    unsigned long long tier_stores;          // evicted blocks the tier took
+    unsigned long long tier_bytes;           // what they took compressed
+    unsigned long long spill_hits;           // block loads the spill file served, not the disk
+    unsigned long long spill_stores;         // evicted blocks written to it
+    unsigned long long writeback_foreground; // dirty victims written on a miss
+    unsigned long long writeback_background; // written by the flusher
+    unsigned long long writeback_sync;       // written by lab2_fsync/lab2_close
+    unsigned long long writeback_requests;   // write I/Os issued by batched write-back
+    unsigned long long dirty_blocks;         // right now
+    unsigned long long disk_read_bytes;      // including direct I/O
+    unsigned long long disk_write_bytes;
+    unsigned long long direct_read_bytes;    // moved by bypassing the cache
+    unsigned long long direct_write_bytes;
+} lab2_stats;
+
+// Operations with a latency histogram. Hits are timed one in 64, so their
+// count is a sample; the rest are timed every time.
+typedef enum lab2_latency_op {
+    LAB2_LAT_HIT,          // copy out of a resident block
+    LAB2_LAT_MISS,         // read of missing blocks on the calling thread
+    LAB2_LAT_EVICT_WRITE,  // dirty victim written back on a miss
+    LAB2_LAT_WRITEBACK,    // one batch of background or fsync write-back
+    LAB2_LAT_DIRECT_READ,  // one call's worth of direct I/O
+    LAB2_LAT_DIRECT_WRITE,
+    LAB2_LAT_OPS
+} lab2_latency_op;
+
+typedef struct lab2_latency {
+    unsigned long long count;
+    unsigned long long mean_ns;
+    unsigned long long p50_ns;
+    unsigned long long p90_ns;
+    unsigned long long p99_ns;
+    unsigned long long p999_ns;
+    unsigned long long max_ns;
+} lab2_latency;
+
+// One point of the curve lab2_get_mrc() estimates: the share of block
+// accesses that would have missed in an LRU cache of this size.
+typedef struct lab2_mrc_point {
+    unsigned long long cache_blocks;
+    unsigned long long cache_bytes;
+    double miss_ratio;
+} lab2_mrc_point;
+
+// Every open returns a descriptor of its own, with its own offset, and
+// descriptors are reused once closed. Opens of the same file, by device
+// and inode, share its cached blocks and their write-back. lab2_close()
+// writes back the file's dirty blocks, and the last close of a file also
+// drops them from the cache. If a write-back fails it returns -1 with
+// errno set, and the descriptor is closed all the same. A read or write
+// that misses while write-backs of dirty blocks keep failing, so that no
+// frame can be freed, stops there: it returns what it transferred so far,
+// or -1 with errno set to EIO.
 int lab2_open(const char *path);
 int lab2_close(int fd);
 ssize_t lab2_read(int fd, void *buf, size_t count);
@@ -12,4 +163,61 @@ ssize_t lab2_write(int fd, const void *buf, size_t count);
 off_t lab2_lseek(int fd, off_t offset, int whence);
 int lab2_fsync(int fd);
 
+// Positional and vectored variants. They neither use nor move the offset
+// of the handle, so any number of threads can call them on one descriptor
+// concurrently. A vectored read fills the buffers in order and batches the
+// misses of the whole range.
+ssize_t lab2_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t lab2_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t lab2_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t lab2_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+// Zero-copy access to whole blocks; `block` counts in the pool's block
+// size. lab2_get_block() pins a block of the file in the cache and returns
+// its frame, or NULL when the block lies past the end of the file or when
+// pins, of all callers together, already take half of the block's shard (or
+// its one block). A pinned block is never evicted; release every pin with
+// the matching put call before closing the handle. lab2_get_block_rw() may
+// also pin blocks past the end of the file: the block is marked dirty on
+// release, and the file grows to cover it. lab2_get_blocks() pins up to
+// `count` consecutive blocks and fills iov[], reading the missing ones in
+// batches; it returns how many it pinned, or -1 if none. Concurrent readers
+// of a block that is pinned for writing see its contents as they are being
+// changed.
+const void *lab2_get_block(int fd, off_t block);
+void *lab2_get_block_rw(int fd, off_t block);
+int lab2_put_block(int fd, const void *data);
+int lab2_put_block_rw(int fd, void *data);
+ssize_t lab2_get_blocks(int fd, off_t first, struct iovec *iov, size_t count, bool writable);
+int lab2_put_blocks(int fd, const struct iovec *iov, size_t count, bool writable);
+
+void lab2_config_default(lab2_config *cfg);
+int lab2_open_ex(const char *path, const lab2_config *cfg);
+int lab2_set_default_policy(lab2_policy policy);
+void lab2_get_stats(lab2_stats *st);
+int lab2_get_file_stats(int fd, lab2_stats *st);
+int lab2_get_latency(lab2_latency_op op, lab2_latency *out);
+
+// Warm start. lab2_save_manifest() writes back the file's dirty blocks
+// and saves the list of its cached blocks to `manifest`, hottest first.
+// lab2_load_manifest() queues the blocks of a manifest to be read in the
+// background, in large batches and only into free frames of the cache, and
+// returns how many it queued. A manifest of another block size, or saved
+// before the file changed inode, size or modification time, is refused
+// with ESTALE. With LAB2_WARM_DIR set, every file saves one when its last
+// handle is closed and loads it when it is opened again.
+int lab2_save_manifest(int fd, const char *manifest);
+ssize_t lab2_load_manifest(int fd, const char *manifest);
+
+// Estimates the miss ratio curve of the accesses since the pool was built,
+// from a small sample of the blocks, so that the cache can be sized from
+// live traffic. Fills up to `max` points in increasing size and returns how
+// many, 0 before enough accesses have been seen or if the pool was built
+// without mrc on. A pool of up to 4096 blocks samples every block, a
+// larger one about 4096 blocks of a working set the size of the cache to
+// start with, fewer once the working set outgrows its shadow. Threads feed
+// their samples in batches, and those of other threads may not be counted
+// yet.
+int lab2_get_mrc(lab2_mrc_point *points, size_t max);
+
 #endif
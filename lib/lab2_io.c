@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include "lab2_io.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+// ---------------------------------------------------------------------------
+// Plain syscalls: the fallback, and what LAB2_IO=sync selects.
+// ---------------------------------------------------------------------------
+
+static void sync_one(IoRequest *r) {
+    ssize_t ret;
+    if (r->iovcnt == 1) {
+        ret = r->op == IO_WRITE
+                  ? pwrite(r->fd, r->iov[0].iov_base, r->iov[0].iov_len, r->offset)
+                  : pread(r->fd, r->iov[0].iov_base, r->iov[0].iov_len, r->offset);
+    } else {
+        ret = r->op == IO_WRITE ? pwritev(r->fd, r->iov, r->iovcnt, r->offset)
+                                : preadv(r->fd, r->iov, r->iovcnt, r->offset);
+    }
+    r->result = ret < 0 ? -errno : ret;
+}
+
+static void sync_run(IoRequest *reqs, size_t n) {
+    for (size_t i = 0; i < n; i++) sync_one(&reqs[i]);
+}
+
+#ifdef HAVE_IO_URING
+
+// ---------------------------------------------------------------------------
+// io_uring, driven through the raw system calls. Every thread that does I/O
+// gets its own ring, so submission never takes a lock.
+// ---------------------------------------------------------------------------
+
+#define RING_DEPTH 128
+// The kernel limits a single registered buffer to 1 GiB.
+#define FIXED_CHUNK (1UL << 30)
+// Registering the buffers pins them once more for every ring, against
+// RLIMIT_MEMLOCK, so only the first few rings to do I/O get them.
+#define FIXED_RINGS 4
+
+typedef struct Ring {
+    int fd;
+    unsigned entries;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    uint64_t buf_gen;   // generation of the buffers it last synced with
+    bool fixed;         // the buffers are registered; changes under buf_lock
+} Ring;
+
+static pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *buf_base;
+static size_t buf_len;
+static _Atomic uint64_t buf_gen = 1;
+static Ring *fixed_rings[FIXED_RINGS]; // those with r->fixed, under buf_lock
+
+static pthread_key_t ring_key;
+static __thread Ring *my_ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+// buf_lock held.
+static void ring_unfix(Ring *r) {
+    if (!r->fixed) return;
+    sys_io_uring_register(r->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    r->fixed = false;
+    for (int i = 0; i < FIXED_RINGS; i++)
+        if (fixed_rings[i] == r) fixed_rings[i] = NULL;
+}
+
+static void ring_destroy(Ring *r) {
+    pthread_mutex_lock(&buf_lock);
+    ring_unfix(r);
+    pthread_mutex_unlock(&buf_lock);
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_len);
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_ring_len);
+    if (r->fd >= 0) close(r->fd);
+    free(r);
+}
+
+static void ring_release(void *arg) {
+    ring_destroy(arg);
+}
+
+static Ring *ring_create(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    Ring *r = calloc(1, sizeof(Ring));
+    if (!r) return NULL;
+    r->fd = sys_io_uring_setup(RING_DEPTH, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len) r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = r->sq_ring_len;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->entries = p.sq_entries;
+    r->sq_head = (_Atomic unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (_Atomic unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+
+fail:
+    ring_destroy(r);
+    return NULL;
+}
+
+// Brings the ring's fixed buffers up to date with io_set_buffers(). A ring
+// that cannot register them, or finds FIXED_RINGS others holding them,
+// works with plain buffers.
+static void ring_sync_buffers(Ring *r) {
+    if (atomic_load_explicit(&buf_gen, memory_order_acquire) == r->buf_gen) return;
+    pthread_mutex_lock(&buf_lock);
+    int free_slot = -1;
+    for (int i = 0; i < FIXED_RINGS; i++)
+        if (!fixed_rings[i]) free_slot = i;
+    if (buf_base && !r->fixed && free_slot >= 0) {
+        size_t n = (buf_len + FIXED_CHUNK - 1) / FIXED_CHUNK;
+        struct iovec *iov = calloc(n, sizeof(struct iovec));
+        if (iov) {
+            for (size_t i = 0; i < n; i++) {
+                iov[i].iov_base = buf_base + i * FIXED_CHUNK;
+                iov[i].iov_len = i + 1 < n ? FIXED_CHUNK : buf_len - i * FIXED_CHUNK;
+            }
+            r->fixed = sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+            if (r->fixed) fixed_rings[free_slot] = r;
+            free(iov);
+        }
+    }
+    r->buf_gen = atomic_load_explicit(&buf_gen, memory_order_relaxed);
+    pthread_mutex_unlock(&buf_lock);
+}
+
+static void ring_prep(Ring *r, struct io_uring_sqe *sqe, IoRequest *req, size_t idx) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    sqe->off = (uint64_t)req->offset;
+    sqe->user_data = idx;
+    char *p = req->iov[0].iov_base;
+    if (req->iovcnt == 1 && r->fixed && p >= buf_base && p + req->iov[0].iov_len <= buf_base + buf_len) {
+        sqe->opcode = req->op == IO_WRITE ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t)(uintptr_t)p;
+        sqe->len = (unsigned)req->iov[0].iov_len;
+        sqe->buf_index = (uint16_t)((size_t)(p - buf_base) / FIXED_CHUNK);
+    } else {
+        sqe->opcode = req->op == IO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uint64_t)(uintptr_t)req->iov;
+        sqe->len = (unsigned)req->iovcnt;
+    }
+}
+
+// Moves the completions the kernel posted into their requests. Returns how
+// many there were.
+static size_t ring_reap(Ring *r, IoRequest *reqs, bool *done) {
+    size_t n = 0;
+    unsigned ch = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    unsigned ct = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+    for (; ch != ct; ch++, n++) {
+        struct io_uring_cqe *cqe = &r->cqes[ch & r->cq_mask];
+        reqs[cqe->user_data].result = cqe->res;
+        done[cqe->user_data] = true;
+    }
+    atomic_store_explicit(r->cq_head, ch, memory_order_release);
+    return n;
+}
+
+// Keeps up to a ring's worth of requests in flight. Returns -1 if the ring
+// failed; completed requests have their result set, the rest was never
+// handed to the kernel and is left for the caller to run synchronously.
+static int ring_run(Ring *r, IoRequest *reqs, size_t n, bool *done) {
+    size_t next = 0, completed = 0, inflight = 0;
+    unsigned first = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    while (completed < n) {
+        unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(r->sq_head, memory_order_acquire);
+        while (next < n && inflight < r->entries && tail - head < r->entries) {
+            unsigned slot = tail & r->sq_mask;
+            ring_prep(r, &r->sqes[slot], &reqs[next], next);
+            r->sq_array[slot] = slot;
+            tail++;
+            next++;
+            inflight++;
+        }
+        atomic_store_explicit(r->sq_tail, tail, memory_order_release);
+
+        // Entries the kernel turned away last time (EAGAIN) are still queued.
+        unsigned pending = tail - atomic_load_explicit(r->sq_head, memory_order_acquire);
+        int ret = sys_io_uring_enter(r->fd, pending, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+
+        size_t reaped = ring_reap(r, reqs, done);
+        completed += reaped;
+        inflight -= reaped;
+    }
+    if (completed == n) return 0;
+
+    // What the kernel took may still complete into buffers the caller is
+    // about to reuse, or write over what it writes again, so it is waited
+    // for before the ring is given up. The kernel takes entries in order.
+    size_t taken = atomic_load_explicit(r->sq_head, memory_order_acquire) - first;
+    while (completed < taken) {
+        if (sys_io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            sched_yield();
+        completed += ring_reap(r, reqs, done);
+    }
+    return -1;
+}
+
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+static bool use_uring;
+
+static void backend_init(void) {
+    const char *v = getenv("LAB2_IO");
+    if (v && !strcmp(v, "sync")) return;
+    if (pthread_key_create(&ring_key, ring_release)) return;
+    // Probe once; threads that later fail to set up a ring fall back alone.
+    Ring *r = ring_create();
+    if (!r) return;
+    my_ring = r;
+    pthread_setspecific(ring_key, r);
+    use_uring = true;
+}
+
+static Ring *thread_ring(void) {
+    if (!my_ring) {
+        my_ring = ring_create();
+        if (my_ring) pthread_setspecific(ring_key, my_ring);
+    }
+    return my_ring;
+}
+
+void io_run(IoRequest *reqs, size_t n) {
+    pthread_once(&backend_once, backend_init);
+    if (!n) return;
+    Ring *r = use_uring ? thread_ring() : NULL;
+    if (!r || (n == 1 && reqs[0].iovcnt > 1)) {
+        // A lone vectored request gains nothing from the ring.
+        sync_run(reqs, n);
+        return;
+    }
+    ring_sync_buffers(r);
+
+    // Batches go through the ring a ring's depth at a time.
+    for (size_t at = 0; at < n; at += RING_DEPTH) {
+        size_t k = n - at < RING_DEPTH ? n - at : RING_DEPTH;
+        bool done[RING_DEPTH];
+        memset(done, 0, k);
+        if (ring_run(r, reqs + at, k, done) == 0) continue;
+        // Nothing is in flight any more; the rest never reached the kernel.
+        my_ring = NULL;
+        pthread_setspecific(ring_key, NULL);
+        ring_destroy(r);
+        for (size_t i = 0; i < k; i++)
+            if (!done[i]) sync_one(&reqs[at + i]);
+        sync_run(reqs + at + k, n - at - k);
+        return;
+    }
+}
+
+// The old buffers are unregistered from every ring right away, rather
+// than when its thread next does I/O, so that they do not stay pinned.
+void io_set_buffers(void *base, size_t len) {
+    pthread_mutex_lock(&buf_lock);
+    for (int i = 0; i < FIXED_RINGS; i++)
+        if (fixed_rings[i]) ring_unfix(fixed_rings[i]);
+    buf_base = base;
+    buf_len = base ? len : 0;
+    atomic_fetch_add_explicit(&buf_gen, 1, memory_order_release);
+    pthread_mutex_unlock(&buf_lock);
+}
+
+const char *io_backend_name(void) {
+    pthread_once(&backend_once, backend_init);
+    return use_uring ? "uring" : "sync";
+}
+
+#else
+
+void io_run(IoRequest *reqs, size_t n) {
+    sync_run(reqs, n);
+}
+
+void io_set_buffers(void *base, size_t len) {
+    (void)base;
+    (void)len;
+}
+
+const char *io_backend_name(void) {
+    return "sync";
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef LAB2_IO_H
+#define LAB2_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+enum { IO_READ, IO_WRITE };
+
+// One positioned, vectored transfer. `result` receives the number of bytes
+// transferred or -errno, like the return value of preadv/pwritev.
+typedef struct IoRequest {
+    int fd;
+    int op;
+    off_t offset;
+    const struct iovec *iov;
+    int iovcnt;
+    ssize_t result;
+} IoRequest;
+
+// Runs a batch of requests and returns once all of them completed. With the
+// io_uring backend the whole batch is in flight at once, up to the depth of
+// the calling thread's ring; otherwise the requests run one by one.
+void io_run(IoRequest *reqs, size_t n);
+
+// Declares the memory that the cache does its I/O from. The io_uring
+// backend registers it as fixed buffers with the first few rings, so their
+// single-buffer transfers skip the per-request page pinning. Pass NULL
+// before releasing the memory; no I/O may be in flight while the region
+// changes.
+void io_set_buffers(void *base, size_t len);
+
+// "uring" or "sync". LAB2_IO=sync forces the plain syscalls.
+const char *io_backend_name(void);
+
+#endif
@@ -0,0 +1,141 @@
+#include "lab2_lz.h"
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
+// Matches stop this far from the end, so that loads never run past it.
+#define LZ_TAIL 8
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Length of the common prefix of a and b, at most `max` bytes.
+static size_t match_length(const uint8_t *a, const uint8_t *b, size_t max) {
+    size_t len = 0;
+    while (len + 8 <= max) {
+        uint64_t x = load64(a + len) ^ load64(b + len);
+        if (x) return len + (size_t)__builtin_ctzll(x) / 8;
+        len += 8;
+    }
+    while (len < max && a[len] == b[len]) len++;
+    return len;
+}
+
+// Appends the continuation bytes of a length whose nibble was full.
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Appends one sequence; mlen 0 ends the stream. Returns NULL if it does
+// not fit before `end`.
+static uint8_t *put_sequence(uint8_t *op, uint8_t *end, const uint8_t *lit, size_t nlit,
+                             size_t offset, size_t mlen) {
+    size_t need = 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+    if ((size_t)(end - op) < need) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15) op = put_length(op, mlen - 15);
+    return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint8_t *op = dst, *end = dst + cap;
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+    while (n >= LZ_TAIL && ip + LZ_TAIL <= n) {
+        uint32_t seq = load32(src + ip);
+        unsigned h = lz_hash(seq);
+        size_t ref = table[h];
+        table[h] = (uint32_t)ip;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || load32(src + ref) != seq) {
+            // Step faster through data that does not match.
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        size_t mlen = LZ_MIN_MATCH + match_length(src + ref + LZ_MIN_MATCH,
+                                                  src + ip + LZ_MIN_MATCH,
+                                                  n - LZ_TAIL - ip);
+        op = put_sequence(op, end, src + anchor, ip - anchor, ip - ref, mlen);
+        if (!op) return 0;
+        ip += mlen;
+        anchor = ip;
+        if (ip + LZ_TAIL <= n) table[lz_hash(load32(src + ip - 2))] = (uint32_t)(ip - 2);
+    }
+    op = put_sequence(op, end, src + anchor, n - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+// Reads the continuation of a length whose nibble was full.
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t n) {
+    const uint8_t *ip = src, *end = src + len;
+    size_t op = 0;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_length(&ip, end, &nlit) < 0) return -1;
+        if ((size_t)(end - ip) < nlit || n - op < nlit) return -1;
+        memcpy(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == end) break;
+
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, end, &mlen) < 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (!offset || offset > op || n - op < mlen) return -1;
+        const uint8_t *ref = dst + op - offset;
+        if (offset >= mlen) {
+            memcpy(dst + op, ref, mlen);
+        } else {
+            // Overlapping: the match repeats its last `offset` bytes, so
+            // whatever is copied already can be copied again, in chunks
+            // that double.
+            for (size_t done = 0, k; done < mlen; done += k) {
+                k = done + offset < mlen - done ? done + offset : mlen - done;
+                memcpy(dst + op + done, ref, k);
+            }
+        }
+        op += mlen;
+    }
+    return op == n ? 0 : -1;
+}
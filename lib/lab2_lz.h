@@ -0,0 +1,26 @@
+#ifndef LAB2_LZ_H
+#define LAB2_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A small LZ77 compressor in the manner of LZ4: greedy matching through a
+// hash of the next four bytes, no entropy coding, a 64 KiB window. It
+// trades ratio for speed, a few GB/s to decompress, which is what a cache
+// in front of a disk wants.
+//
+// The output is a series of sequences, each a token byte, the literal
+// length beyond 15 in 255-steps, the literals, a 2-byte little-endian
+// offset and the match length beyond 19 in 255-steps. The token holds the
+// literal length in its upper and the match length less four in its lower
+// nibble. The last sequence has literals only.
+
+// Compresses n bytes into dst. Returns the compressed size, or 0 if it
+// would take more than cap bytes.
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+// Decompresses len bytes of src, which must expand to exactly n bytes.
+// Returns -1 on malformed input, without writing past dst + n.
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t n);
+
+#endif
@@ -0,0 +1,300 @@
+#include "lab2_mrc.h"
+#include "lab2_policy.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reuse distances are kept in a log-linear histogram, four buckets per
+// power of two.
+#define MRC_SUB_BITS 2
+#define MRC_LINEAR (2 << MRC_SUB_BITS)
+#define MRC_MAX_BIT 40
+#define MRC_BUCKETS (MRC_LINEAR + (MRC_MAX_BIT - MRC_SUB_BITS) * (1 << MRC_SUB_BITS))
+#define MRC_NONE UINT32_MAX
+// Sampled accesses a thread collects before taking mrc_lock.
+#define MRC_BATCH 256
+
+typedef struct MrcEntry {
+    uint64_t key;
+    uint32_t time;   // of the last access
+    uint32_t sample; // MRC_NONE while the entry is free
+    uint32_t next;   // hash chain or free list
+} MrcEntry;
+
+typedef struct MrcBuffer {
+    uint64_t gen; // of the estimate the entries belong to
+    size_t n;
+    struct {
+        uint64_t key;
+        uint32_t sample;
+    } e[MRC_BATCH];
+} MrcBuffer;
+
+_Atomic uint32_t mrc_threshold;
+
+// Bumped by every reset, so that batches collected before are dropped.
+static _Atomic uint64_t mrc_gen;
+static pthread_key_t mrc_key;
+static pthread_once_t mrc_once = PTHREAD_ONCE_INIT;
+static __thread MrcBuffer *my_buffer;
+
+// Everything below is under mrc_lock. A sampled block owns an entry, and
+// its last access time a set bit in a Fenwick tree over times, so the
+// number of blocks touched since is a prefix sum. Times run up to twice
+// the number of entries and are then renumbered densely.
+static pthread_mutex_t mrc_lock = PTHREAD_MUTEX_INITIALIZER;
+static MrcEntry *entries;
+static uint32_t *buckets;
+static uint32_t *tree;      // 1-based
+static uint32_t *by_time;   // scratch for renumbering
+static size_t nkeys;
+static size_t used;
+static size_t bucket_mask;
+static uint32_t free_list;
+static uint32_t now;
+static uint32_t horizon;
+static uint32_t threshold;
+// Every sample stands for 2^MRC_SAMPLE_BITS / threshold accesses at the
+// time it was taken.
+static double hist[MRC_BUCKETS];
+static double cold;
+
+static unsigned mrc_bucket(uint64_t blocks) {
+    if (blocks < MRC_LINEAR) return blocks;
+    if (blocks >> MRC_MAX_BIT) blocks = (1ULL << MRC_MAX_BIT) - 1;
+    unsigned bit = 63 - __builtin_clzll(blocks);
+    unsigned sub = (blocks >> (bit - MRC_SUB_BITS)) & ((1 << MRC_SUB_BITS) - 1);
+    return MRC_LINEAR + ((bit - MRC_SUB_BITS - 1) << MRC_SUB_BITS) + sub;
+}
+
+static uint64_t mrc_bucket_top(unsigned i) {
+    if (i < MRC_LINEAR) return i;
+    unsigned bit = (i - MRC_LINEAR) / (1 << MRC_SUB_BITS) + MRC_SUB_BITS + 1;
+    uint64_t sub = (i - MRC_LINEAR) % (1 << MRC_SUB_BITS);
+    uint64_t step = 1ULL << (bit - MRC_SUB_BITS);
+    return ((1ULL << MRC_SUB_BITS) + sub + 1) * step - 1;
+}
+
+static void tree_add(uint32_t t, int32_t d) {
+    for (size_t i = (size_t)t + 1; i <= horizon; i += i & -i) tree[i] += d;
+}
+
+// Set bits at times up to and including t.
+static uint32_t tree_sum(uint32_t t) {
+    uint32_t s = 0;
+    for (size_t i = (size_t)t + 1; i; i -= i & -i) s += tree[i];
+    return s;
+}
+
+static void renumber(void) {
+    for (uint32_t t = 0; t < horizon; t++) by_time[t] = MRC_NONE;
+    for (size_t i = 0; i < nkeys; i++) {
+        if (entries[i].sample != MRC_NONE) by_time[entries[i].time] = (uint32_t)i;
+    }
+    memset(tree, 0, ((size_t)horizon + 1) * sizeof(uint32_t));
+    now = 0;
+    for (uint32_t t = 0; t < horizon; t++) {
+        if (by_time[t] == MRC_NONE) continue;
+        entries[by_time[t]].time = now;
+        tree_add(now++, 1);
+    }
+}
+
+static void forget(uint32_t i) {
+    uint32_t *pp = &buckets[mix64(entries[i].key) & bucket_mask];
+    while (*pp != i) pp = &entries[*pp].next;
+    *pp = entries[i].next;
+    tree_add(entries[i].time, -1);
+    entries[i].sample = MRC_NONE;
+    entries[i].next = free_list;
+    free_list = i;
+    used--;
+}
+
+// Lowers the threshold until some sampled blocks fall above it, and
+// forgets those.
+static void shrink(void) {
+    while (used == nkeys && threshold > 1) {
+        threshold -= threshold / 8 ? threshold / 8 : 1;
+        for (size_t i = 0; i < nkeys; i++) {
+            if (entries[i].sample != MRC_NONE && entries[i].sample >= threshold) forget((uint32_t)i);
+        }
+    }
+    atomic_store_explicit(&mrc_threshold, threshold, memory_order_relaxed);
+}
+
+int mrc_reset(size_t keys, double rate) {
+    pthread_mutex_lock(&mrc_lock);
+    atomic_fetch_add_explicit(&mrc_gen, 1, memory_order_relaxed);
+    free(entries);
+    free(buckets);
+    free(tree);
+    free(by_time);
+    entries = NULL;
+    buckets = tree = by_time = NULL;
+    nkeys = used = 0;
+    threshold = 0;
+    atomic_store_explicit(&mrc_threshold, 0, memory_order_relaxed);
+    memset(hist, 0, sizeof(hist));
+    cold = 0;
+    if (!keys) {
+        pthread_mutex_unlock(&mrc_lock);
+        return 0;
+    }
+
+    size_t nb = 1;
+    while (nb < keys) nb <<= 1;
+    entries = malloc(keys * sizeof(MrcEntry));
+    buckets = malloc(nb * sizeof(uint32_t));
+    tree = calloc(2 * keys + 1, sizeof(uint32_t));
+    by_time = malloc(2 * keys * sizeof(uint32_t));
+    if (!entries || !buckets || !tree || !by_time) {
+        free(entries);
+        free(buckets);
+        free(tree);
+        free(by_time);
+        entries = NULL;
+        buckets = tree = by_time = NULL;
+        pthread_mutex_unlock(&mrc_lock);
+        return -1;
+    }
+    for (size_t i = 0; i < nb; i++) buckets[i] = MRC_NONE;
+    free_list = MRC_NONE;
+    for (size_t i = keys; i > 0; i--) {
+        entries[i - 1].sample = MRC_NONE;
+        entries[i - 1].next = free_list;
+        free_list = (uint32_t)(i - 1);
+    }
+    nkeys = keys;
+    bucket_mask = nb - 1;
+    horizon = (uint32_t)(2 * keys);
+    now = 0;
+    threshold = rate < 1 ? (uint32_t)(rate * (1u << MRC_SAMPLE_BITS)) : 1u << MRC_SAMPLE_BITS;
+    if (!threshold) threshold = 1;
+    atomic_store_explicit(&mrc_threshold, threshold, memory_order_relaxed);
+    pthread_mutex_unlock(&mrc_lock);
+    return 0;
+}
+
+// Feeds one sampled access to the shadow. One above the threshold was
+// taken before the threshold dropped. mrc_lock held.
+static void shadow_add(uint64_t key, uint32_t sample) {
+    if (sample >= threshold) return;
+    // Before any entry changes: renumbering goes by the times of all live
+    // entries, and a new one has none yet.
+    if (now == horizon) renumber();
+    double weight = (double)(1u << MRC_SAMPLE_BITS) / threshold;
+    uint32_t *head = &buckets[mix64(key) & bucket_mask];
+    uint32_t i = *head;
+    while (i != MRC_NONE && entries[i].key != key) i = entries[i].next;
+
+    if (i != MRC_NONE) {
+        // Its place in the LRU stack, counting from 1 at the top.
+        uint64_t depth = used - tree_sum(entries[i].time) + 1;
+        hist[mrc_bucket((uint64_t)(depth * weight + 0.5))] += weight;
+        tree_add(entries[i].time, -1);
+    } else {
+        if (used == nkeys) {
+            shrink();
+            if (sample >= threshold || used == nkeys) return;
+            weight = (double)(1u << MRC_SAMPLE_BITS) / threshold;
+        }
+        cold += weight;
+        i = free_list;
+        free_list = entries[i].next;
+        used++;
+        entries[i].key = key;
+        entries[i].sample = sample;
+        entries[i].next = *head;
+        *head = i;
+    }
+    entries[i].time = now;
+    tree_add(now++, 1);
+}
+
+static void drain(MrcBuffer *b) {
+    pthread_mutex_lock(&mrc_lock);
+    if (b->gen == atomic_load_explicit(&mrc_gen, memory_order_relaxed)) {
+        for (size_t i = 0; i < b->n; i++) shadow_add(b->e[i].key, b->e[i].sample);
+    }
+    pthread_mutex_unlock(&mrc_lock);
+    b->n = 0;
+}
+
+static void mrc_release(void *arg) {
+    MrcBuffer *b = arg;
+    if (b->n) drain(b);
+    free(b);
+}
+
+static void mrc_key_init(void) {
+    pthread_key_create(&mrc_key, mrc_release);
+}
+
+void mrc_sample(uint64_t key, uint32_t sample) {
+    MrcBuffer *b = my_buffer;
+    if (!b) {
+        pthread_once(&mrc_once, mrc_key_init);
+        b = malloc(sizeof(MrcBuffer));
+        if (!b) return;
+        b->n = 0;
+        pthread_setspecific(mrc_key, b);
+        my_buffer = b;
+    }
+    if (!b->n) b->gen = atomic_load_explicit(&mrc_gen, memory_order_relaxed);
+    b->e[b->n].key = key;
+    b->e[b->n].sample = sample;
+    if (++b->n == MRC_BATCH) drain(b);
+}
+
+size_t mrc_curve(lab2_mrc_point *out, size_t max, size_t block_size, uint64_t accesses) {
+    double h[MRC_BUCKETS];
+    // Other threads' batches are left out until they fill up.
+    if (my_buffer && my_buffer->n) drain(my_buffer);
+    pthread_mutex_lock(&mrc_lock);
+    memcpy(h, hist, sizeof(h));
+    double total = cold;
+    // Sampled distances are multiples of this, so the curve says nothing
+    // about smaller caches.
+    double grain = threshold ? (double)(1u << MRC_SAMPLE_BITS) / threshold : 1;
+    pthread_mutex_unlock(&mrc_lock);
+
+    for (unsigned i = 0; i < MRC_BUCKETS; i++) total += h[i];
+    if (accesses && total) {
+        double diff = (double)accesses - total;
+        for (unsigned i = 1; i < MRC_BUCKETS && diff; i++) {
+            double d = diff < -h[i] ? -h[i] : diff;
+            h[i] += d;
+            diff -= d;
+        }
+        total = (double)accesses - diff;
+    }
+
+    unsigned first = mrc_bucket((uint64_t)grain), last = 0, points = 0;
+    for (unsigned i = first; i < MRC_BUCKETS; i++) {
+        if (h[i] > 0) {
+            last = i;
+            points++;
+        }
+    }
+    if (!total || !points || !max) return 0;
+
+    // Every bucket that holds reuses changes the curve. When there are
+    // more of those than room, keep an even spread that ends at the last.
+    size_t n = 0, seen = 0;
+    double hits = 0;
+    for (unsigned i = 0; i <= last; i++) {
+        hits += h[i];
+        if (i < first || h[i] <= 0) continue;
+        seen++;
+        if (points > max && i != last && (seen * max) / points == ((seen - 1) * max) / points)
+            continue;
+        if (n == max) n--;
+        uint64_t blocks = mrc_bucket_top(i);
+        out[n].cache_blocks = blocks;
+        out[n].cache_bytes = blocks * block_size;
+        out[n].miss_ratio = 1.0 - hits / total;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,60 @@
+#ifndef LAB2_MRC_H
+#define LAB2_MRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "lab2.h"
+
+// Miss ratio curve estimation after SHARDS (Waldspurger et al., FAST '15).
+// A block is sampled when 24 bits of a hash of its key fall below a
+// threshold, so a sampled block has all of its accesses sampled. The
+// sampled blocks go through a shadow LRU that measures reuse distances,
+// scaled up by the sampling rate. The shadow tracks a fixed number of
+// blocks; when it is full the threshold drops by an eighth and blocks
+// above it are forgotten, so the rate adapts to the working set. Memory
+// stays fixed.
+//
+// Threads collect their sampled accesses in a private batch and feed it
+// to the shadow under its lock once it is full, so the lock is taken once
+// per MRC_BATCH samples rather than per access. Accesses of different
+// threads reach the shadow batch by batch, which blurs their order a
+// little.
+//
+// The curve is that of an LRU cache, whatever the pool's policy is.
+
+#define MRC_SAMPLE_BITS 24
+
+extern _Atomic uint32_t mrc_threshold;
+
+// Forgets everything and tracks up to `keys` sampled blocks from now on,
+// starting at the sampling rate `rate` (at most 1). 0 keys turns the
+// estimate off. Batches that threads collected before are dropped.
+int mrc_reset(size_t keys, double rate);
+
+// Adds a sampled access to the calling thread's batch, and feeds the batch
+// to the shadow once it is full.
+void mrc_sample(uint64_t key, uint32_t sample);
+
+// Feeds one block access. Unsampled blocks cost a hash and a compare, and
+// sampled ones an append to the thread's batch but for one in MRC_BATCH. The
+// hash is salted: mix64() maps 0 to 0, and the first block of the first
+// handle would always be sampled.
+static inline void mrc_access(uint64_t key) {
+    uint64_t x = key + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    uint32_t sample = (uint32_t)(x >> 40);
+    if (sample < atomic_load_explicit(&mrc_threshold, memory_order_relaxed))
+        mrc_sample(key, sample);
+}
+
+// Fills up to `max` points of the curve in increasing cache size, the last
+// one being the size at which only first accesses miss. Returns the number
+// of points. `accesses` counts every block access since mrc_reset(), for
+// the SHARDS_adj correction: whatever the samples over- or undercount is
+// put on the smallest reuse distance, which is where a hot block that
+// happens to be (or not be) sampled skews the estimate. 0 skips it.
+size_t mrc_curve(lab2_mrc_point *out, size_t max, size_t block_size, uint64_t accesses);
+
+#endif
@@ -0,0 +1,709 @@
+#include "lab2_policy.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// ---------------------------------------------------------------------------
+// Lists and ghost tables shared by the policies
+// ---------------------------------------------------------------------------
+
+static void list_init(PolicyList *l) {
+    l->head.prev = l->head.next = &l->head;
+    l->size = 0;
+}
+
+static void list_push_front(PolicyList *l, PolicyNode *n) {
+    n->prev = &l->head;
+    n->next = l->head.next;
+    l->head.next->prev = n;
+    l->head.next = n;
+    l->size++;
+}
+
+static void list_unlink(PolicyList *l, PolicyNode *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->prev = n->next = NULL;
+    l->size--;
+}
+
+static void list_move_front(PolicyList *l, PolicyNode *n) {
+    list_unlink(l, n);
+    list_push_front(l, n);
+}
+
+static bool can_evict(Policy *p, const PolicyNode *n) {
+    return !p->evictable || p->evictable(n);
+}
+
+// Coldest evictable node of a list; pinned nodes are stepped over in place.
+// Hits recorded by policy_touch() are replayed first, which may move the
+// node elsewhere, so the walk restarts from the tail after each one. The
+// budget keeps readers that touch faster than we replay from stalling us.
+static PolicyNode *list_coldest(Policy *p, PolicyList *l) {
+    size_t budget = 2 * l->size + 1;
+    PolicyNode *n = l->head.prev;
+    while (n != &l->head) {
+        uint8_t touched;
+        if (budget && (touched = atomic_load_explicit(&n->accessed, memory_order_relaxed))) {
+            atomic_store_explicit(&n->accessed, 0, memory_order_relaxed);
+            while (touched--) p->ops->hit(p, n);
+            budget--;
+            n = l->head.prev;
+            continue;
+        }
+        if (can_evict(p, n)) return n;
+        n = n->prev;
+    }
+    return NULL;
+}
+
+// Appends the nodes of a list to out[n..max), coldest first.
+static size_t list_collect(const PolicyList *l, PolicyNode **out, size_t n, size_t max) {
+    for (PolicyNode *x = l->head.prev; x != &l->head && n < max; x = x->prev) out[n++] = x;
+    return n;
+}
+
+// Keys of recently evicted blocks. Entries are preallocated, so keeping
+// ghosts never touches the heap after the policy is created.
+typedef struct Ghost {
+    uint64_t key;
+    struct Ghost *prev;
+    struct Ghost *next;
+    struct Ghost *hnext;
+    uint8_t list;
+} Ghost;
+
+typedef struct GhostList {
+    Ghost head;
+    size_t size;
+} GhostList;
+
+typedef struct GhostTable {
+    Ghost *entries;
+    Ghost *free;
+    Ghost **buckets;
+    size_t mask;
+    size_t capacity;
+    size_t used;
+} GhostTable;
+
+static int ghost_init(GhostTable *t, size_t capacity) {
+    size_t nb = 1;
+    if (capacity == 0) capacity = 1;
+    while (nb < capacity) nb <<= 1;
+    t->entries = calloc(capacity, sizeof(Ghost));
+    t->buckets = calloc(nb, sizeof(Ghost *));
+    if (!t->entries || !t->buckets) {
+        free(t->entries);
+        free(t->buckets);
+        return -1;
+    }
+    t->mask = nb - 1;
+    t->capacity = capacity;
+    t->used = 0;
+    t->free = NULL;
+    for (size_t i = capacity; i > 0; i--) {
+        t->entries[i - 1].hnext = t->free;
+        t->free = &t->entries[i - 1];
+    }
+    return 0;
+}
+
+static void ghost_destroy(GhostTable *t) {
+    free(t->entries);
+    free(t->buckets);
+}
+
+static void ghost_list_init(GhostList *l) {
+    l->head.prev = l->head.next = &l->head;
+    l->size = 0;
+}
+
+static Ghost *ghost_find(GhostTable *t, uint64_t key) {
+    Ghost *g = t->buckets[mix64(key) & t->mask];
+    while (g && g->key != key) g = g->hnext;
+    return g;
+}
+
+static void ghost_drop(GhostTable *t, GhostList *l, Ghost *g) {
+    Ghost **pp = &t->buckets[mix64(g->key) & t->mask];
+    while (*pp != g) pp = &(*pp)->hnext;
+    *pp = g->hnext;
+    g->prev->next = g->next;
+    g->next->prev = g->prev;
+    l->size--;
+    g->hnext = t->free;
+    t->free = g;
+    t->used--;
+}
+
+static void ghost_drop_back(GhostTable *t, GhostList *l) {
+    if (l->size) ghost_drop(t, l, l->head.prev);
+}
+
+// The caller must make room first when the table is full.
+static void ghost_push(GhostTable *t, GhostList *l, uint8_t list, uint64_t key) {
+    Ghost *g = t->free;
+    if (!g) return;
+    t->free = g->hnext;
+    t->used++;
+    g->key = key;
+    g->list = list;
+    size_t i = mix64(key) & t->mask;
+    g->hnext = t->buckets[i];
+    t->buckets[i] = g;
+    g->prev = &l->head;
+    g->next = l->head.next;
+    l->head.next->prev = g;
+    l->head.next = g;
+    l->size++;
+}
+
+static size_t max_size(size_t a, size_t b) {
+    return a > b ? a : b;
+}
+
+// ---------------------------------------------------------------------------
+// Random
+// ---------------------------------------------------------------------------
+
+typedef struct RandomPolicy {
+    Policy base;
+    PolicyNode **nodes;
+    size_t size;
+    size_t cap;
+    uint64_t rng;
+} RandomPolicy;
+
+static Policy *random_create(size_t capacity) {
+    RandomPolicy *r = calloc(1, sizeof(RandomPolicy));
+    if (!r) return NULL;
+    r->cap = max_size(capacity, 1) + POLICY_SPARE;
+    r->nodes = malloc(r->cap * sizeof(PolicyNode *));
+    if (!r->nodes) {
+        free(r);
+        return NULL;
+    }
+    r->rng = mix64((uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)r);
+    return &r->base;
+}
+
+static void random_destroy(Policy *p) {
+    RandomPolicy *r = (RandomPolicy *)p;
+    free(r->nodes);
+    free(r);
+}
+
+// A node past the headroom is left out rather than grow the array under
+// the caller's lock; it is never chosen as a victim, and removing it is a
+// no-op.
+static void random_insert(Policy *p, PolicyNode *n) {
+    RandomPolicy *r = (RandomPolicy *)p;
+    if (r->size == r->cap) {
+        n->slot = SIZE_MAX;
+        return;
+    }
+    n->slot = r->size;
+    r->nodes[r->size++] = n;
+}
+
+static void random_hit(Policy *p, PolicyNode *n) {
+    (void)p;
+    (void)n;
+}
+
+static void random_remove(Policy *p, PolicyNode *n) {
+    RandomPolicy *r = (RandomPolicy *)p;
+    if (n->slot == SIZE_MAX) return;
+    PolicyNode *last = r->nodes[--r->size];
+    r->nodes[n->slot] = last;
+    last->slot = n->slot;
+}
+
+static PolicyNode *random_victim(Policy *p, uint64_t incoming) {
+    RandomPolicy *r = (RandomPolicy *)p;
+    (void)incoming;
+    if (!r->size) return NULL;
+    r->rng ^= r->rng << 13;
+    r->rng ^= r->rng >> 7;
+    r->rng ^= r->rng << 17;
+    size_t start = r->rng % r->size;
+    for (size_t i = 0; i < r->size; i++) {
+        PolicyNode *n = r->nodes[(start + i) % r->size];
+        if (can_evict(p, n)) {
+            random_remove(p, n);
+            return n;
+        }
+    }
+    return NULL;
+}
+
+// Every node is equally cold; report them in slot order.
+static size_t random_coldest(Policy *p, PolicyNode **out, size_t max) {
+    RandomPolicy *r = (RandomPolicy *)p;
+    size_t n = 0;
+    for (; n < r->size && n < max; n++) out[n] = r->nodes[n];
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// LRU
+// ---------------------------------------------------------------------------
+
+typedef struct LruPolicy {
+    Policy base;
+    PolicyList list;
+} LruPolicy;
+
+static Policy *lru_create(size_t capacity) {
+    LruPolicy *l = calloc(1, sizeof(LruPolicy));
+    if (!l) return NULL;
+    list_init(&l->list);
+    return &l->base;
+}
+
+static void lru_destroy(Policy *p) {
+    free(p);
+}
+
+static void lru_insert(Policy *p, PolicyNode *n) {
+    list_push_front(&((LruPolicy *)p)->list, n);
+}
+
+static void lru_hit(Policy *p, PolicyNode *n) {
+    list_move_front(&((LruPolicy *)p)->list, n);
+}
+
+static void lru_remove(Policy *p, PolicyNode *n) {
+    list_unlink(&((LruPolicy *)p)->list, n);
+}
+
+static PolicyNode *lru_victim(Policy *p, uint64_t incoming) {
+    LruPolicy *l = (LruPolicy *)p;
+    (void)incoming;
+    PolicyNode *n = list_coldest(p, &l->list);
+    if (n) list_unlink(&l->list, n);
+    return n;
+}
+
+static size_t lru_coldest(Policy *p, PolicyNode **out, size_t max) {
+    return list_collect(&((LruPolicy *)p)->list, out, 0, max);
+}
+
+// ---------------------------------------------------------------------------
+// CLOCK: the list is the clock face, its tail is the hand.
+// ---------------------------------------------------------------------------
+
+typedef struct ClockPolicy {
+    Policy base;
+    PolicyList ring;
+} ClockPolicy;
+
+static Policy *clock_create(size_t capacity) {
+    ClockPolicy *c = calloc(1, sizeof(ClockPolicy));
+    if (!c) return NULL;
+    list_init(&c->ring);
+    return &c->base;
+}
+
+static void clock_destroy(Policy *p) {
+    free(p);
+}
+
+static void clock_insert(Policy *p, PolicyNode *n) {
+    n->freq = 0;
+    list_push_front(&((ClockPolicy *)p)->ring, n);
+}
+
+static void clock_hit(Policy *p, PolicyNode *n) {
+    (void)p;
+    n->freq = 1;
+}
+
+static void clock_remove(Policy *p, PolicyNode *n) {
+    list_unlink(&((ClockPolicy *)p)->ring, n);
+}
+
+static PolicyNode *clock_victim(Policy *p, uint64_t incoming) {
+    ClockPolicy *c = (ClockPolicy *)p;
+    (void)incoming;
+    PolicyNode *n;
+    while ((n = list_coldest(p, &c->ring)) && n->freq) {
+        n->freq = 0;
+        list_move_front(&c->ring, n);
+    }
+    if (n) list_unlink(&c->ring, n);
+    return n;
+}
+
+// Starts at the hand; referenced nodes would get a second chance first,
+// which the order ignores.
+static size_t clock_coldest(Policy *p, PolicyNode **out, size_t max) {
+    return list_collect(&((ClockPolicy *)p)->ring, out, 0, max);
+}
+
+// ---------------------------------------------------------------------------
+// 2Q (Johnson & Shasha): A1in FIFO, A1out ghost FIFO, Am LRU.
+// ---------------------------------------------------------------------------
+
+enum { Q_A1IN = 1, Q_AM = POLICY_QUEUE_FREQUENT };
+
+typedef struct TwoQPolicy {
+    Policy base;
+    PolicyList a1in;
+    PolicyList am;
+    GhostList a1out;
+    GhostTable ghosts;
+    size_t kin;
+} TwoQPolicy;
+
+static Policy *twoq_create(size_t capacity) {
+    TwoQPolicy *q = calloc(1, sizeof(TwoQPolicy));
+    if (!q) return NULL;
+    if (ghost_init(&q->ghosts, max_size(capacity / 2, 1)) < 0) {
+        free(q);
+        return NULL;
+    }
+    list_init(&q->a1in);
+    list_init(&q->am);
+    ghost_list_init(&q->a1out);
+    q->kin = max_size(capacity / 4, 1);
+    return &q->base;
+}
+
+static void twoq_destroy(Policy *p) {
+    TwoQPolicy *q = (TwoQPolicy *)p;
+    ghost_destroy(&q->ghosts);
+    free(q);
+}
+
+static void twoq_insert(Policy *p, PolicyNode *n) {
+    TwoQPolicy *q = (TwoQPolicy *)p;
+    Ghost *g = ghost_find(&q->ghosts, n->key);
+    if (g) {
+        ghost_drop(&q->ghosts, &q->a1out, g);
+        n->queue = Q_AM;
+        list_push_front(&q->am, n);
+    } else {
+        n->queue = Q_A1IN;
+        list_push_front(&q->a1in, n);
+    }
+}
+
+static void twoq_hit(Policy *p, PolicyNode *n) {
+    if (n->queue == Q_AM) list_move_front(&((TwoQPolicy *)p)->am, n);
+}
+
+static void twoq_remove(Policy *p, PolicyNode *n) {
+    TwoQPolicy *q = (TwoQPolicy *)p;
+    list_unlink(n->queue == Q_AM ? &q->am : &q->a1in, n);
+}
+
+static PolicyNode *twoq_victim(Policy *p, uint64_t incoming) {
+    TwoQPolicy *q = (TwoQPolicy *)p;
+    (void)incoming;
+    PolicyNode *n = NULL;
+    if (q->a1in.size > q->kin || !q->am.size) n = list_coldest(p, &q->a1in);
+    if (!n) {
+        n = list_coldest(p, &q->am);
+        if (n) {
+            list_unlink(&q->am, n);
+            return n;
+        }
+        n = list_coldest(p, &q->a1in);
+        if (!n) return NULL;
+    }
+    list_unlink(&q->a1in, n);
+    if (q->ghosts.used == q->ghosts.capacity) ghost_drop_back(&q->ghosts, &q->a1out);
+    ghost_push(&q->ghosts, &q->a1out, 0, n->key);
+    return n;
+}
+
+static size_t twoq_coldest(Policy *p, PolicyNode **out, size_t max) {
+    TwoQPolicy *q = (TwoQPolicy *)p;
+    bool in_first = q->a1in.size > q->kin || !q->am.size;
+    size_t n = list_collect(in_first ? &q->a1in : &q->am, out, 0, max);
+    return list_collect(in_first ? &q->am : &q->a1in, out, n, max);
+}
+
+// ---------------------------------------------------------------------------
+// ARC (Megiddo & Modha): T1/T2 resident, B1/B2 ghosts, adaptive target p.
+// ---------------------------------------------------------------------------
+
+enum { ARC_T1 = 1, ARC_T2 = POLICY_QUEUE_FREQUENT, ARC_B1, ARC_B2 };
+
+typedef struct ArcPolicy {
+    Policy base;
+    PolicyList t1;
+    PolicyList t2;
+    GhostList b1;
+    GhostList b2;
+    GhostTable ghosts;
+    size_t p;
+    bool adapted;
+    uint64_t adapted_key;
+} ArcPolicy;
+
+static Policy *arc_create(size_t capacity) {
+    ArcPolicy *a = calloc(1, sizeof(ArcPolicy));
+    if (!a) return NULL;
+    if (ghost_init(&a->ghosts, max_size(2 * capacity, 1)) < 0) {
+        free(a);
+        return NULL;
+    }
+    a->base.capacity = max_size(capacity, 1);
+    list_init(&a->t1);
+    list_init(&a->t2);
+    ghost_list_init(&a->b1);
+    ghost_list_init(&a->b2);
+    return &a->base;
+}
+
+static void arc_destroy(Policy *p) {
+    ArcPolicy *a = (ArcPolicy *)p;
+    ghost_destroy(&a->ghosts);
+    free(a);
+}
+
+static void arc_adapt(ArcPolicy *a, Ghost *g) {
+    size_t c = a->base.capacity;
+    if (g->list == ARC_B1) {
+        size_t d = max_size(a->b2.size / max_size(a->b1.size, 1), 1);
+        a->p = a->p + d < c ? a->p + d : c;
+    } else {
+        size_t d = max_size(a->b1.size / max_size(a->b2.size, 1), 1);
+        a->p = a->p > d ? a->p - d : 0;
+    }
+}
+
+static void arc_to_ghost(ArcPolicy *a, GhostList *l, uint8_t list, uint64_t key) {
+    if (a->ghosts.used == a->ghosts.capacity)
+        ghost_drop_back(&a->ghosts, a->b1.size >= a->b2.size ? &a->b1 : &a->b2);
+    ghost_push(&a->ghosts, l, list, key);
+}
+
+static void arc_insert(Policy *p, PolicyNode *n) {
+    ArcPolicy *a = (ArcPolicy *)p;
+    size_t c = a->base.capacity;
+    Ghost *g = ghost_find(&a->ghosts, n->key);
+    if (g) {
+        if (!a->adapted || a->adapted_key != n->key) arc_adapt(a, g);
+        ghost_drop(&a->ghosts, g->list == ARC_B1 ? &a->b1 : &a->b2, g);
+        n->queue = ARC_T2;
+        list_push_front(&a->t2, n);
+    } else {
+        if (a->t1.size + a->b1.size >= c && a->b1.size) {
+            ghost_drop_back(&a->ghosts, &a->b1);
+        } else if (a->t1.size + a->t2.size + a->b1.size + a->b2.size >= 2 * c && a->b2.size) {
+            ghost_drop_back(&a->ghosts, &a->b2);
+        }
+        n->queue = ARC_T1;
+        list_push_front(&a->t1, n);
+    }
+    a->adapted = false;
+}
+
+static void arc_hit(Policy *p, PolicyNode *n) {
+    ArcPolicy *a = (ArcPolicy *)p;
+    list_unlink(n->queue == ARC_T1 ? &a->t1 : &a->t2, n);
+    n->queue = ARC_T2;
+    list_push_front(&a->t2, n);
+}
+
+static void arc_remove(Policy *p, PolicyNode *n) {
+    ArcPolicy *a = (ArcPolicy *)p;
+    list_unlink(n->queue == ARC_T1 ? &a->t1 : &a->t2, n);
+}
+
+static PolicyNode *arc_victim(Policy *p, uint64_t incoming) {
+    ArcPolicy *a = (ArcPolicy *)p;
+    Ghost *g = ghost_find(&a->ghosts, incoming);
+    bool in_b2 = g && g->list == ARC_B2;
+    PolicyNode *n;
+    if (g) {
+        arc_adapt(a, g);
+        a->adapted = true;
+        a->adapted_key = incoming;
+    }
+    bool from_t1 = a->t1.size &&
+                   ((in_b2 && a->t1.size == a->p) || a->t1.size > a->p || !a->t2.size);
+    n = list_coldest(p, from_t1 ? &a->t1 : &a->t2);
+    if (!n) {
+        from_t1 = !from_t1;
+        n = list_coldest(p, from_t1 ? &a->t1 : &a->t2);
+        if (!n) return NULL;
+    }
+    if (from_t1) {
+        list_unlink(&a->t1, n);
+        arc_to_ghost(a, &a->b1, ARC_B1, n->key);
+    } else {
+        list_unlink(&a->t2, n);
+        arc_to_ghost(a, &a->b2, ARC_B2, n->key);
+    }
+    return n;
+}
+
+static size_t arc_coldest(Policy *p, PolicyNode **out, size_t max) {
+    ArcPolicy *a = (ArcPolicy *)p;
+    bool t1_first = a->t1.size > a->p || !a->t2.size;
+    size_t n = list_collect(t1_first ? &a->t1 : &a->t2, out, 0, max);
+    return list_collect(t1_first ? &a->t2 : &a->t1, out, n, max);
+}
+
+// ---------------------------------------------------------------------------
+// S3-FIFO (Yang et al.): small FIFO, main FIFO with reinsertion, ghost FIFO.
+// ---------------------------------------------------------------------------
+
+enum { S3_SMALL = 1, S3_MAIN = POLICY_QUEUE_FREQUENT };
+
+typedef struct S3FifoPolicy {
+    Policy base;
+    PolicyList small;
+    PolicyList main;
+    GhostList ghost;
+    GhostTable ghosts;
+    size_t small_target;
+} S3FifoPolicy;
+
+static Policy *s3fifo_create(size_t capacity) {
+    S3FifoPolicy *s = calloc(1, sizeof(S3FifoPolicy));
+    if (!s) return NULL;
+    if (ghost_init(&s->ghosts, max_size(capacity, 1)) < 0) {
+        free(s);
+        return NULL;
+    }
+    list_init(&s->small);
+    list_init(&s->main);
+    ghost_list_init(&s->ghost);
+    s->small_target = max_size(capacity / 10, 1);
+    return &s->base;
+}
+
+static void s3fifo_destroy(Policy *p) {
+    S3FifoPolicy *s = (S3FifoPolicy *)p;
+    ghost_destroy(&s->ghosts);
+    free(s);
+}
+
+static void s3fifo_insert(Policy *p, PolicyNode *n) {
+    S3FifoPolicy *s = (S3FifoPolicy *)p;
+    Ghost *g = ghost_find(&s->ghosts, n->key);
+    n->freq = 0;
+    if (g) {
+        ghost_drop(&s->ghosts, &s->ghost, g);
+        n->queue = S3_MAIN;
+        list_push_front(&s->main, n);
+    } else {
+        n->queue = S3_SMALL;
+        list_push_front(&s->small, n);
+    }
+}
+
+static void s3fifo_hit(Policy *p, PolicyNode *n) {
+    (void)p;
+    if (n->freq < 3) n->freq++;
+}
+
+static void s3fifo_remove(Policy *p, PolicyNode *n) {
+    S3FifoPolicy *s = (S3FifoPolicy *)p;
+    list_unlink(n->queue == S3_MAIN ? &s->main : &s->small, n);
+}
+
+static PolicyNode *s3fifo_victim(Policy *p, uint64_t incoming) {
+    S3FifoPolicy *s = (S3FifoPolicy *)p;
+    (void)incoming;
+    for (;;) {
+        PolicyNode *n = NULL;
+        bool from_small = false;
+        if (s->small.size >= s->small_target || !s->main.size) {
+            n = list_coldest(p, &s->small);
+            from_small = n != NULL;
+        }
+        if (!n) n = list_coldest(p, &s->main);
+        if (!n) {
+            n = list_coldest(p, &s->small);
+            from_small = true;
+        }
+        if (!n) return NULL;
+
+        if (from_small) {
+            list_unlink(&s->small, n);
+            if (n->freq > 1) {
+                n->freq = 0;
+                n->queue = S3_MAIN;
+                list_push_front(&s->main, n);
+                continue;
+            }
+            if (s->ghosts.used == s->ghosts.capacity) ghost_drop_back(&s->ghosts, &s->ghost);
+            ghost_push(&s->ghosts, &s->ghost, 0, n->key);
+            return n;
+        }
+        if (n->freq) {
+            n->freq--;
+            list_move_front(&s->main, n);
+            continue;
+        }
+        list_unlink(&s->main, n);
+        return n;
+    }
+}
+
+static size_t s3fifo_coldest(Policy *p, PolicyNode **out, size_t max) {
+    S3FifoPolicy *s = (S3FifoPolicy *)p;
+    bool small_first = s->small.size >= s->small_target || !s->main.size;
+    size_t n = list_collect(small_first ? &s->small : &s->main, out, 0, max);
+    return list_collect(small_first ? &s->main : &s->small, out, n, max);
+}
+
+// ---------------------------------------------------------------------------
+
+static const PolicyOps policy_table[] = {
+    [LAB2_POLICY_RANDOM] = { "random", random_create, random_destroy, random_insert,
+                             random_hit, random_victim, random_remove,
+                             random_coldest },
+    [LAB2_POLICY_LRU]    = { "lru", lru_create, lru_destroy, lru_insert,
+                             lru_hit, lru_victim, lru_remove,
+                             lru_coldest },
+    [LAB2_POLICY_CLOCK]  = { "clock", clock_create, clock_destroy, clock_insert,
+                             clock_hit, clock_victim, clock_remove,
+                             clock_coldest },
+    [LAB2_POLICY_2Q]     = { "2q", twoq_create, twoq_destroy, twoq_insert,
+                             twoq_hit, twoq_victim, twoq_remove,
+                             twoq_coldest },
+    [LAB2_POLICY_ARC]    = { "arc", arc_create, arc_destroy, arc_insert,
+                             arc_hit, arc_victim, arc_remove,
+                             arc_coldest },
+    [LAB2_POLICY_S3FIFO] = { "s3fifo", s3fifo_create, s3fifo_destroy, s3fifo_insert,
+                             s3fifo_hit, s3fifo_victim, s3fifo_remove,
+                             s3fifo_coldest },
+};
+
+#define POLICY_COUNT (sizeof(policy_table) / sizeof(policy_table[0]))
+
+Policy *policy_create(lab2_policy kind, size_t capacity) {
+    if (!policy_name(kind)) return NULL;
+    Policy *p = policy_table[kind].create(capacity);
+    if (!p) return NULL;
+    p->ops = &policy_table[kind];
+    p->capacity = max_size(capacity, 1);
+    p->evictable = NULL;
+    return p;
+}
+
+int policy_parse(const char *name, lab2_policy *out) {
+    for (size_t i = 0; i < POLICY_COUNT; i++) {
+        if (policy_table[i].name && strcasecmp(name, policy_table[i].name) == 0) {
+            *out = (lab2_policy)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// NULL for LAB2_POLICY_DEFAULT, which only stands for another one.
+const char *policy_name(lab2_policy kind) {
+    if ((unsigned)kind >= POLICY_COUNT) return NULL;
+    return policy_table[kind].name;
+}
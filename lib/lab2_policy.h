@@ -0,0 +1,118 @@
+#ifndef LAB2_POLICY_H
+#define LAB2_POLICY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "lab2.h"
+
+// Intrusive node embedded into every cached block. The fields are shared by
+// all policies: each one uses only the subset it needs.
+typedef struct PolicyNode {
+    struct PolicyNode *prev;
+    struct PolicyNode *next;
+    uint64_t key;
+    size_t slot;
+    uint8_t queue;
+    uint8_t freq;
+    _Atomic uint8_t accessed;
+} PolicyNode;
+
+// Nodes a policy may hold beyond its capacity: blocks inserted while the
+// ones it would evict are pinned. Policies that keep an array size it for
+// this many more, since nothing may allocate on the insert path.
+#define POLICY_SPARE 64
+
+// Policies with a queue for blocks that were hit again after entering
+// (2Q's Am, ARC's T2, S3-FIFO's main) number it the same.
+#define POLICY_QUEUE_FREQUENT 2
+
+typedef struct PolicyList {
+    PolicyNode head;
+    size_t size;
+} PolicyList;
+
+typedef struct Policy Policy;
+
+typedef struct PolicyOps {
+    const char *name;
+    Policy *(*create)(size_t capacity);
+    void (*destroy)(Policy *p);
+    void (*insert)(Policy *p, PolicyNode *n);
+    void (*hit)(Policy *p, PolicyNode *n);
+    PolicyNode *(*victim)(Policy *p, uint64_t incoming);
+    void (*remove)(Policy *p, PolicyNode *n);
+    size_t (*coldest)(Policy *p, PolicyNode **out, size_t max);
+} PolicyOps;
+
+struct Policy {
+    const PolicyOps *ops;
+    size_t capacity;
+    // Optional owner hook: victims are only chosen among nodes for which
+    // it returns true. Pinned nodes keep their place in the policy.
+    bool (*evictable)(const PolicyNode *n);
+};
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+Policy *policy_create(lab2_policy kind, size_t capacity);
+int policy_parse(const char *name, lab2_policy *out);
+const char *policy_name(lab2_policy kind);
+
+static inline void policy_destroy(Policy *p) {
+    p->ops->destroy(p);
+}
+
+// Called once for every block that enters the cache.
+static inline void policy_insert(Policy *p, PolicyNode *n) {
+    atomic_store_explicit(&n->accessed, 0, memory_order_relaxed);
+    p->ops->insert(p, n);
+}
+
+static inline void policy_hit(Policy *p, PolicyNode *n) {
+    p->ops->hit(p, n);
+}
+
+// Records a hit without holding the owner's lock. The policy replays the
+// recorded hits once the node comes up for eviction. The count saturates,
+// so a hot node stops writing to its cache line after a few touches.
+#define POLICY_TOUCH_MAX 3
+
+static inline void policy_touch(PolicyNode *n) {
+    uint8_t a = atomic_load_explicit(&n->accessed, memory_order_relaxed);
+    if (a < POLICY_TOUCH_MAX) atomic_store_explicit(&n->accessed, a + 1, memory_order_relaxed);
+}
+
+// Whether the node has been hit since it entered the cache, as far as the
+// policy remembers. Owner's lock held.
+static inline bool policy_frequent(const PolicyNode *n) {
+    return n->queue == POLICY_QUEUE_FREQUENT || n->freq ||
+           atomic_load_explicit(&n->accessed, memory_order_relaxed);
+}
+
+// Picks a victim and detaches it from the policy. `incoming` is the key of
+// the block that is about to be inserted; ARC uses it to steer replacement.
+// Returns NULL when every node is pinned.
+static inline PolicyNode *policy_victim(Policy *p, uint64_t incoming) {
+    return p->ops->victim(p, incoming);
+}
+
+// Detaches a block that leaves the cache without being chosen as a victim.
+static inline void policy_remove(Policy *p, PolicyNode *n) {
+    p->ops->remove(p, n);
+}
+
+// Fills out[] with up to `max` nodes, roughly in the order they would be
+// evicted, without changing any policy state. Pinned nodes are included.
+static inline size_t policy_coldest(Policy *p, PolicyNode **out, size_t max) {
+    return p->ops->coldest(p, out, max);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "lab2_record.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Entries a thread collects before appending them to the file.
+#define RECORD_BATCH 4096
+
+typedef struct RecordBuffer {
+    size_t n;
+    RecordEntry e[RECORD_BATCH];
+} RecordBuffer;
+
+atomic_bool record_on;
+
+// The file is only written under record_lock. It is never reopened once a
+// block size mismatch has stopped it, which would truncate the trace.
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int record_fd = -1;
+static bool record_started;
+static size_t record_block_size;
+static uint64_t record_epoch; // CLOCK_MONOTONIC ns when recording started
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static __thread RecordBuffer *my_buffer;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// record_lock held.
+static void record_stop(void) {
+    atomic_store_explicit(&record_on, false, memory_order_relaxed);
+    if (record_fd >= 0) close(record_fd);
+    record_fd = -1;
+}
+
+static int write_all(int fd, const void *p, size_t len) {
+    const char *c = p;
+    while (len) {
+        ssize_t n = write(fd, c, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Entries that reach a stopped recorder are dropped.
+static void write_out(RecordBuffer *b) {
+    pthread_mutex_lock(&record_lock);
+    if (record_fd >= 0 && write_all(record_fd, b->e, b->n * sizeof(RecordEntry)) < 0)
+        record_stop();
+    pthread_mutex_unlock(&record_lock);
+    b->n = 0;
+}
+
+static void record_release(void *arg) {
+    RecordBuffer *b = arg;
+    if (b->n) write_out(b);
+    free(b);
+}
+
+// The main thread's buffer gets no key destructor.
+static void record_exit(void) {
+    record_flush();
+}
+
+static void record_key_init(void) {
+    pthread_key_create(&record_key, record_release);
+    atexit(record_exit);
+}
+
+int record_start(const char *path, size_t block_size) {
+    pthread_once(&record_once, record_key_init);
+    pthread_mutex_lock(&record_lock);
+    int ret = 0;
+    if (record_started) {
+        if (record_fd < 0 || block_size != record_block_size) {
+            record_stop();
+            ret = -1;
+        }
+        pthread_mutex_unlock(&record_lock);
+        return ret;
+    }
+    record_started = true;
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    RecordHeader h = { RECORD_MAGIC, RECORD_VERSION, (uint32_t)block_size };
+    if (record_fd < 0 || write_all(record_fd, &h, sizeof(h)) < 0) {
+        record_stop();
+        ret = -1;
+    } else {
+        record_block_size = block_size;
+        record_epoch = clock_ns();
+        atomic_store_explicit(&record_on, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&record_lock);
+    return ret;
+}
+
+void record_append(uint32_t file, uint64_t block, uint64_t flags) {
+    RecordBuffer *b = my_buffer;
+    if (!b) {
+        b = malloc(sizeof(RecordBuffer));
+        if (!b) return;
+        b->n = 0;
+        pthread_setspecific(record_key, b);
+        my_buffer = b;
+    }
+    b->e[b->n++] = (RecordEntry){
+        .ns = clock_ns() - record_epoch,
+        .word = flags | ((uint64_t)(file & RECORD_FILE_MASK) << RECORD_FILE_SHIFT) |
+                (block & RECORD_BLOCK_MASK),
+    };
+    if (b->n == RECORD_BATCH) write_out(b);
+}
+
+void record_flush(void) {
+    if (my_buffer && my_buffer->n) write_out(my_buffer);
+}
@@ -0,0 +1,71 @@
+#ifndef LAB2_RECORD_H
+#define LAB2_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Access traces for offline replay. While recording, every block a caller
+// reads, writes or pins is appended to the trace file as a 16-byte entry.
+// Threads fill private batches and append them whole, so entries of
+// different threads interleave batch by batch; the timestamps give the
+// exact order.
+//
+// The file starts with a RecordHeader, followed by RecordEntry values in
+// host byte order until the end.
+
+#define RECORD_MAGIC 0x314352543242414cULL // "LAB2TRC1" on little-endian hosts
+#define RECORD_VERSION 2
+
+typedef struct RecordHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+} RecordHeader;
+
+// `word` packs the block number in bits 0-37, the file id in bits 38-61
+// and the flags on top. The id names the file, not the handle: every open
+// of one file shares its cached blocks and records the same id, and files
+// opened anew get new ids, so a replay caches what the pool did. The field
+// is as wide as the part of the id that block keys keep, so files the
+// pool tells apart stay apart in the trace.
+typedef struct RecordEntry {
+    uint64_t ns; // since recording started
+    uint64_t word;
+} RecordEntry;
+
+#define RECORD_WRITE (1ULL << 63)
+#define RECORD_DIRECT (1ULL << 62) // moved by direct I/O, bypassing the cache
+#define RECORD_FILE_BITS 24
+#define RECORD_FILE_SHIFT 38
+#define RECORD_FILE_MASK ((1ULL << RECORD_FILE_BITS) - 1)
+#define RECORD_BLOCK_MASK ((1ULL << RECORD_FILE_SHIFT) - 1)
+
+static inline uint64_t record_block(uint64_t word) {
+    return word & RECORD_BLOCK_MASK;
+}
+
+static inline uint32_t record_file(uint64_t word) {
+    return (uint32_t)((word >> RECORD_FILE_SHIFT) & RECORD_FILE_MASK);
+}
+
+// Starts recording into `path` for a pool of the given block size.
+// Calling it again with the same block size keeps the current trace; a
+// different block size stops recording, since block numbers would no
+// longer be comparable. Returns -1 if the file cannot be written.
+int record_start(const char *path, size_t block_size);
+
+// Writes out the calling thread's pending entries.
+void record_flush(void);
+
+extern atomic_bool record_on;
+
+void record_append(uint32_t file, uint64_t block, uint64_t flags);
+
+// Logs one block access. Costs a single load while no trace is recorded.
+static inline void record_access(uint32_t file, uint64_t block, uint64_t flags) {
+    if (atomic_load_explicit(&record_on, memory_order_acquire)) record_append(file, block, flags);
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include "lab2_sketch.h"
+#include "lab2_policy.h"
+#include <stdlib.h>
+
+#define SKETCH_LINE 64
+#define SKETCH_ROWS 4
+#define SKETCH_ROW_WIDTH (SKETCH_LINE / SKETCH_ROWS)
+#define SKETCH_WIDTH_MUL 4
+#define SKETCH_PERIOD_MUL 10
+
+Sketch *sketch_create(size_t blocks) {
+    Sketch *s = calloc(1, sizeof(Sketch));
+    if (!s) return NULL;
+    // A few counters per block in every row: the keys counted in a period
+    // are many more than the blocks the cache holds.
+    size_t lines = 1;
+    while (lines * SKETCH_ROW_WIDTH < blocks * SKETCH_WIDTH_MUL) lines <<= 1;
+    if (posix_memalign((void **)&s->counters, SKETCH_LINE, lines * SKETCH_LINE)) {
+        free(s);
+        return NULL;
+    }
+    for (size_t i = 0; i < lines * SKETCH_LINE; i++) atomic_init(&s->counters[i], 0);
+    s->mask = lines - 1;
+    size_t period = blocks * SKETCH_PERIOD_MUL;
+    s->period = period > UINT32_MAX / 2 ? UINT32_MAX / 2 : (uint32_t)period;
+    if (!s->period) s->period = SKETCH_PERIOD_MUL;
+    return s;
+}
+
+void sketch_destroy(Sketch *s) {
+    if (!s) return;
+    free(s->counters);
+    free(s);
+}
+
+// The line comes from the low bits of the hash, the counter of each row
+// from four of its upper bits.
+static _Atomic uint8_t *counter(const Sketch *s, uint64_t hash, unsigned row) {
+    size_t line = hash & s->mask;
+    unsigned col = (hash >> (32 + 4 * row)) & (SKETCH_ROW_WIDTH - 1);
+    return &s->counters[line * SKETCH_LINE + row * SKETCH_ROW_WIDTH + col];
+}
+
+// Halves every counter. Increments that race with it may be lost.
+static void age(Sketch *s) {
+    for (size_t i = 0; i < (s->mask + 1) * SKETCH_LINE; i++) {
+        uint8_t c = atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+        if (c) atomic_store_explicit(&s->counters[i], c >> 1, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&s->adds, s->period / 2, memory_order_relaxed);
+}
+
+// Conservative update: only the counters at the key's current estimate
+// go up, since the others are inflated by other keys already. Counters at
+// their maximum are not written, so hot keys stop dirtying their line, and
+// neither is `adds` unless something changed.
+void sketch_add(Sketch *s, uint64_t key) {
+    uint64_t hash = mix64(key ^ 0x9e3779b97f4a7c15ULL);
+    _Atomic uint8_t *c[SKETCH_ROWS];
+    uint8_t v[SKETCH_ROWS], min = SKETCH_MAX;
+    for (unsigned row = 0; row < SKETCH_ROWS; row++) {
+        c[row] = counter(s, hash, row);
+        v[row] = atomic_load_explicit(c[row], memory_order_relaxed);
+        if (v[row] < min) min = v[row];
+    }
+    if (min == SKETCH_MAX) return;
+    for (unsigned row = 0; row < SKETCH_ROWS; row++)
+        if (v[row] == min) atomic_store_explicit(c[row], min + 1, memory_order_relaxed);
+    if (atomic_fetch_add_explicit(&s->adds, 1, memory_order_relaxed) + 1 == s->period) age(s);
+}
+
+unsigned sketch_estimate(const Sketch *s, uint64_t key) {
+    uint64_t hash = mix64(key ^ 0x9e3779b97f4a7c15ULL);
+    unsigned min = SKETCH_MAX;
+    for (unsigned row = 0; row < SKETCH_ROWS; row++) {
+        uint8_t v = atomic_load_explicit(counter(s, hash, row), memory_order_relaxed);
+        if (v < min) min = v;
+    }
+    return min;
+}
@@ -0,0 +1,35 @@
+#ifndef LAB2_SKETCH_H
+#define LAB2_SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Count-min sketch of block access frequencies, for TinyLFU admission
+// (Einziger et al., "TinyLFU: A Highly Efficient Cache Admission Policy").
+// A key has four counters, one per row, all in the same 64-byte line, so
+// an update touches a single cache line. Counters saturate at 15. Once the
+// increments add up to ten times the number of blocks the sketch was sized
+// for, every counter is halved, so that old popularity fades.
+//
+// Counters are updated with relaxed atomics and no lock. Racing increments
+// may get lost, which only makes an estimate a little low.
+
+#define SKETCH_MAX 15
+
+typedef struct Sketch {
+    _Atomic uint32_t adds; // since the last halving
+    uint32_t period;
+    size_t mask;           // lines - 1
+    _Atomic uint8_t *counters;
+} Sketch;
+
+Sketch *sketch_create(size_t blocks);
+void sketch_destroy(Sketch *s);
+
+void sketch_add(Sketch *s, uint64_t key);
+
+// An upper bound of the accesses to the key since about one period ago.
+unsigned sketch_estimate(const Sketch *s, uint64_t key);
+
+#endif
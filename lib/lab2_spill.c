@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include "lab2_spill.h"
+#include "lab2_policy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+int spill_open(const char *path, size_t bytes) {
+    // Victims are not read again soon enough to be worth the page cache,
+    // and frames have the alignment direct I/O wants. Not every file
+    // system takes O_DIRECT, though.
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_DIRECT, 0600);
+    if (fd < 0 && errno == EINVAL) fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    // Only truncate once the file is ours; another process may be using it.
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        int err = errno == EWOULDBLOCK ? EBUSY : errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (ftruncate(fd, 0) < 0 ||
+        (fallocate(fd, 0, 0, (off_t)bytes) < 0 &&
+         (errno != EOPNOTSUPP || ftruncate(fd, (off_t)bytes) < 0))) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+Spill *spill_create(int fd, off_t base, size_t nslots, size_t block_size) {
+    if (!nslots || nslots > UINT32_MAX / 2) return NULL;
+    Spill *sp = calloc(1, sizeof(*sp));
+    if (!sp) return NULL;
+    sp->fd = fd;
+    sp->base = base;
+    sp->block_size = block_size;
+    sp->nslots = (uint32_t)nslots;
+    size_t slots = 16;
+    while (slots < 2 * nslots) slots <<= 1;
+    sp->index_mask = slots - 1;
+    sp->owner = malloc(nslots * sizeof(uint64_t));
+    sp->state = calloc(nslots, 1);
+    sp->index = calloc(slots, sizeof(uint32_t));
+    if (!sp->owner || !sp->state || !sp->index) {
+        spill_destroy(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+void spill_destroy(Spill *sp) {
+    if (!sp) return;
+    free(sp->owner);
+    free(sp->state);
+    free(sp->index);
+    free(sp);
+}
+
+static uint32_t *find(Spill *sp, uint64_t key) {
+    for (size_t i = mix64(key) & sp->index_mask;; i = (i + 1) & sp->index_mask) {
+        uint32_t *e = &sp->index[i];
+        if (!*e || sp->owner[*e - 1] == key) return e;
+    }
+}
+
+// Deletes by shifting back the entries that probed past it, as the
+// compressed tier does.
+static void unindex(Spill *sp, uint32_t *e) {
+    size_t i = e - sp->index, j = i;
+    for (;;) {
+        j = (j + 1) & sp->index_mask;
+        if (!sp->index[j]) break;
+        size_t home = mix64(sp->owner[sp->index[j] - 1]) & sp->index_mask;
+        if (((j - home) & sp->index_mask) < ((j - i) & sp->index_mask)) continue;
+        sp->index[i] = sp->index[j];
+        i = j;
+    }
+    sp->index[i] = 0;
+}
+
+bool spill_reserve(Spill *sp, uint32_t *slot) {
+    for (uint32_t tries = 0; tries < sp->nslots; tries++) {
+        uint32_t s = sp->head;
+        sp->head = s + 1 == sp->nslots ? 0 : s + 1;
+        if (sp->state[s] == SPILL_BUSY) continue;
+        if (sp->state[s] == SPILL_VALID) unindex(sp, find(sp, sp->owner[s]));
+        sp->state[s] = SPILL_BUSY;
+        *slot = s;
+        return true;
+    }
+    return false;
+}
+
+void spill_commit(Spill *sp, uint32_t slot, uint64_t key) {
+    uint32_t *e = find(sp, key);
+    if (*e) {
+        sp->state[*e - 1] = SPILL_FREE;
+        unindex(sp, e);
+        e = find(sp, key);
+    }
+    sp->owner[slot] = key;
+    sp->state[slot] = SPILL_VALID;
+    *e = slot + 1;
+}
+
+bool spill_take(Spill *sp, uint64_t key, uint32_t *slot) {
+    uint32_t *e = find(sp, key);
+    if (!*e) return false;
+    *slot = *e - 1;
+    sp->state[*slot] = SPILL_BUSY;
+    unindex(sp, e);
+    return true;
+}
+
+void spill_release(Spill *sp, uint32_t slot) {
+    sp->state[slot] = SPILL_FREE;
+}
+
+void spill_clear(Spill *sp) {
+    for (uint32_t s = 0; s < sp->nslots; s++)
+        if (sp->state[s] == SPILL_VALID) sp->state[s] = SPILL_FREE;
+    memset(sp->index, 0, (sp->index_mask + 1) * sizeof(uint32_t));
+}
@@ -0,0 +1,69 @@
+#ifndef LAB2_SPILL_H
+#define LAB2_SPILL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Victim tier in a file on fast local storage. Clean blocks evicted from
+// the pool are written into block-sized slots of a preallocated file, and
+// a miss reads them from there instead of the origin. Slots are filled
+// like a log: a write takes the slot after the last one written and
+// whatever it held is forgotten, so the oldest victims make room.
+//
+// Only the in-memory index says what a slot holds. The file is truncated
+// when it is opened and nothing in it outlives the process, so a crash
+// leaves nothing to validate. A block leaves the tier when it is taken
+// back into the pool or written directly, which keeps it from ever
+// serving a copy older than the origin.
+//
+// Slots are read and written without a lock, so a slot in use is marked
+// busy and is neither reused nor found until it is released. The file is
+// split into one region per shard, and a region is only used under its
+// shard lock.
+
+enum { SPILL_FREE, SPILL_VALID, SPILL_BUSY };
+
+typedef struct Spill {
+    int fd;
+    off_t base;          // of the region in the file
+    size_t block_size;
+    uint32_t nslots;
+    uint32_t head;       // slot the next write takes
+    uint64_t *owner;     // key of the block in each slot
+    uint8_t *state;
+    uint32_t *index;     // key -> slot + 1, linear probing, 0 when empty
+    size_t index_mask;
+} Spill;
+
+// Opens the file at path for a tier of `bytes`, truncates it and
+// preallocates the space. Returns the descriptor, or -1 with errno set;
+// EBUSY means another process uses the file.
+int spill_open(const char *path, size_t bytes);
+
+// A region of nslots blocks of block_size at `base` in the file.
+Spill *spill_create(int fd, off_t base, size_t nslots, size_t block_size);
+void spill_destroy(Spill *sp);
+
+static inline off_t spill_offset(const Spill *sp, uint32_t slot) {
+    return sp->base + (off_t)slot * (off_t)sp->block_size;
+}
+
+// Takes the next slot for a write and marks it busy, forgetting the block
+// it held. Returns false if every slot is busy.
+bool spill_reserve(Spill *sp, uint32_t *slot);
+
+// Indexes a reserved slot once the block has been written to it.
+void spill_commit(Spill *sp, uint32_t slot, uint64_t key);
+
+// Removes the block from the index. Returns true if it was there, with its
+// slot busy until released.
+bool spill_take(Spill *sp, uint64_t key, uint32_t *slot);
+
+void spill_release(Spill *sp, uint32_t slot);
+
+// Forgets every block; busy slots stay busy.
+void spill_clear(Spill *sp);
+
+#endif
@@ -0,0 +1,153 @@
+#include "lab2_stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LAT_SUB_BITS 3
+#define LAT_LINEAR (2 << LAT_SUB_BITS) // values below are their own bucket
+#define LAT_MAX_BIT 40                  // about 18 minutes
+#define LAT_BUCKETS (LAT_LINEAR + (LAT_MAX_BIT - LAT_SUB_BITS) * (1 << LAT_SUB_BITS))
+
+// Counters of one thread. Only the owner writes them, with a relaxed load
+// and store rather than an atomic add; readers sum all records. Records are
+// never freed, and the ones of exited threads are reused, so the sums keep
+// counting everything that happened.
+typedef struct StatRecord {
+    _Atomic uint64_t total[NSTATS];
+    // STATS_FILES rows, a chunk of them on first use.
+    _Atomic uint64_t (*_Atomic files[STATS_FILES / STATS_CHUNK])[NSTATS];
+    _Atomic uint64_t lat[LAB2_LAT_OPS][LAT_BUCKETS];
+    _Atomic uint64_t lat_sum[LAB2_LAT_OPS];
+    _Atomic uint64_t lat_max[LAB2_LAT_OPS];
+    _Atomic bool in_use;
+    struct StatRecord *next;
+} __attribute__((aligned(64))) StatRecord;
+
+static StatRecord *_Atomic records;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread StatRecord *my_stats;
+
+static void stats_release(void *arg) {
+    StatRecord *r = arg;
+    atomic_store_explicit(&r->in_use, false, memory_order_release);
+}
+
+static void stats_key_init(void) {
+    pthread_key_create(&stats_key, stats_release);
+}
+
+static StatRecord *stats_record(void) {
+    StatRecord *r = my_stats;
+    if (r) return r;
+    pthread_once(&stats_once, stats_key_init);
+    for (r = atomic_load_explicit(&records, memory_order_acquire); r; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, true)) break;
+    }
+    if (!r) {
+        if (posix_memalign((void **)&r, 64, sizeof(StatRecord))) return NULL;
+        memset(r, 0, sizeof(*r));
+        atomic_init(&r->in_use, true);
+        r->next = atomic_load_explicit(&records, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&records, &r->next, r,
+                                                      memory_order_release,
+                                                      memory_order_relaxed)) {
+        }
+    }
+    pthread_setspecific(stats_key, r);
+    my_stats = r;
+    return r;
+}
+
+static inline void bump(_Atomic uint64_t *c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void stats_add(int file, int counter, uint64_t n) {
+    StatRecord *r = stats_record();
+    if (!r) return;
+    bump(&r->total[counter], n);
+    if (file < 0 || file >= STATS_FILES) return;
+    _Atomic(_Atomic uint64_t (*)[NSTATS]) *chunk = &r->files[file / STATS_CHUNK];
+    _Atomic uint64_t (*rows)[NSTATS] = atomic_load_explicit(chunk, memory_order_relaxed);
+    if (!rows) {
+        rows = calloc(STATS_CHUNK, sizeof(*rows));
+        if (!rows) return;
+        atomic_store_explicit(chunk, rows, memory_order_release);
+    }
+    bump(&rows[file % STATS_CHUNK][counter], n);
+}
+
+void stats_sum(int file, uint64_t out[NSTATS]) {
+    memset(out, 0, NSTATS * sizeof(uint64_t));
+    for (StatRecord *r = atomic_load_explicit(&records, memory_order_acquire); r; r = r->next) {
+        _Atomic uint64_t *c = r->total;
+        if (file >= 0) {
+            if (file >= STATS_FILES) continue;
+            _Atomic uint64_t (*rows)[NSTATS] =
+                atomic_load_explicit(&r->files[file / STATS_CHUNK], memory_order_acquire);
+            if (!rows) continue;
+            c = rows[file % STATS_CHUNK];
+        }
+        for (int i = 0; i < NSTATS; i++) out[i] += atomic_load_explicit(&c[i], memory_order_relaxed);
+    }
+}
+
+static unsigned lat_bucket(uint64_t ns) {
+    if (ns < LAT_LINEAR) return ns;
+    if (ns >> LAT_MAX_BIT) ns = (1ULL << LAT_MAX_BIT) - 1;
+    unsigned bit = 63 - __builtin_clzll(ns);
+    unsigned sub = (ns >> (bit - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1);
+    return LAT_LINEAR + ((bit - LAT_SUB_BITS - 1) << LAT_SUB_BITS) + sub;
+}
+
+// Largest value that falls into bucket i.
+static uint64_t lat_bucket_top(unsigned i) {
+    if (i < LAT_LINEAR) return i;
+    unsigned bit = (i - LAT_LINEAR) / (1 << LAT_SUB_BITS) + LAT_SUB_BITS + 1;
+    uint64_t sub = (i - LAT_LINEAR) % (1 << LAT_SUB_BITS);
+    uint64_t step = 1ULL << (bit - LAT_SUB_BITS);
+    return ((1ULL << LAT_SUB_BITS) + sub + 1) * step - 1;
+}
+
+void stats_latency(lab2_latency_op op, uint64_t ns) {
+    StatRecord *r = stats_record();
+    if (!r) return;
+    bump(&r->lat[op][lat_bucket(ns)], 1);
+    bump(&r->lat_sum[op], ns);
+    if (ns > atomic_load_explicit(&r->lat_max[op], memory_order_relaxed))
+        atomic_store_explicit(&r->lat_max[op], ns, memory_order_relaxed);
+}
+
+void stats_latency_get(lab2_latency_op op, lab2_latency *out) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    unsigned long long *targets[] = { &out->p50_ns, &out->p90_ns, &out->p99_ns, &out->p999_ns };
+    uint64_t hist[LAT_BUCKETS] = { 0 };
+    uint64_t sum = 0;
+
+    memset(out, 0, sizeof(*out));
+    for (StatRecord *r = atomic_load_explicit(&records, memory_order_acquire); r; r = r->next) {
+        for (unsigned i = 0; i < LAT_BUCKETS; i++)
+            hist[i] += atomic_load_explicit(&r->lat[op][i], memory_order_relaxed);
+        sum += atomic_load_explicit(&r->lat_sum[op], memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&r->lat_max[op], memory_order_relaxed);
+        if (max > out->max_ns) out->max_ns = max;
+    }
+    for (unsigned i = 0; i < LAT_BUCKETS; i++) out->count += hist[i];
+    if (!out->count) return;
+    out->mean_ns = sum / out->count;
+
+    uint64_t seen = 0;
+    size_t q = 0;
+    for (unsigned i = 0; i < LAT_BUCKETS && q < 4; i++) {
+        seen += hist[i];
+        while (q < 4 && seen >= quantiles[q] * out->count) {
+            uint64_t top = lat_bucket_top(i);
+            *targets[q++] = top < out->max_ns ? top : out->max_ns;
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef LAB2_STATS_H
+#define LAB2_STATS_H
+
+#include <stdint.h>
+#include "lab2.h"
+
+enum {
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_READAHEAD_HITS,
+    STAT_WARM_HITS,
+    STAT_EVICTIONS,
+    STAT_TIER_HITS,
+    STAT_TIER_STORES,
+    STAT_TIER_BYTES,
+    STAT_SPILL_HITS,
+    STAT_SPILL_STORES,
+    STAT_WB_FOREGROUND,
+    STAT_WB_BACKGROUND,
+    STAT_WB_SYNC,
+    STAT_WB_REQUESTS,
+    STAT_DISK_READ,
+    STAT_DISK_WRITE,
+    STAT_DIRECT_READ,
+    STAT_DIRECT_WRITE,
+    NSTATS
+};
+
+// One row of counters per slot, which the pool hands to files and handles.
+// Rows come in chunks of STATS_CHUNK, allocated as a thread first counts
+// into them.
+#define STATS_CHUNK 256
+#define STATS_FILES (256 * STATS_CHUNK)
+
+// Adds n to a counter of the calling thread, both to its global total and,
+// when `file` is a slot rather than -1, to that slot's row. Every
+// thread owns its counters, so this costs a couple of plain stores.
+void stats_add(int file, int counter, uint64_t n);
+
+// Sums the counters of all threads, past and present: the global totals for
+// file -1, a slot's row otherwise.
+void stats_sum(int file, uint64_t out[NSTATS]);
+
+// Latency histograms, one per operation and thread. Buckets are exact up
+// to 16 ns and then split every power of two into eight, so a percentile is
+// off by at most 12.5%.
+void stats_latency(lab2_latency_op op, uint64_t ns);
+void stats_latency_get(lab2_latency_op op, lab2_latency *out);
+
+#endif
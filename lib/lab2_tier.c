@@ -0,0 +1,152 @@
+#include "lab2_tier.h"
+#include "lab2_lz.h"
+#include "lab2_policy.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIER_ALIGN 16
+// The index is sized for blocks that compress this well on average; past
+// that, records are dropped for want of slots rather than of bytes.
+#define TIER_MAX_RATIO 4
+
+// Records start TIER_ALIGN-aligned in the arena. One that would not fit
+// before the end of the arena is preceded by padding up to the end, a
+// record of length 0.
+typedef struct TierRecord {
+    uint64_t key;
+    uint32_t len;  // compressed bytes that follow, 0 for padding
+    uint32_t span; // bytes the record takes in the arena
+} TierRecord;
+
+// Compression output, per thread and as large as the largest block the
+// thread compressed.
+typedef struct TierBuffer {
+    size_t size;
+    uint8_t data[];
+} TierBuffer;
+
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+static __thread TierBuffer *my_buffer;
+
+static void buffer_key_init(void) {
+    pthread_key_create(&buffer_key, free);
+}
+
+Tier *tier_create(size_t bytes, size_t block_size) {
+    size_t size = bytes & ~(size_t)(TIER_ALIGN - 1);
+    if (size < sizeof(TierRecord) + block_size) return NULL;
+    Tier *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->size = size;
+    t->block_size = block_size;
+    t->max_count = size / block_size * TIER_MAX_RATIO;
+    size_t slots = 16;
+    while (slots < 2 * t->max_count) slots <<= 1;
+    t->index_mask = slots - 1;
+    t->arena = malloc(size);
+    t->index = calloc(slots, sizeof(TierSlot));
+    if (!t->arena || !t->index) {
+        tier_destroy(t);
+        return NULL;
+    }
+    return t;
+}
+
+void tier_destroy(Tier *t) {
+    if (!t) return;
+    free(t->arena);
+    free(t->index);
+    free(t);
+}
+
+static TierSlot *find(Tier *t, uint64_t key) {
+    for (size_t i = mix64(key) & t->index_mask;; i = (i + 1) & t->index_mask) {
+        TierSlot *slot = &t->index[i];
+        if (!slot->pos || slot->key == key) return slot;
+    }
+}
+
+// Deletes by shifting back the entries that probed past the slot, so that
+// lookups never meet a tombstone.
+static void unindex(Tier *t, TierSlot *slot) {
+    size_t i = slot - t->index, j = i;
+    for (;;) {
+        j = (j + 1) & t->index_mask;
+        if (!t->index[j].pos) break;
+        size_t home = mix64(t->index[j].key) & t->index_mask;
+        // Move j into i unless its home lies cyclically in (i, j].
+        if (((j - home) & t->index_mask) < ((j - i) & t->index_mask)) continue;
+        t->index[i] = t->index[j];
+        i = j;
+    }
+    t->index[i].pos = 0;
+    t->count--;
+}
+
+static TierRecord *record_at(Tier *t, uint64_t pos) {
+    return (TierRecord *)(t->arena + pos % t->size);
+}
+
+// Drops the oldest record, unless it was taken or replaced already.
+static void pop_oldest(Tier *t) {
+    TierRecord *r = record_at(t, t->tail);
+    if (r->len) {
+        TierSlot *slot = find(t, r->key);
+        if (slot->pos == t->tail + 1) unindex(t, slot);
+    }
+    t->tail += r->span;
+}
+
+size_t tier_compress(const Tier *t, const void *data, const uint8_t **out) {
+    TierBuffer *b = my_buffer;
+    if (!b || b->size < t->block_size) {
+        pthread_once(&buffer_once, buffer_key_init);
+        TierBuffer *grown = realloc(b, sizeof(TierBuffer) + t->block_size);
+        if (!grown) return 0;
+        b = grown;
+        b->size = t->block_size;
+        pthread_setspecific(buffer_key, b);
+        my_buffer = b;
+    }
+    *out = b->data;
+    return lz_compress(data, t->block_size, b->data, t->block_size - t->block_size / 4);
+}
+
+void tier_insert(Tier *t, uint64_t key, const uint8_t *packed, size_t len) {
+    TierSlot *slot = find(t, key);
+    if (slot->pos) unindex(t, slot);
+
+    size_t span = (sizeof(TierRecord) + len + TIER_ALIGN - 1) & ~(size_t)(TIER_ALIGN - 1);
+    size_t off = t->head % t->size;
+    if (off + span > t->size) {
+        size_t pad = t->size - off;
+        while (t->head + pad - t->tail > t->size) pop_oldest(t);
+        *record_at(t, t->head) = (TierRecord){ 0, 0, (uint32_t)pad };
+        t->head += pad;
+    }
+    while (t->head + span - t->tail > t->size || t->count >= t->max_count) pop_oldest(t);
+
+    TierRecord *r = record_at(t, t->head);
+    *r = (TierRecord){ key, (uint32_t)len, (uint32_t)span };
+    memcpy(r + 1, packed, len);
+    slot = find(t, key);
+    *slot = (TierSlot){ key, t->head + 1 };
+    t->count++;
+    t->head += span;
+}
+
+bool tier_take(Tier *t, uint64_t key, void *data) {
+    TierSlot *slot = find(t, key);
+    if (!slot->pos) return false;
+    TierRecord *r = record_at(t, slot->pos - 1);
+    unindex(t, slot);
+    return !data || lz_decompress((const uint8_t *)(r + 1), r->len, data, t->block_size) == 0;
+}
+
+void tier_clear(Tier *t) {
+    memset(t->index, 0, (t->index_mask + 1) * sizeof(TierSlot));
+    t->count = 0;
+    t->head = t->tail = 0;
+}
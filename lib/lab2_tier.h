@@ -0,0 +1,56 @@
+#ifndef LAB2_TIER_H
+#define LAB2_TIER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed second tier. Clean blocks evicted from the pool are
+// compressed into a ring of records and looked up here on a miss before
+// the disk is read. The ring is filled in order and its oldest records
+// make room for new ones, so eviction is FIFO and the arena never
+// fragments. A block leaves the tier when it is taken back into the pool,
+// which keeps the two exclusive. Blocks that do not compress to three
+// quarters of their size are not kept.
+//
+// A tier has no lock of its own: the pool keeps one per shard and only
+// uses it under the shard lock. Compression needs no lock, so the pool
+// does it unlocked and takes the lock only to insert the record.
+
+typedef struct TierSlot {
+    uint64_t key;
+    uint64_t pos; // position of the record + 1, 0 for an empty slot
+} TierSlot;
+
+typedef struct Tier {
+    uint8_t *arena;
+    size_t size;         // of the arena, a multiple of TIER_ALIGN
+    uint64_t head, tail; // records live in [tail, head), positions only grow
+    TierSlot *index;     // key -> record, linear probing
+    size_t index_mask;
+    size_t count, max_count;
+    size_t block_size;
+} Tier;
+
+// A tier of `bytes` for blocks of block_size, or NULL if it cannot hold a
+// single block.
+Tier *tier_create(size_t bytes, size_t block_size);
+void tier_destroy(Tier *t);
+
+// Compresses a block into a buffer of the calling thread, valid until its
+// next call, and points *out at it. Returns the compressed size, or 0 if
+// the block would not be kept. Needs no lock.
+size_t tier_compress(const Tier *t, const void *data, const uint8_t **out);
+
+// Stores a block tier_compress() returned, replacing the oldest records if
+// it has to.
+void tier_insert(Tier *t, uint64_t key, const uint8_t *packed, size_t len);
+
+// Removes the block from the tier. Returns true if it was there and, unless
+// `data` is NULL, has been decompressed into it.
+bool tier_take(Tier *t, uint64_t key, void *data);
+
+// Drops every block.
+void tier_clear(Tier *t);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef LAB2_TRACE_H
+#define LAB2_TRACE_H
+
+#include <stdint.h>
+
+// Static tracepoints in the "lab2" provider, for perf, bpftrace or
+// SystemTap to attach to a running process. A probe is a single nop plus
+// an ELF note that names it and tells where its arguments live, so it
+// costs nothing while no tracer is attached. All arguments are 64-bit.
+//
+//   lab2:hit        file, block
+//   lab2:miss       file, block, blocks read, ns
+//   lab2:readahead  file, first block, blocks
+//   lab2:evict      file, block, ns spent writing it back (0 if clean)
+//   lab2:writeback  blocks, write requests, ns
+//   lab2:direct     file, 0 for read or 1 for write, bytes, ns
+//
+// `file` is the slot of the open file, shared by all of its handles and
+// reused once the last one is closed.
+
+#if __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+#define TRACE2(name, a, b) STAP_PROBE2(lab2, name, (uint64_t)(a), (uint64_t)(b))
+#define TRACE3(name, a, b, c) STAP_PROBE3(lab2, name, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c))
+#define TRACE4(name, a, b, c, d) \
+    STAP_PROBE4(lab2, name, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c), (uint64_t)(d))
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+
+// What <sys/sdt.h> emits, for systems without the header: a version 3
+// stapsdt note pointing at the nop, and the .stapsdt.base anchor that
+// tools use to relocate it.
+#define TRACE_NOTE(name, args)                                              \
+    "990: nop\n"                                                            \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                           \
+    ".balign 4\n"                                                           \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+    "991: .asciz \"stapsdt\"\n"                                             \
+    "992: .balign 4\n"                                                      \
+    "993: .8byte 990b\n"                                                    \
+    ".8byte _.stapsdt.base\n"                                               \
+    ".8byte 0\n"                                                            \
+    ".asciz \"lab2\"\n"                                                     \
+    ".asciz \"" #name "\"\n"                                                \
+    ".asciz \"" args "\"\n"                                                 \
+    "994: .balign 4\n"                                                      \
+    ".popsection\n"                                                         \
+    ".ifndef _.stapsdt.base\n"                                              \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                                \
+    ".hidden _.stapsdt.base\n"                                              \
+    "_.stapsdt.base: .space 1\n"                                            \
+    ".size _.stapsdt.base, 1\n"                                             \
+    ".popsection\n"                                                         \
+    ".endif\n"
+
+#define TRACE2(name, a, b)                                           \
+    __asm__ __volatile__(TRACE_NOTE(name, "8@%[a1] 8@%[a2]")         \
+                         :: [a1] "nor"((uint64_t)(a)), [a2] "nor"((uint64_t)(b)))
+#define TRACE3(name, a, b, c)                                        \
+    __asm__ __volatile__(TRACE_NOTE(name, "8@%[a1] 8@%[a2] 8@%[a3]") \
+                         :: [a1] "nor"((uint64_t)(a)), [a2] "nor"((uint64_t)(b)), \
+                            [a3] "nor"((uint64_t)(c)))
+#define TRACE4(name, a, b, c, d)                                             \
+    __asm__ __volatile__(TRACE_NOTE(name, "8@%[a1] 8@%[a2] 8@%[a3] 8@%[a4]") \
+                         :: [a1] "nor"((uint64_t)(a)), [a2] "nor"((uint64_t)(b)), \
+                            [a3] "nor"((uint64_t)(c)), [a4] "nor"((uint64_t)(d)))
+
+#else
+
+#define TRACE2(name, a, b) ((void)(a), (void)(b))
+#define TRACE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define TRACE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+
+#endif
+
+#endif
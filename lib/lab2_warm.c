@@ -0,0 +1,88 @@
+#include "lab2_warm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// No manifest of a sane cache comes near this; a larger count means the
+// file is damaged.
+#define WARM_MAX_ENTRIES (1ULL << 32)
+
+int warm_identity(int fd, WarmHeader *h) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+    h->size = st.st_size;
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+bool warm_same_file(const WarmHeader *a, const WarmHeader *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+static int write_all(int fd, const void *p, size_t len) {
+    const char *c = p;
+    while (len) {
+        ssize_t n = write(fd, c, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *p, size_t len) {
+    char *c = p;
+    while (len) {
+        ssize_t n = read(fd, c, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int warm_write(const char *path, const WarmHeader *h, const uint64_t *e) {
+    size_t len = strlen(path);
+    char *tmp = malloc(len + 8);
+    if (!tmp) return -1;
+    snprintf(tmp, len + 8, "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+    int err = write_all(fd, h, sizeof(*h));
+    if (!err) err = write_all(fd, e, h->count * sizeof(uint64_t));
+    if (close(fd) < 0) err = -1;
+    if (!err) err = rename(tmp, path);
+    if (err) unlink(tmp);
+    free(tmp);
+    return err ? -1 : 0;
+}
+
+uint64_t *warm_read(const char *path, WarmHeader *h) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    uint64_t *e = NULL;
+    if (read_all(fd, h, sizeof(*h)) == 0 && h->magic == WARM_MAGIC &&
+        h->version == WARM_VERSION && h->count < WARM_MAX_ENTRIES) {
+        e = malloc(h->count ? h->count * sizeof(uint64_t) : 1);
+        if (e && read_all(fd, e, h->count * sizeof(uint64_t)) < 0) {
+            free(e);
+            e = NULL;
+        }
+    }
+    if (!e && errno != ENOMEM) errno = EINVAL;
+    close(fd);
+    return e;
+}
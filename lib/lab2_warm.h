@@ -0,0 +1,62 @@
+#ifndef LAB2_WARM_H
+#define LAB2_WARM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Warm-start manifests. A manifest lists the blocks of one file that were
+// cached when it was saved, warmest first, so that a later process can load
+// them back before it is asked for them. It names the file by device, inode,
+// size and modification time: if any of them changed since, the blocks may
+// no longer hold what was cached and the manifest is ignored.
+//
+// The file starts with a WarmHeader, followed by `count` 8-byte entries in
+// host byte order.
+
+#define WARM_MAGIC 0x314d52573242414cULL // "LAB2WRM1" on little-endian hosts
+#define WARM_VERSION 1
+
+typedef struct WarmHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t count;
+} WarmHeader;
+
+// An entry packs the block number in bits 0-39, how recently the block was
+// used in bits 40-55 (WARM_RECENCY_MAX for the most recent) and flags on
+// top, so entries sort warmest first by their upper bits.
+#define WARM_BLOCK_MASK ((1ULL << 40) - 1)
+#define WARM_RECENCY_SHIFT 40
+#define WARM_RECENCY_MAX 0xffffULL
+#define WARM_FREQUENT (1ULL << 56) // hit again after it was loaded
+
+static inline uint64_t warm_entry(uint64_t block, uint64_t recency, uint64_t flags) {
+    return flags | (recency << WARM_RECENCY_SHIFT) | (block & WARM_BLOCK_MASK);
+}
+
+static inline uint64_t warm_block(uint64_t e) {
+    return e & WARM_BLOCK_MASK;
+}
+
+// Fills the identity fields of `h` from an open file.
+int warm_identity(int fd, WarmHeader *h);
+
+bool warm_same_file(const WarmHeader *a, const WarmHeader *b);
+
+// Replaces the manifest at `path` atomically: a crash leaves either the
+// old manifest or the new one. h->count entries are taken from `e`.
+int warm_write(const char *path, const WarmHeader *h, const uint64_t *e);
+
+// Reads a manifest into *h and returns its entries, which the caller
+// frees, or NULL if the file is missing, truncated or of another version
+// (EINVAL).
+uint64_t *warm_read(const char *path, WarmHeader *h);
+
+#endif
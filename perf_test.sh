@@ -12,42 +12,99 @@ echo "==================================================="
 echo
 
 # Test 1: Cache Performance Test
-echo "Test 1: Random Cache Performance Test"
+echo "Test 1: Cache Performance Test"
 echo "Description: Evaluating cache performance with different"
-echo "file sizes and access patterns (sequential and random)"
+echo "file sizes and access patterns, against plain O_DIRECT I/O"
 echo "==================================================="
 echo
-echo "Size(MB) | Mode  | Run | no_cache(ms) | with_cache(ms)"
-echo "------------------------------------------------------"
+
+# Cache and workload settings; every run is timed, not counted.
+export LAB2_BLOCK_SIZE=${LAB2_BLOCK_SIZE:-4096}
+export LAB2_CACHE_SIZE=${LAB2_CACHE_SIZE:-64M}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-5}
+IO_SIZE=${IO_SIZE:-4K}
+THREADS=${THREADS:-1}
+# One JSON object per run, for comparing builds.
+RESULTS=${RESULTS:-perf_results.jsonl}
+: > $RESULTS
+
+field() {
+  echo "$1" | sed -n "s/.*\"$2\":\([^,}]*\).*/\1/p"
+}
+
+echo "Size(MB) | Workload | Run | no_cache(MB/s) | with_cache(MB/s) | p99(us) | hit ratio"
+echo "-------------------------------------------------------------------------------------"
 
 for size in 256 512 1024
 do
   FILE="testfile_${size}MB.bin"
 
   dd if=/dev/zero of=$FILE bs=1M count=$size 2>/dev/null
-  
-  for mode in seq rand
+
+  for workload in seq rand zipf hotcold mixed
   do
     for run in 1 2 3
     do
-      
+
       # Clear system caches
       sync
       echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null 2>&1
 
-      output=$(./lab2_test $mode $FILE $((size*1024*1024)))
-
-      no_cache=$(echo "$output" | awk -F'[= ]' '{print $2}')
-      with_cache=$(echo "$output" | awk -F'[= ]' '{print $5}')
+      args="-w $workload -s ${size}M -b $IO_SIZE -t $THREADS -d $SECONDS_PER_RUN"
+      no_cache=$(./lab2_test -j -B $args $FILE)
+      with_cache=$(./lab2_test -j $args $FILE)
+      echo "$no_cache" >> $RESULTS
+      echo "$with_cache" >> $RESULTS
 
-      echo "$size      | $mode |  $run  | $no_cache       | $with_cache"
+      echo "$size      | $workload | $run | $(field "$no_cache" mb_per_sec) | $(field "$with_cache" mb_per_sec) | $(field "$with_cache" p99) | $(field "$with_cache" hit_ratio)"
     done
   done
+  rm -f $FILE
+done
+
+echo
+echo "==================================================="
+echo "Test 2: Hugepages"
+echo "Description: Random hits on a file the cache holds"
+echo "whole, with the frames on 4 KiB and on 2 MiB pages"
+echo "==================================================="
+echo
+
+FILE="testfile_hugepages.bin"
+echo "Hugepages | ops/s | p50(us) | p99(us)"
+echo "----------------------------------------"
+for huge in 0 1
+do
+  result=$(LAB2_HUGEPAGES=$huge LAB2_CACHE_SIZE=1100M \
+           ./lab2_test -j -W -w rand -s 1G -b $IO_SIZE -t $THREADS -d $SECONDS_PER_RUN $FILE)
+  echo "$result" >> $RESULTS
+  echo "$huge         | $(field "$result" ops_per_sec) | $(field "$result" p50) | $(field "$result" p99)"
+done
+rm -f $FILE
+
+echo
+echo "==================================================="
+echo "Test 3: Scan resistance"
+echo "Description: Zipf reads while another handle scans"
+echo "the file, without admission and with TinyLFU"
+echo "==================================================="
+echo
+
+FILE="testfile_scan.bin"
+echo "Admission | hit ratio | ops/s | p99(us) | scan MB/s"
+echo "---------------------------------------------------"
+for admission in none tinylfu
+do
+  result=$(LAB2_ADMISSION=$admission LAB2_CACHE_SIZE=64M \
+           ./lab2_test -j -S -w zipf -s 512M -b $IO_SIZE -t $THREADS -d $SECONDS_PER_RUN $FILE)
+  echo "$result" >> $RESULTS
+  echo "$admission | $(field "$result" hit_ratio) | $(field "$result" ops_per_sec) | $(field "$result" p99) | $(field "$result" scan_mb_per_sec)"
 done
+rm -f $FILE
 
 echo
 echo "==================================================="
-echo "Test 2: External Integer Sorting Test"
+echo "Test 4: External Integer Sorting Test"
 echo "Description: Testing the performance of external"
 echo "merge sort implementation for integer arrays"
 echo "==================================================="
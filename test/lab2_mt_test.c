@@ -0,0 +1,843 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include "lab2.h"
+
+#define BLOCK 4096
+#define STRESS_FILE_SIZE (4 << 20)
+#define HIT_FILE_BLOCKS 1024
+#define MISS_CACHE_BLOCKS 256
+#define MISS_FILE_BLOCKS 8192
+#define MISS_OPS 20000
+#define WARM_BLOCKS 192
+#define SCAN_HOT_BLOCKS 64
+#define SCAN_BLOCKS 2048
+#define SCAN_DIRECT_BLOCKS 16
+#define TIER_BLOCKS 1024
+#define SPILL_BLOCKS 1024
+#define HANDLE_OPENS 1000
+#define POLICY_BLOCKS 16
+#define POLICY_FILE_BLOCKS (4 * POLICY_BLOCKS)
+#define POLICY_OPS 3000
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A single-shard pool of `blocks` blocks, with the process defaults for
+// everything else.
+static lab2_config test_config(size_t blocks) {
+    lab2_config cfg;
+    lab2_config_default(&cfg);
+    cfg.block_size = BLOCK;
+    cfg.capacity_blocks = blocks;
+    cfg.capacity_bytes = 0;
+    cfg.shards = 1;
+    return cfg;
+}
+
+static unsigned next_rand(unsigned *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// ---------------------------------------------------------------------------
+// Stress: every thread owns a file and checks its reads against a private
+// shadow copy. The pool is much smaller than the files, so threads keep
+// evicting each other's blocks.
+// ---------------------------------------------------------------------------
+
+typedef struct StressArg {
+    const lab2_config *cfg;
+    int id;
+    int iterations;
+    int failed;
+} StressArg;
+
+static void *stress_worker(void *p) {
+    StressArg *a = p;
+    char path[64];
+    snprintf(path, sizeof(path), "mt-stress-%d.bin", a->id);
+    unlink(path);
+
+    unsigned char *shadow = calloc(1, STRESS_FILE_SIZE);
+    unsigned char *buf = NULL;
+    if (posix_memalign((void **)&buf, BLOCK, 65536)) buf = NULL;
+    size_t size = 0;
+    unsigned seed = 12345 + a->id * 7919;
+    int fd = lab2_open_ex(path, a->cfg);
+    if (fd < 0 || !shadow || !buf) {
+        a->failed = 1;
+        goto out;
+    }
+
+    for (int it = 0; it < a->iterations && !a->failed; it++) {
+        size_t off = next_rand(&seed) % (STRESS_FILE_SIZE - 65536);
+        size_t len = next_rand(&seed) % 65536;
+        unsigned op = next_rand(&seed) % 100;
+        // Block-aligned offsets let large transfers take the direct path.
+        if (next_rand(&seed) % 4 == 0) off -= off % BLOCK;
+        // Half of the transfers use the positional calls, split into three
+        // buffers.
+        bool positional = next_rand(&seed) % 2;
+        struct iovec iov[3] = {
+            { buf, len / 3 },
+            { buf + len / 3, len / 3 },
+            { buf + 2 * (len / 3), len - 2 * (len / 3) },
+        };
+        if (op < 45) {
+            for (size_t i = 0; i < len; i++) buf[i] = (unsigned char)next_rand(&seed);
+            ssize_t n;
+            if (positional) {
+                n = lab2_pwritev(fd, iov, 3, off);
+            } else {
+                lab2_lseek(fd, off, SEEK_SET);
+                n = lab2_write(fd, buf, len);
+            }
+            if (n != (ssize_t)len) a->failed = 1;
+            memcpy(shadow + off, buf, len);
+            if (off + len > size) size = off + len;
+        } else if (op < 95) {
+            size_t expect = off >= size ? 0 : (off + len > size ? size - off : len);
+            ssize_t n;
+            if (positional) {
+                n = lab2_preadv(fd, iov, 3, off);
+            } else {
+                lab2_lseek(fd, off, SEEK_SET);
+                n = lab2_read(fd, buf, len);
+            }
+            if (n != (ssize_t)expect) a->failed = 1;
+            else if (memcmp(buf, shadow + off, expect)) a->failed = 1;
+        } else if (op < 98) {
+            // Zero-copy access: check a pinned block, or flip bytes in it.
+            off_t bn = off / BLOCK;
+            size_t at = (size_t)bn * BLOCK;
+            if (op < 96) {
+                const unsigned char *data = lab2_get_block(fd, bn);
+                if (at < size) {
+                    size_t n = size - at < BLOCK ? size - at : BLOCK;
+                    if (!data || memcmp(data, shadow + at, n)) a->failed = 1;
+                }
+                if (data && lab2_put_block(fd, data) < 0) a->failed = 1;
+            } else {
+                unsigned char *data = lab2_get_block_rw(fd, bn);
+                if (!data) {
+                    a->failed = 1;
+                    continue;
+                }
+                for (size_t i = 0; i < len % BLOCK; i++) data[i] ^= 0x5a;
+                memcpy(shadow + at, data, BLOCK);
+                if (lab2_put_block_rw(fd, data) < 0) a->failed = 1;
+                if (at + BLOCK > size) size = at + BLOCK;
+            }
+        } else {
+            lab2_fsync(fd);
+        }
+    }
+    lab2_close(fd);
+
+    int sys_fd = open(path, O_RDONLY);
+    unsigned char *disk = malloc(STRESS_FILE_SIZE);
+    if (sys_fd < 0 || !disk || read(sys_fd, disk, STRESS_FILE_SIZE) < (ssize_t)size ||
+        memcmp(disk, shadow, size))
+        a->failed = 1;
+    if (sys_fd >= 0) close(sys_fd);
+    free(disk);
+out:
+    unlink(path);
+    free(shadow);
+    free(buf);
+    return NULL;
+}
+
+static int run_stress(int threads) {
+    lab2_config cfg = test_config(512);
+    cfg.shards = 4;
+    cfg.direct_bytes = 8 * BLOCK;
+
+    // The first open builds the shared pool with this configuration.
+    int probe = lab2_open_ex("mt-probe.bin", &cfg);
+    if (probe < 0) {
+        perror("lab2_open_ex");
+        return 1;
+    }
+
+    pthread_t tid[threads];
+    StressArg args[threads];
+    for (int i = 0; i < threads; i++) {
+        args[i] = (StressArg){ .cfg = &cfg, .id = i, .iterations = 3000, .failed = 0 };
+        pthread_create(&tid[i], NULL, stress_worker, &args[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+        failed |= args[i].failed;
+    }
+    lab2_close(probe);
+    unlink("mt-probe.bin");
+    printf("stress: %d threads, %s\n", threads, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+// ---------------------------------------------------------------------------
+// Hit throughput: every thread reads random blocks of its own, fully cached
+// file, and then all threads read one shared handle with lab2_pread(). No
+// miss ever happens, so the numbers show how the hit path scales.
+// ---------------------------------------------------------------------------
+
+typedef struct HitArg {
+    int fd;
+    bool shared;
+    unsigned seed;
+    double seconds;
+    unsigned long ops;
+    pthread_barrier_t *start;
+} HitArg;
+
+static void *hit_worker(void *p) {
+    HitArg *a = p;
+    char buf[BLOCK];
+    unsigned seed = a->seed;
+    pthread_barrier_wait(a->start);
+    double end = now_sec() + a->seconds;
+    unsigned long ops = 0;
+    while ((ops & 1023) || now_sec() < end) {
+        off_t off = (off_t)(next_rand(&seed) % HIT_FILE_BLOCKS) * BLOCK;
+        if (a->shared) {
+            lab2_pread(a->fd, buf, BLOCK, off);
+        } else {
+            lab2_lseek(a->fd, off, SEEK_SET);
+            lab2_read(a->fd, buf, BLOCK);
+        }
+        ops++;
+    }
+    a->ops = ops;
+    return NULL;
+}
+
+static int make_file(const char *path, size_t size) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd < 0) return -1;
+    char *buf = calloc(1, 1 << 20);
+    for (size_t done = 0; done < size; done += 1 << 20) {
+        if (write(fd, buf, 1 << 20) < 0) break;
+    }
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+static double hit_round(HitArg *args, int t) {
+    pthread_t tid[t];
+    for (int i = 0; i < t; i++) pthread_create(&tid[i], NULL, hit_worker, &args[i]);
+    unsigned long total = 0;
+    for (int i = 0; i < t; i++) {
+        pthread_join(tid[i], NULL);
+        total += args[i].ops;
+    }
+    return total / args[0].seconds;
+}
+
+static void run_hits(int max_threads, double seconds) {
+    lab2_config cfg = test_config((size_t)max_threads * HIT_FILE_BLOCKS * 2);
+    cfg.shards = 0;
+    cfg.direct_bytes = LAB2_DIRECT_OFF; // the warm-up read must fill the cache
+
+    printf("\n threads |      ops/s | speedup | shared ops/s | speedup\n");
+    printf("---------+------------+---------+--------------+--------\n");
+    double base = 0, shared_base = 0;
+    for (int t = 1; t <= max_threads; t *= 2) {
+        int fds[t];
+        HitArg args[t];
+        pthread_barrier_t start;
+        char *buf = malloc((size_t)HIT_FILE_BLOCKS * BLOCK);
+        pthread_barrier_init(&start, NULL, t);
+        for (int i = 0; i < t; i++) {
+            char path[64];
+            snprintf(path, sizeof(path), "mt-hit-%d.bin", i);
+            make_file(path, (size_t)HIT_FILE_BLOCKS * BLOCK);
+            fds[i] = lab2_open_ex(path, &cfg);
+            lab2_read(fds[i], buf, (size_t)HIT_FILE_BLOCKS * BLOCK);
+            args[i] = (HitArg){ .fd = fds[i], .seed = 777 + i, .seconds = seconds, .start = &start };
+        }
+        double rate = hit_round(args, t);
+        for (int i = 0; i < t; i++) {
+            args[i].fd = fds[0];
+            args[i].shared = true;
+        }
+        double shared = hit_round(args, t);
+        if (t == 1) {
+            base = rate;
+            shared_base = shared;
+        }
+        printf(" %7d | %10.0f | %6.2fx | %12.0f | %6.2fx\n", t, rate, rate / base, shared,
+               shared / shared_base);
+        for (int i = 0; i < t; i++) {
+            char path[64];
+            snprintf(path, sizeof(path), "mt-hit-%d.bin", i);
+            lab2_close(fds[i]);
+            unlink(path);
+        }
+        pthread_barrier_destroy(&start);
+        free(buf);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Miss latency: one thread, random blocks of a file 32 times the cache, so
+// nearly every access allocates a frame and evicts another one.
+// ---------------------------------------------------------------------------
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report_latency(const char *name, double *lat, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += lat[i];
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf(" %-6s | %8.2f | %8.2f | %8.2f\n", name, sum / n * 1e6, lat[n / 2] * 1e6,
+           lat[n * 99 / 100] * 1e6);
+}
+
+static void run_misses(void) {
+    lab2_config cfg = test_config(MISS_CACHE_BLOCKS);
+    cfg.mrc = LAB2_MRC_ON;
+
+    make_file("mt-miss.bin", (size_t)MISS_FILE_BLOCKS * BLOCK);
+    int fd = lab2_open_ex("mt-miss.bin", &cfg);
+    double *lat = malloc(MISS_OPS * sizeof(double));
+    if (fd < 0 || !lat) {
+        perror("miss latency");
+        free(lat);
+        return;
+    }
+
+    char buf[BLOCK];
+    unsigned seed = 4242;
+    printf("\n miss   |  mean us |   p50 us |   p99 us\n");
+    printf("--------+----------+----------+---------\n");
+    lab2_stats before, after;
+    for (int pass = 0; pass < 2; pass++) {
+        lab2_get_stats(&before);
+        for (int i = 0; i < MISS_OPS; i++) {
+            off_t off = (off_t)(next_rand(&seed) % MISS_FILE_BLOCKS) * BLOCK;
+            double t0 = now_sec();
+            lab2_lseek(fd, off, SEEK_SET);
+            if (pass == 0) lab2_read(fd, buf, BLOCK);
+            else lab2_write(fd, buf, BLOCK);
+            lat[i] = now_sec() - t0;
+        }
+        report_latency(pass == 0 ? "read" : "write", lat, MISS_OPS);
+    }
+    lab2_get_stats(&after);
+    printf("write-backs during writes: %llu foreground, %llu background\n",
+           after.writeback_foreground - before.writeback_foreground,
+           after.writeback_background - before.writeback_background);
+    lab2_stats file;
+    lab2_get_file_stats(fd, &file);
+    printf("handle: %llu hits, %llu misses, %llu evictions, %llu KiB read from disk\n",
+           file.hits, file.misses, file.evictions, file.disk_read_bytes >> 10);
+    // Uniform accesses: a cache of 1/k of the file should miss 1 - 1/k of them.
+    lab2_mrc_point curve[8];
+    int points = lab2_get_mrc(curve, 8);
+    printf("estimated LRU miss ratio (blocks: ratio):");
+    for (int i = 0; i < points; i++) printf(" %llu: %.3f", curve[i].cache_blocks, curve[i].miss_ratio);
+    printf("\n");
+    printf("\n inside |  mean us |   p50 us |   p99 us\n");
+    printf("--------+----------+----------+---------\n");
+    const char *names[] = { "hit", "miss", "evict" };
+    for (int op = LAB2_LAT_HIT; op <= LAB2_LAT_EVICT_WRITE; op++) {
+        lab2_latency l;
+        lab2_get_latency(op, &l);
+        printf(" %-6s | %8.2f | %8.2f | %8.2f\n", names[op], l.mean_ns / 1e3, l.p50_ns / 1e3,
+               l.p99_ns / 1e3);
+    }
+    lab2_close(fd);
+    unlink("mt-miss.bin");
+    free(lat);
+}
+
+// Reads a scattered hot set once and returns the share that hit.
+static double warm_pass(int fd) {
+    char buf[BLOCK];
+    lab2_stats before, after;
+    lab2_get_file_stats(fd, &before);
+    for (int i = 0; i < WARM_BLOCKS; i++)
+        lab2_pread(fd, buf, BLOCK, (off_t)((i * 37) % MISS_FILE_BLOCKS) * BLOCK);
+    lab2_get_file_stats(fd, &after);
+    return (double)(after.hits - before.hits) / WARM_BLOCKS;
+}
+
+// A reopened handle loads what the last one had cached, unless the file
+// changed in between.
+static int run_warm(void) {
+    lab2_config cfg = test_config(MISS_CACHE_BLOCKS);
+
+    make_file("mt-warm.bin", (size_t)MISS_FILE_BLOCKS * BLOCK);
+    int fd = lab2_open_ex("mt-warm.bin", &cfg);
+    if (fd < 0) {
+        perror("warm start");
+        return 1;
+    }
+    double cold = warm_pass(fd);
+    int failed = lab2_save_manifest(fd, "mt-warm.manifest") < 0;
+    lab2_close(fd);
+
+    fd = lab2_open_ex("mt-warm.bin", &cfg);
+    ssize_t queued = lab2_load_manifest(fd, "mt-warm.manifest");
+    lab2_stats st;
+    for (int i = 0; i < 200; i++) {
+        lab2_get_file_stats(fd, &st);
+        if (queued < 0 || st.disk_read_bytes >= (unsigned long long)queued * BLOCK) break;
+        usleep(10000);
+    }
+    double warm = warm_pass(fd);
+    lab2_close(fd);
+    failed |= queued < WARM_BLOCKS || warm < 1.0;
+
+    // Growing the file makes the manifest stale.
+    int raw = open("mt-warm.bin", O_WRONLY | O_APPEND);
+    char block[BLOCK] = { 0 };
+    if (raw < 0 || write(raw, block, BLOCK) != BLOCK) failed = 1;
+    if (raw >= 0) close(raw);
+    fd = lab2_open_ex("mt-warm.bin", &cfg);
+    failed |= lab2_load_manifest(fd, "mt-warm.manifest") != -1 || errno != ESTALE;
+    lab2_close(fd);
+
+    printf("\nwarm start: %zd blocks queued, hot set hit %.0f%% cold, %.0f%% warm, %s\n", queued,
+           100 * cold, 100 * warm, failed ? "FAILED" : "ok");
+    unlink("mt-warm.bin");
+    unlink("mt-warm.manifest");
+    return failed;
+}
+
+// Reads a hot set a few times, then scans eight times the cache once, and
+// returns the share of the hot set that survived the scan, or -1 if a
+// direct write over the end of the scan, still cached, went through the
+// cache.
+static double scan_survivors(lab2_admission admission) {
+    lab2_config cfg = test_config(MISS_CACHE_BLOCKS);
+    cfg.policy = LAB2_POLICY_LRU;
+    cfg.readahead_blocks = LAB2_READAHEAD_OFF;
+    cfg.direct_bytes = SCAN_DIRECT_BLOCKS * BLOCK;
+    cfg.admission = admission;
+
+    int fd = lab2_open_ex("mt-scan.bin", &cfg);
+    if (fd < 0) {
+        perror("scan");
+        return -1;
+    }
+    char buf[BLOCK];
+    for (int pass = 0; pass < 4; pass++)
+        for (int i = 0; i < SCAN_HOT_BLOCKS; i++) lab2_pread(fd, buf, BLOCK, (off_t)i * BLOCK);
+    for (int i = 0; i < SCAN_BLOCKS; i++)
+        lab2_pread(fd, buf, BLOCK, (off_t)(SCAN_HOT_BLOCKS + i) * BLOCK);
+    lab2_stats before, after;
+    lab2_get_file_stats(fd, &before);
+    for (int i = 0; i < SCAN_HOT_BLOCKS; i++) lab2_pread(fd, buf, BLOCK, (off_t)i * BLOCK);
+    lab2_get_file_stats(fd, &after);
+    double survived = (double)(after.hits - before.hits) / SCAN_HOT_BLOCKS;
+
+    // With TinyLFU the scanned blocks still cached are on probation.
+    void *tail;
+    if (posix_memalign(&tail, BLOCK, SCAN_DIRECT_BLOCKS * BLOCK)) return -1;
+    memset(tail, 0, SCAN_DIRECT_BLOCKS * BLOCK);
+    off_t pos = (off_t)(SCAN_HOT_BLOCKS + SCAN_BLOCKS - SCAN_DIRECT_BLOCKS) * BLOCK;
+    lab2_get_file_stats(fd, &before);
+    ssize_t n = lab2_pwrite(fd, tail, SCAN_DIRECT_BLOCKS * BLOCK, pos);
+    lab2_get_file_stats(fd, &after);
+    lab2_close(fd);
+    free(tail);
+    if (n != SCAN_DIRECT_BLOCKS * BLOCK ||
+        after.direct_write_bytes - before.direct_write_bytes != SCAN_DIRECT_BLOCKS * BLOCK)
+        return -1;
+    return survived;
+}
+
+// With TinyLFU admission a one-off scan leaves the hot set in place.
+static int run_scan(void) {
+    make_file("mt-scan.bin", (size_t)(SCAN_HOT_BLOCKS + SCAN_BLOCKS) * BLOCK);
+    double plain = scan_survivors(LAB2_ADMISSION_NONE);
+    double tinylfu = scan_survivors(LAB2_ADMISSION_TINYLFU);
+    int failed = plain < 0 || tinylfu < 0.9;
+    printf("scan: hot set hit %.0f%% without admission, %.0f%% with TinyLFU, %s\n", 100 * plain,
+           100 * tinylfu, failed ? "FAILED" : "ok");
+    unlink("mt-scan.bin");
+    return failed;
+}
+
+// Blocks the cache evicts come back from the compressed tier, not the disk.
+static int run_tier(void) {
+    lab2_config cfg = test_config(MISS_CACHE_BLOCKS);
+    cfg.readahead_blocks = LAB2_READAHEAD_OFF;
+    cfg.tier_bytes = 1 << 20;
+
+    make_file("mt-tier.bin", (size_t)TIER_BLOCKS * BLOCK);
+    int fd = lab2_open_ex("mt-tier.bin", &cfg);
+    if (fd < 0) {
+        perror("tier");
+        return 1;
+    }
+    // Mostly zeros, with the block number at the start of each block.
+    for (int i = 0; i < TIER_BLOCKS; i++) lab2_pwrite(fd, &i, sizeof(i), (off_t)i * BLOCK);
+    lab2_fsync(fd);
+    char buf[BLOCK];
+    lab2_stats before, after;
+    lab2_get_file_stats(fd, &before);
+    int failed = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < TIER_BLOCKS; i++) {
+            int stamp = -1;
+            lab2_pread(fd, buf, BLOCK, (off_t)i * BLOCK);
+            memcpy(&stamp, buf, sizeof(stamp));
+            failed |= stamp != i;
+        }
+    }
+    lab2_get_file_stats(fd, &after);
+    lab2_close(fd);
+    unsigned long long hits = after.tier_hits - before.tier_hits;
+    unsigned long long read = after.disk_read_bytes - before.disk_read_bytes;
+    failed |= hits < TIER_BLOCKS;
+    printf("tier: %llu misses served compressed, %llu KiB read from disk, %s\n", hits, read >> 10,
+           failed ? "FAILED" : "ok");
+    unlink("mt-tier.bin");
+    return failed;
+}
+
+// Blocks the cache evicts come back from the spill file, and never older
+// than what was written since.
+static int run_spill(void) {
+    lab2_config cfg = test_config(MISS_CACHE_BLOCKS);
+    cfg.readahead_blocks = LAB2_READAHEAD_OFF;
+    cfg.tier_bytes = LAB2_TIER_OFF;
+    cfg.spill_bytes = 2 * SPILL_BLOCKS * BLOCK;
+    cfg.spill_path = "mt-spill.cache";
+
+    make_file("mt-spill.bin", (size_t)SPILL_BLOCKS * BLOCK);
+    int fd = lab2_open_ex("mt-spill.bin", &cfg);
+    if (fd < 0) {
+        perror("spill");
+        return 1;
+    }
+    for (int i = 0; i < SPILL_BLOCKS; i++) lab2_pwrite(fd, &i, sizeof(i), (off_t)i * BLOCK);
+    lab2_fsync(fd);
+    char buf[BLOCK];
+    lab2_stats before, after;
+    lab2_get_file_stats(fd, &before);
+    int failed = 0;
+    // Read every block, stamp it anew, and read it again: a stale copy in
+    // the spill file would bring the old stamp back.
+    for (int pass = 0; pass < 3; pass++) {
+        for (int i = 0; i < SPILL_BLOCKS; i++) {
+            int want = pass ? i + SPILL_BLOCKS : i, stamp = -1;
+            if (pass == 1) {
+                lab2_pwrite(fd, &want, sizeof(want), (off_t)i * BLOCK);
+                continue;
+            }
+            lab2_pread(fd, buf, BLOCK, (off_t)i * BLOCK);
+            memcpy(&stamp, buf, sizeof(stamp));
+            failed |= stamp != want;
+        }
+    }
+    lab2_get_file_stats(fd, &after);
+    lab2_close(fd);
+    unsigned long long hits = after.spill_hits - before.spill_hits;
+    unsigned long long read = after.disk_read_bytes - before.disk_read_bytes;
+    failed |= hits < SPILL_BLOCKS;
+    printf("spill: %llu misses served from the spill file, %llu KiB read from disk, %s\n", hits,
+           read >> 10, failed ? "FAILED" : "ok");
+    unlink("mt-spill.bin");
+    unlink("mt-spill.cache");
+    return failed;
+}
+
+// Closed descriptors are handed out again, and opens of one file share its
+// blocks: a block written through one handle is a hit through another,
+// stays cached while any handle is open, and is on disk once all of them
+// are closed.
+static int run_handles(void) {
+    lab2_config cfg = test_config(MISS_CACHE_BLOCKS);
+
+    make_file("mt-handles.bin", 16 * BLOCK);
+    int failed = 0, first = -1, opens = 0;
+    for (; opens < HANDLE_OPENS; opens++) {
+        int fd = lab2_open_ex("mt-handles.bin", &cfg);
+        if (fd < 0) break;
+        if (first < 0) first = fd;
+        failed |= fd != first;
+        lab2_close(fd);
+    }
+    failed |= opens < HANDLE_OPENS;
+
+    int a = lab2_open_ex("mt-handles.bin", &cfg);
+    int b = lab2_open_ex("mt-handles.bin", &cfg);
+    lab2_pwrite(a, "shared", 6, BLOCK);
+    lab2_stats before, after;
+    lab2_get_file_stats(b, &before);
+    char buf[2][6];
+    lab2_pread(b, buf[0], 6, BLOCK);
+    failed |= lab2_close(a) != 0;
+    lab2_pread(b, buf[1], 6, BLOCK);
+    lab2_pwrite(b, "second", 6, 2 * BLOCK);
+    lab2_get_file_stats(b, &after);
+    failed |= lab2_close(b) != 0;
+    failed |= a < 0 || b < 0 || a == b || after.hits - before.hits != 2 ||
+              memcmp(buf[0], "shared", 6) || memcmp(buf[1], "shared", 6);
+
+    char disk[2][6] = { { 0 } };
+    int plain = open("mt-handles.bin", O_RDONLY);
+    failed |= plain < 0 || pread(plain, disk[0], 6, BLOCK) != 6 ||
+              pread(plain, disk[1], 6, 2 * BLOCK) != 6 || memcmp(disk[0], "shared", 6) ||
+              memcmp(disk[1], "second", 6);
+    if (plain >= 0) close(plain);
+    printf("handles: %d opens on descriptor %d, shared blocks, %s\n", opens, first,
+           failed ? "FAILED" : "ok");
+    unlink("mt-handles.bin");
+    return failed;
+}
+
+static lab2_config policy_config(lab2_policy policy) {
+    lab2_config cfg = test_config(POLICY_BLOCKS);
+    cfg.policy = policy;
+    cfg.readahead_blocks = LAB2_READAHEAD_OFF;
+    cfg.direct_bytes = LAB2_DIRECT_OFF;
+    cfg.admission = LAB2_ADMISSION_NONE;
+    cfg.tier_bytes = LAB2_TIER_OFF;
+    cfg.spill_bytes = LAB2_SPILL_OFF;
+    return cfg;
+}
+
+// Reads one block and tells whether it was cached.
+static bool cached(int fd, off_t block) {
+    char buf[BLOCK];
+    lab2_stats before, after;
+    lab2_get_file_stats(fd, &before);
+    lab2_pread(fd, buf, BLOCK, block * BLOCK);
+    lab2_get_file_stats(fd, &after);
+    return after.hits > before.hits;
+}
+
+// Fills the cache with blocks 0..POLICY_BLOCKS-1, reads block 0 twice
+// more and misses once. Every policy but 2Q then keeps block 0 and evicts
+// block 1; 2Q evicts the oldest block of its FIFO regardless of the hits.
+// Random is not checked.
+static bool policy_order(lab2_policy policy) {
+    lab2_config cfg = policy_config(policy);
+    int fd = lab2_open_ex("mt-policy.bin", &cfg);
+    if (fd < 0) return false;
+    char buf[BLOCK];
+    for (int i = 0; i < POLICY_BLOCKS; i++) lab2_pread(fd, buf, BLOCK, (off_t)i * BLOCK);
+    lab2_pread(fd, buf, BLOCK, 0);
+    lab2_pread(fd, buf, BLOCK, 0);
+    lab2_pread(fd, buf, BLOCK, (off_t)POLICY_BLOCKS * BLOCK);
+    bool ok = true;
+    if (policy == LAB2_POLICY_2Q) ok = cached(fd, 1) && !cached(fd, 0);
+    else if (policy != LAB2_POLICY_RANDOM) ok = cached(fd, 0) && !cached(fd, 1);
+    lab2_close(fd);
+    return ok;
+}
+
+// A pinned block outlives a scan of the whole file; the policy has to
+// step over it through the evictable hook.
+static bool policy_pinned(lab2_policy policy) {
+    lab2_config cfg = policy_config(policy);
+    int fd = lab2_open_ex("mt-policy.bin", &cfg);
+    if (fd < 0) return false;
+    const void *pin = lab2_get_block(fd, 1);
+    char buf[BLOCK];
+    for (int pass = 0; pass < 2; pass++)
+        for (int i = 2; i < POLICY_FILE_BLOCKS; i++) lab2_pread(fd, buf, BLOCK, (off_t)i * BLOCK);
+    bool ok = pin && cached(fd, 1);
+    if (pin) lab2_put_block(fd, pin);
+    lab2_close(fd);
+    return ok;
+}
+
+// Random reads, writes and reopens of a file much larger than the cache,
+// checked against a copy in memory and, after every close, on disk.
+static bool policy_shadow(lab2_policy policy) {
+    static char shadow[POLICY_FILE_BLOCKS * BLOCK], buf[3 * BLOCK], disk[POLICY_FILE_BLOCKS * BLOCK];
+    lab2_config cfg = policy_config(policy);
+    memset(shadow, 0, sizeof(shadow));
+    unsigned seed = 0x5eed + policy;
+    int fd = lab2_open_ex("mt-policy.bin", &cfg);
+    bool ok = fd >= 0;
+    for (int op = 0; ok && op < POLICY_OPS; op++) {
+        size_t len = 1 + next_rand(&seed) % sizeof(buf);
+        off_t off = next_rand(&seed) % (sizeof(shadow) - len);
+        if (next_rand(&seed) % 2) {
+            for (size_t i = 0; i < len; i++) buf[i] = (char)next_rand(&seed);
+            ok = lab2_pwrite(fd, buf, len, off) == (ssize_t)len;
+            memcpy(shadow + off, buf, len);
+        } else {
+            ok = lab2_pread(fd, buf, len, off) == (ssize_t)len && !memcmp(buf, shadow + off, len);
+        }
+        if (ok && op % 500 == 499) {
+            ok = lab2_close(fd) == 0;
+            int plain = open("mt-policy.bin", O_RDONLY);
+            ok &= plain >= 0 && pread(plain, disk, sizeof(disk), 0) == (ssize_t)sizeof(disk) &&
+                  !memcmp(disk, shadow, sizeof(disk));
+            if (plain >= 0) close(plain);
+            fd = lab2_open_ex("mt-policy.bin", &cfg);
+            ok &= fd >= 0;
+        }
+    }
+    if (fd >= 0) lab2_close(fd);
+    return ok;
+}
+
+// Eviction order, pinning and data integrity under every policy.
+static int run_policies(void) {
+    static const struct {
+        lab2_policy policy;
+        const char *name;
+    } policies[] = {
+        { LAB2_POLICY_RANDOM, "random" }, { LAB2_POLICY_LRU, "lru" },
+        { LAB2_POLICY_CLOCK, "clock" },   { LAB2_POLICY_2Q, "2q" },
+        { LAB2_POLICY_ARC, "arc" },       { LAB2_POLICY_S3FIFO, "s3fifo" },
+    };
+    int failed = 0;
+    printf("policies:");
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        make_file("mt-policy.bin", (size_t)POLICY_FILE_BLOCKS * BLOCK);
+        bool order = policy_order(policies[i].policy);
+        bool pinned = policy_pinned(policies[i].policy);
+        bool shadow = policy_shadow(policies[i].policy);
+        printf(" %s %s", policies[i].name, order && pinned && shadow ? "ok" : "FAILED");
+        if (!order || !pinned || !shadow)
+            printf(" (%s%s%s)", order ? "" : "order ", pinned ? "" : "pinned ", shadow ? "" : "data");
+        failed |= !order || !pinned || !shadow;
+    }
+    printf("\n");
+    unlink("mt-policy.bin");
+    return failed;
+}
+
+typedef struct PinArg {
+    int fd;
+    int id;
+    const void *pins[POLICY_BLOCKS];
+    int held;
+    pthread_barrier_t *start;
+} PinArg;
+
+static void *pin_worker(void *p) {
+    PinArg *a = p;
+    pthread_barrier_wait(a->start);
+    for (int i = 0; i < POLICY_BLOCKS; i++) {
+        const void *data = lab2_get_block(a->fd, (off_t)(a->id * POLICY_BLOCKS + i));
+        if (data) a->pins[a->held++] = data;
+    }
+    return NULL;
+}
+
+// Threads that pin at the same time never hold more than half of a shard
+// between them, and a shard of one block can still be pinned.
+static int run_pins(int threads) {
+    make_file("mt-pins.bin", (size_t)threads * POLICY_BLOCKS * BLOCK);
+    lab2_config cfg = test_config(POLICY_BLOCKS);
+    cfg.readahead_blocks = LAB2_READAHEAD_OFF;
+    int fd = lab2_open_ex("mt-pins.bin", &cfg);
+    if (fd < 0) {
+        perror("pins");
+        return 1;
+    }
+    pthread_t tid[threads];
+    PinArg args[threads];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads);
+    for (int i = 0; i < threads; i++) {
+        args[i] = (PinArg){ .fd = fd, .id = i, .start = &start };
+        pthread_create(&tid[i], NULL, pin_worker, &args[i]);
+    }
+    int held = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+        held += args[i].held;
+    }
+    for (int i = 0; i < threads; i++)
+        for (int j = 0; j < args[i].held; j++) lab2_put_block(fd, args[i].pins[j]);
+    pthread_barrier_destroy(&start);
+    lab2_close(fd);
+
+    cfg = test_config(1);
+    fd = lab2_open_ex("mt-pins.bin", &cfg);
+    const void *one = lab2_get_block(fd, 0);
+    if (one) lab2_put_block(fd, one);
+    lab2_close(fd);
+    int failed = held != POLICY_BLOCKS / 2 || !one;
+    printf("pins: %d threads held %d of %d blocks, one-block shard %s, %s\n", threads, held,
+           POLICY_BLOCKS, one ? "pinned" : "refused", failed ? "FAILED" : "ok");
+    unlink("mt-pins.bin");
+    return failed;
+}
+
+// With every write-back failing, a write stops short once the dirty blocks
+// fill the cache rather than retry forever, and so does the close. The
+// file size limit makes the writes fail.
+static int run_write_errors(void) {
+    lab2_config cfg = test_config(POLICY_BLOCKS);
+    cfg.readahead_blocks = LAB2_READAHEAD_OFF;
+    cfg.direct_bytes = LAB2_DIRECT_OFF;
+    unlink("mt-full.bin");
+    int fd = lab2_open_ex("mt-full.bin", &cfg);
+    if (fd < 0) {
+        perror("write errors");
+        return 1;
+    }
+    struct rlimit old, none;
+    getrlimit(RLIMIT_FSIZE, &old);
+    none = (struct rlimit){ 0, old.rlim_max };
+    void (*sig)(int) = signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &none);
+
+    static char buf[POLICY_FILE_BLOCKS * BLOCK];
+    errno = 0;
+    ssize_t n = lab2_pwrite(fd, buf, sizeof(buf), 0);
+    int write_err = errno;
+    int closed = lab2_close(fd);
+    int close_err = errno;
+    setrlimit(RLIMIT_FSIZE, &old);
+    signal(SIGXFSZ, sig);
+
+    int failed = n < POLICY_BLOCKS * BLOCK || n >= (ssize_t)sizeof(buf) || write_err != EIO ||
+                 closed != -1 || close_err == 0;
+    printf("write errors: %zd of %zu blocks written, %s\n", n / BLOCK, sizeof(buf) / BLOCK,
+           failed ? "FAILED" : "ok");
+    unlink("mt-full.bin");
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (threads < 1) threads = 1;
+
+    int failed = run_stress(threads);
+    run_hits(threads, seconds);
+    run_misses();
+    failed |= run_warm();
+    failed |= run_scan();
+    failed |= run_tier();
+    failed |= run_spill();
+    failed |= run_handles();
+    failed |= run_policies();
+    failed |= run_pins(threads);
+    failed |= run_write_errors();
+    return failed;
+}
@@ -1,85 +1,485 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <sys/time.h>
+#include <math.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <dlfcn.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "lab2.h"
 
-typedef int     (*lab2_open_t)(const char *);
-typedef int     (*lab2_close_t)(int);
-typedef ssize_t (*lab2_read_t)(int, void *, size_t);
-typedef ssize_t (*lab2_write_t)(int, const void *, size_t);
-typedef off_t   (*lab2_lseek_t)(int, off_t, int);
-typedef int     (*lab2_fsync_t)(int);
+// Workload benchmark. Every thread issues positional reads and writes of
+// one I/O size against a shared handle, picking offsets from the chosen
+// access pattern, and the run reports throughput, latency percentiles and
+// the cache hit ratio. With -B the same workload goes to the file through
+// plain O_DIRECT pread/pwrite, which is what the cache is compared with.
+// With -S one more thread reads the whole file over and over through a
+// handle of its own while the workload runs, to see how well the working
+// set survives a scan; it is not counted in the results.
 
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <any_mode_name> <path> <size>\n", argv[0]);
-        return 1;
+typedef enum Pattern { SEQ, RAND, ZIPF, HOTCOLD } Pattern;
+
+static const char *pattern_names[] = { "seq", "rand", "zipf", "hotcold" };
+
+#define WARM_CHUNK (64 << 10)
+
+typedef struct Options {
+    const char *path;
+    const char *workload;
+    Pattern pattern;
+    size_t file_size;
+    size_t io_size;
+    int threads;
+    unsigned long ops;     // per thread, 0 for one pass over the file
+    double seconds;        // run for this long instead, if set
+    int read_pct;
+    double zipf_theta;
+    int hot_pct;           // share of the file that is hot
+    int hot_access_pct;    // share of the accesses that go there
+    bool baseline;
+    bool warm;             // read the file once before timing
+    bool scan;             // scan the file alongside the workload
+    bool json;
+} Options;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double rand01(uint64_t *state) {
+    return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t scramble(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// ---------------------------------------------------------------------------
+// Zipfian ranks, after Gray et al., "Quickly generating billion-record
+// synthetic databases". Ranks are scrambled over the file, as in YCSB, so
+// that the hot items are not all neighbours.
+// ---------------------------------------------------------------------------
+
+typedef struct Zipf {
+    uint64_t n;
+    double theta, alpha, zetan, eta;
+} Zipf;
+
+static void zipf_init(Zipf *z, uint64_t n, double theta) {
+    double zeta2 = 1.0 + pow(0.5, theta);
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) z->zetan += 1.0 / pow((double)i, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(const Zipf *z, uint64_t *state) {
+    double u = rand01(state);
+    double uz = u * z->zetan;
+    uint64_t rank;
+    if (uz < 1.0) rank = 0;
+    else if (uz < 1.0 + pow(0.5, z->theta)) rank = 1;
+    else rank = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    if (rank >= z->n) rank = z->n - 1;
+    return scramble(rank) % z->n;
+}
+
+// ---------------------------------------------------------------------------
+// Latency histogram: exact up to 16 ns, then eight buckets per power of
+// two, which keeps percentiles within 12.5%.
+// ---------------------------------------------------------------------------
+
+#define HIST_BUCKETS (16 + 40 * 8)
+
+typedef struct Hist {
+    unsigned long long bucket[HIST_BUCKETS];
+    unsigned long long count;
+    double sum;
+    uint64_t max;
+} Hist;
+
+static unsigned hist_index(uint64_t ns) {
+    if (ns < 16) return ns;
+    unsigned bit = 63 - __builtin_clzll(ns);
+    unsigned i = 16 + (bit - 4) * 8 + ((ns >> (bit - 3)) & 7);
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_top(unsigned i) {
+    if (i < 16) return i;
+    unsigned bit = (i - 16) / 8 + 4;
+    uint64_t step = 1ULL << (bit - 3);
+    return (8 + (i - 16) % 8 + 1) * step - 1;
+}
+
+static void hist_add(Hist *h, uint64_t ns) {
+    h->bucket[hist_index(ns)]++;
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max) h->max = ns;
+}
+
+static void hist_merge(Hist *into, const Hist *h) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) into->bucket[i] += h->bucket[i];
+    into->count += h->count;
+    into->sum += h->sum;
+    if (h->max > into->max) into->max = h->max;
+}
+
+static double hist_pct(const Hist *h, double q) {
+    unsigned long long seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen && seen >= q * h->count) {
+            uint64_t top = hist_top(i);
+            return (top < h->max ? top : h->max) / 1e3;
+        }
     }
+    return 0;
+}
 
-    void *handle = dlopen("./liblab2.so", RTLD_LAZY);
-    if (!handle) {
-        fprintf(stderr, "Cannot open library: %s\n", dlerror());
-        return 1;
+// ---------------------------------------------------------------------------
+// Workers
+// ---------------------------------------------------------------------------
+
+typedef struct Worker {
+    const Options *o;
+    const Zipf *zipf;
+    int fd;
+    int id;
+    uint64_t seed;
+    pthread_barrier_t *start;
+    unsigned long long ops;
+    unsigned long long bytes;
+    int errors;
+    Hist hist;
+} Worker;
+
+static uint64_t next_slot(Worker *w, uint64_t *cursor) {
+    const Options *o = w->o;
+    uint64_t n = o->file_size / o->io_size;
+    switch (o->pattern) {
+    case SEQ: {
+        // Every thread scans its own slice of the file, wrapping around.
+        uint64_t lo = n * w->id / o->threads, hi = n * (w->id + 1) / o->threads;
+        if (hi == lo) hi = lo + 1;
+        uint64_t slot = lo + *cursor % (hi - lo);
+        ++*cursor;
+        return slot;
+    }
+    case RAND:
+        return next_rand(&w->seed) % n;
+    case ZIPF:
+        return zipf_next(w->zipf, &w->seed);
+    case HOTCOLD: {
+        uint64_t hot = n * o->hot_pct / 100;
+        if (!hot) hot = 1;
+        if (hot >= n || (int)(next_rand(&w->seed) % 100) < o->hot_access_pct)
+            return next_rand(&w->seed) % hot;
+        return hot + next_rand(&w->seed) % (n - hot);
+    }
     }
+    return 0;
+}
 
-    lab2_open_t  lab2_open  = (lab2_open_t)dlsym(handle, "lab2_open");
-    lab2_close_t lab2_close = (lab2_close_t)dlsym(handle, "lab2_close");
-    lab2_read_t  lab2_read  = (lab2_read_t)dlsym(handle, "lab2_read");
+static void *worker(void *arg) {
+    Worker *w = arg;
+    const Options *o = w->o;
+    char *buf;
+    if (posix_memalign((void **)&buf, 4096, o->io_size)) {
+        w->errors++;
+        return NULL;
+    }
+    memset(buf, 0x5a, o->io_size);
+    unsigned long ops = o->ops ? o->ops : o->file_size / o->io_size / o->threads;
+    uint64_t cursor = 0;
 
-    char *error;
-    if ((error = dlerror()) != NULL) {
-        fprintf(stderr, "Error dlsym: %s\n", error);
-        dlclose(handle);
-        return 1;
+    pthread_barrier_wait(w->start);
+    double end = now_sec() + o->seconds;
+    for (unsigned long i = 0; o->seconds > 0 ? ((i & 63) || now_sec() < end) : i < ops; i++) {
+        off_t off = (off_t)(next_slot(w, &cursor) * o->io_size);
+        bool is_read = (int)(next_rand(&w->seed) % 100) < o->read_pct;
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ssize_t n;
+        if (o->baseline) {
+            n = is_read ? pread(w->fd, buf, o->io_size, off) : pwrite(w->fd, buf, o->io_size, off);
+        } else {
+            n = is_read ? lab2_pread(w->fd, buf, o->io_size, off)
+                        : lab2_pwrite(w->fd, buf, o->io_size, off);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (n != (ssize_t)o->io_size) w->errors++;
+        hist_add(&w->hist, (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec);
+        w->ops++;
+        w->bytes += o->io_size;
     }
+    free(buf);
+    return NULL;
+}
 
-    char *path = argv[2];
-    long size = atol(argv[3]);
-    char *buf = malloc(size);
-    if (!buf) {
-        perror("malloc");
-        dlclose(handle);
-        return 1;
+typedef struct Scanner {
+    const Options *o;
+    int fd;
+    atomic_bool stop;
+    unsigned long long bytes;
+    int errors;
+} Scanner;
+
+static void *scanner(void *arg) {
+    Scanner *sc = arg;
+    const Options *o = sc->o;
+    char *buf;
+    if (posix_memalign((void **)&buf, 4096, o->io_size)) {
+        sc->errors++;
+        return NULL;
+    }
+    uint64_t n = o->file_size / o->io_size;
+    for (uint64_t i = 0; !atomic_load_explicit(&sc->stop, memory_order_relaxed); i++) {
+        off_t off = (off_t)(i % n * o->io_size);
+        ssize_t r = o->baseline ? pread(sc->fd, buf, o->io_size, off)
+                                : lab2_pread(sc->fd, buf, o->io_size, off);
+        if (r != (ssize_t)o->io_size) sc->errors++;
+        sc->bytes += o->io_size;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Creates the file, or grows it to the requested size, with plain writes.
+static int prepare_file(const Options *o) {
+    struct stat st;
+    if (stat(o->path, &st) == 0 && (size_t)st.st_size >= o->file_size) return 0;
+    int fd = open(o->path, O_CREAT | O_WRONLY, 0666);
+    if (fd < 0) return -1;
+    char *chunk = malloc(1 << 20);
+    if (!chunk) {
+        close(fd);
+        return -1;
+    }
+    for (size_t i = 0; i < (1 << 20); i++) chunk[i] = (char)i;
+    int ret = 0;
+    for (size_t done = 0; done < o->file_size && ret == 0; done += 1 << 20) {
+        size_t n = o->file_size - done < (1 << 20) ? o->file_size - done : (1 << 20);
+        if (pwrite(fd, chunk, n, done) != (ssize_t)n) ret = -1;
+    }
+    if (fsync(fd) < 0) ret = -1;
+    free(chunk);
+    close(fd);
+    return ret;
+}
+
+static int parse_size(const char *s, size_t *out) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0) return -1;
+    switch (*end) {
+    case 'k': case 'K': v *= 1024; end++; break;
+    case 'm': case 'M': v *= 1024 * 1024; end++; break;
+    case 'g': case 'G': v *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (*end) return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <path>\n"
+            "  -w seq|rand|zipf|hotcold|mixed  access pattern (seq); mixed is zipf with 70%% reads\n"
+            "  -s SIZE      file size, K/M/G suffixes (64M)\n"
+            "  -b SIZE      I/O size (4K)\n"
+            "  -t N         threads sharing the handle (1)\n"
+            "  -n N         operations per thread (one pass over the file)\n"
+            "  -d SECONDS   run for a fixed time instead\n"
+            "  -r PERCENT   share of reads (100, 70 for mixed)\n"
+            "  -z THETA     Zipf skew (0.99)\n"
+            "  -H HOT:ACC   hot/cold split: ACC%% of accesses go to HOT%% of the file (10:90)\n"
+            "  -B           bypass the cache: plain O_DIRECT pread/pwrite\n"
+            "  -W           read the file through the cache once before timing\n"
+            "  -S           scan the file on another handle while the workload runs\n"
+            "  -j           print the result as one JSON object\n"
+            "The cache is configured through the LAB2_* environment variables.\n",
+            prog);
+}
+
+static int parse_options(int argc, char *argv[], Options *o) {
+    *o = (Options){ .workload = "seq", .pattern = SEQ, .file_size = 64 << 20, .io_size = 4096,
+                    .threads = 1, .read_pct = -1, .zipf_theta = 0.99, .hot_pct = 10,
+                    .hot_access_pct = 90 };
+    int c;
+    while ((c = getopt(argc, argv, "w:s:b:t:n:d:r:z:H:BWSj")) != -1) {
+        switch (c) {
+        case 'w':
+            o->workload = optarg;
+            if (!strcmp(optarg, "seq")) o->pattern = SEQ;
+            else if (!strcmp(optarg, "rand")) o->pattern = RAND;
+            else if (!strcmp(optarg, "zipf")) o->pattern = ZIPF;
+            else if (!strcmp(optarg, "hotcold")) o->pattern = HOTCOLD;
+            else if (!strcmp(optarg, "mixed")) o->pattern = ZIPF;
+            else return -1;
+            break;
+        case 's': if (parse_size(optarg, &o->file_size)) return -1; break;
+        case 'b': if (parse_size(optarg, &o->io_size)) return -1; break;
+        case 't': o->threads = atoi(optarg); break;
+        case 'n': o->ops = strtoul(optarg, NULL, 10); break;
+        case 'd': o->seconds = atof(optarg); break;
+        case 'r': o->read_pct = atoi(optarg); break;
+        case 'z': o->zipf_theta = atof(optarg); break;
+        case 'H':
+            if (sscanf(optarg, "%d:%d", &o->hot_pct, &o->hot_access_pct) != 2) return -1;
+            break;
+        case 'B': o->baseline = true; break;
+        case 'W': o->warm = true; break;
+        case 'S': o->scan = true; break;
+        case 'j': o->json = true; break;
+        default: return -1;
+        }
     }
+    if (optind != argc - 1) return -1;
+    o->path = argv[optind];
+    if (o->read_pct < 0) o->read_pct = strcmp(o->workload, "mixed") ? 100 : 70;
+    if (o->threads < 1 || !o->io_size || o->file_size < o->io_size || o->read_pct > 100 ||
+        o->zipf_theta <= 0 || o->zipf_theta == 1.0 || o->hot_pct < 0 || o->hot_pct > 100 ||
+        o->hot_access_pct < 0 || o->hot_access_pct > 100)
+        return -1;
+    return 0;
+}
 
-    int fd_sys = open(path, O_RDONLY);
-    if (fd_sys < 0) {
-        perror("open");
-        free(buf);
-        dlclose(handle);
+int main(int argc, char *argv[]) {
+    Options o;
+    if (parse_options(argc, argv, &o) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (prepare_file(&o) < 0) {
+        perror(o.path);
         return 1;
     }
-    struct timeval t1, t2;
-    gettimeofday(&t1, NULL);
-    read(fd_sys, buf, size);
-    close(fd_sys);
-    gettimeofday(&t2, NULL);
-    double d1 = (t2.tv_sec - t1.tv_sec) * 1000.0 +
-                (t2.tv_usec - t1.tv_usec) / 1000.0;
 
-    memset(buf, 0, size);
+    Zipf zipf;
+    if (o.pattern == ZIPF) zipf_init(&zipf, o.file_size / o.io_size, o.zipf_theta);
 
-    int fd = lab2_open(path);
+    int fd = o.baseline ? open(o.path, O_RDWR | O_DIRECT) : lab2_open(o.path);
     if (fd < 0) {
-        fprintf(stderr, "lab2_open failed\n");
-        free(buf);
-        dlclose(handle);
+        perror(o.baseline ? "open" : "lab2_open");
         return 1;
     }
-    gettimeofday(&t1, NULL);
-    lab2_read(fd, buf, size);
-    gettimeofday(&t2, NULL);
-    double d2 = (t2.tv_sec - t1.tv_sec) * 1000.0 +
-                (t2.tv_usec - t1.tv_usec) / 1000.0;
+    if (o.warm && !o.baseline) {
+        // Small enough reads that direct I/O leaves them to the cache.
+        char *chunk = malloc(WARM_CHUNK);
+        for (size_t done = 0; chunk && done < o.file_size; done += WARM_CHUNK) {
+            size_t n = o.file_size - done < WARM_CHUNK ? o.file_size - done : WARM_CHUNK;
+            lab2_pread(fd, chunk, n, done);
+        }
+        free(chunk);
+    }
+    lab2_stats before, after;
+    if (!o.baseline) lab2_get_file_stats(fd, &before);
 
-    printf("no_cache=%.2f ms, with_cache=%.2f ms\n", d1, d2);
+    Scanner sc = { .o = &o, .fd = -1 };
+    pthread_t scan_tid;
+    if (o.scan) {
+        sc.fd = o.baseline ? open(o.path, O_RDONLY | O_DIRECT) : lab2_open(o.path);
+        if (sc.fd < 0) {
+            perror(o.baseline ? "open" : "lab2_open");
+            return 1;
+        }
+    }
 
-    lab2_close(fd);
+    pthread_t tid[o.threads];
+    Worker *w = calloc(o.threads, sizeof(Worker));
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, o.threads + 1);
+    for (int i = 0; i < o.threads; i++) {
+        w[i] = (Worker){ .o = &o, .zipf = &zipf, .fd = fd, .id = i,
+                         .seed = 0x9e3779b97f4a7c15ULL * (i + 1), .start = &start };
+        pthread_create(&tid[i], NULL, worker, &w[i]);
+    }
+    pthread_barrier_wait(&start);
+    double t0 = now_sec();
+    if (o.scan) pthread_create(&scan_tid, NULL, scanner, &sc);
+    Hist total = { 0 };
+    unsigned long long ops = 0, bytes = 0;
+    int errors = 0;
+    for (int i = 0; i < o.threads; i++) {
+        pthread_join(tid[i], NULL);
+        hist_merge(&total, &w[i].hist);
+        ops += w[i].ops;
+        bytes += w[i].bytes;
+        errors += w[i].errors;
+    }
+    double elapsed = now_sec() - t0;
+    double scan_mb = -1;
+    if (o.scan) {
+        atomic_store(&sc.stop, true);
+        pthread_join(scan_tid, NULL);
+        scan_mb = sc.bytes / (now_sec() - t0) / (1 << 20);
+        errors += sc.errors;
+        if (o.baseline) close(sc.fd);
+        else lab2_close(sc.fd);
+    }
 
-    free(buf);
-    dlclose(handle);
-    return 0;
+    double hit_ratio = -1;
+    if (!o.baseline) {
+        lab2_get_file_stats(fd, &after);
+        unsigned long long hits = after.hits - before.hits;
+        unsigned long long lookups = hits + after.misses - before.misses;
+        if (lookups) hit_ratio = (double)hits / lookups;
+        lab2_close(fd);
+    } else {
+        close(fd);
+    }
+
+    double mean = total.count ? total.sum / total.count / 1e3 : 0;
+    if (o.json) {
+        printf("{\"workload\":\"%s\",\"pattern\":\"%s\",\"cache\":%s,\"file_size\":%zu,"
+               "\"io_size\":%zu,\"threads\":%d,\"read_pct\":%d,\"ops\":%llu,\"seconds\":%.6f,"
+               "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"latency_us\":{\"mean\":%.2f,"
+               "\"p50\":%.2f,\"p99\":%.2f,\"p999\":%.2f,\"max\":%.2f},\"hit_ratio\":",
+               o.workload, pattern_names[o.pattern], o.baseline ? "false" : "true", o.file_size,
+               o.io_size, o.threads, o.read_pct, ops, elapsed, ops / elapsed,
+               bytes / elapsed / (1 << 20), mean, hist_pct(&total, 0.5), hist_pct(&total, 0.99),
+               hist_pct(&total, 0.999), total.max / 1e3);
+        if (hit_ratio < 0) printf("null");
+        else printf("%.4f", hit_ratio);
+        if (scan_mb >= 0) printf(",\"scan_mb_per_sec\":%.2f", scan_mb);
+        printf(",\"errors\":%d}\n", errors);
+    } else {
+        printf("workload=%s cache=%s ops=%llu seconds=%.3f ops_per_sec=%.0f mb_per_sec=%.2f "
+               "mean_us=%.2f p50_us=%.2f p99_us=%.2f p999_us=%.2f hit_ratio=",
+               o.workload, o.baseline ? "off" : "on", ops, elapsed, ops / elapsed,
+               bytes / elapsed / (1 << 20), mean, hist_pct(&total, 0.5), hist_pct(&total, 0.99),
+               hist_pct(&total, 0.999));
+        if (hit_ratio < 0) printf("-");
+        else printf("%.4f", hit_ratio);
+        if (scan_mb >= 0) printf(" scan_mb_per_sec=%.2f", scan_mb);
+        printf(" errors=%d\n", errors);
+    }
+    pthread_barrier_destroy(&start);
+    free(w);
+    return errors ? 1 : 0;
 }
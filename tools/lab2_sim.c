@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab2_policy.h"
+#include "lab2_record.h"
+
+// Replays an access trace recorded with LAB2_TRACE against every eviction
+// policy and a range of cache sizes, and prints the hit ratio and the
+// write-backs that evictions cost for each. The policies are the cache's
+// own; around them every run keeps its blocks in flat arrays indexed by an
+// open-addressed table, so a replay touches a few cache lines per access.
+// Runs are spread over one thread per CPU.
+//
+// What the trace cannot show is not modelled: readahead, the background
+// flusher (every dirty block is written back when it is evicted) and
+// blocks moved by direct I/O, which are skipped unless -D is given.
+
+typedef struct IndexSlot {
+    uint64_t key;
+    uint32_t node; // node index + 1, 0 for an empty slot
+} IndexSlot;
+
+// One shard of a simulated cache.
+typedef struct SimCache {
+    Policy *policy;
+    PolicyNode *nodes;
+    uint8_t *dirty;
+    IndexSlot *index;
+    size_t mask;
+    size_t used;
+    size_t capacity;
+} SimCache;
+
+typedef struct SimRun {
+    lab2_policy policy;
+    size_t capacity;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long writebacks;
+    unsigned long long dirty_left;
+    int error;
+} SimRun;
+
+typedef struct Trace {
+    const RecordEntry *e;
+    size_t n;
+    size_t block_size;
+} Trace;
+
+typedef struct Options {
+    size_t shards;
+    bool direct;
+    lab2_policy policies[16];
+    size_t npolicies;
+    size_t sizes[64]; // bytes
+    size_t nsizes;
+} Options;
+
+static const Trace *trace;
+static const Options *opts;
+static SimRun *runs;
+static size_t nruns;
+static size_t next_run;
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t entry_key(uint64_t word) {
+    return ((uint64_t)record_file(word) << RECORD_FILE_SHIFT) ^ record_block(word);
+}
+
+static bool skip_entry(uint64_t word) {
+    return (word & RECORD_DIRECT) && !opts->direct;
+}
+
+// ---------------------------------------------------------------------------
+// Simulated cache
+// ---------------------------------------------------------------------------
+
+static int sim_init(SimCache *c, lab2_policy kind, size_t capacity) {
+    size_t slots = 1;
+    while (slots < 2 * capacity) slots <<= 1;
+    memset(c, 0, sizeof(*c));
+    c->capacity = capacity;
+    c->mask = slots - 1;
+    c->policy = policy_create(kind, capacity);
+    c->nodes = calloc(capacity, sizeof(PolicyNode));
+    c->dirty = calloc(capacity, 1);
+    c->index = calloc(slots, sizeof(IndexSlot));
+    if (!c->policy || !c->nodes || !c->dirty || !c->index) return -1;
+    return 0;
+}
+
+static void sim_destroy(SimCache *c) {
+    if (c->policy) policy_destroy(c->policy);
+    free(c->nodes);
+    free(c->dirty);
+    free(c->index);
+}
+
+// Removes a key with backward-shift deletion, so that lookups never need
+// tombstones.
+static void index_remove(SimCache *c, uint64_t key) {
+    size_t i = mix64(key) & c->mask;
+    while (c->index[i].key != key || !c->index[i].node) i = (i + 1) & c->mask;
+    for (;;) {
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & c->mask;
+            if (!c->index[j].node) {
+                c->index[i].node = 0;
+                return;
+            }
+            size_t home = mix64(c->index[j].key) & c->mask;
+            // The entry at j may fill the hole at i unless its home lies
+            // cyclically in (i, j].
+            bool between = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+            if (!between) break;
+        }
+        c->index[i] = c->index[j];
+        i = j;
+    }
+}
+
+// Returns true on a hit. A miss inserts the block, evicting the policy's
+// victim once the cache is full.
+static bool sim_access(SimCache *c, SimRun *r, uint64_t key, uint64_t hash, bool write) {
+    size_t i = hash & c->mask;
+    for (; c->index[i].node; i = (i + 1) & c->mask) {
+        if (c->index[i].key == key) {
+            size_t n = c->index[i].node - 1;
+            policy_hit(c->policy, &c->nodes[n]);
+            if (write) c->dirty[n] = 1;
+            return true;
+        }
+    }
+    PolicyNode *n;
+    if (c->used < c->capacity) {
+        n = &c->nodes[c->used++];
+    } else {
+        n = policy_victim(c->policy, key);
+        if (c->dirty[n - c->nodes]) r->writebacks++;
+        index_remove(c, n->key);
+        for (i = hash & c->mask; c->index[i].node; i = (i + 1) & c->mask) {
+        }
+    }
+    size_t idx = (size_t)(n - c->nodes);
+    n->key = key;
+    c->dirty[idx] = write;
+    c->index[i].key = key;
+    c->index[i].node = (uint32_t)idx + 1;
+    policy_insert(c->policy, n);
+    return false;
+}
+
+// Replays the trace through a cache split into shards the way the pool
+// splits it: by key hash, with the capacity spread evenly.
+static void sim_run(SimRun *r) {
+    size_t nshards = opts->shards;
+    size_t blocks = r->capacity;
+    SimCache *shards = calloc(nshards, sizeof(SimCache));
+    if (!shards) {
+        r->error = ENOMEM;
+        return;
+    }
+    for (size_t i = 0; i < nshards; i++) {
+        size_t cap = blocks / nshards + (i < blocks % nshards);
+        if (sim_init(&shards[i], r->policy, cap ? cap : 1) < 0) r->error = ENOMEM;
+    }
+    for (size_t k = 0; k < trace->n && !r->error; k++) {
+        uint64_t word = trace->e[k].word;
+        if (skip_entry(word)) continue;
+        uint64_t key = entry_key(word);
+        uint64_t hash = mix64(key);
+        SimCache *c = &shards[(hash >> 32) & (nshards - 1)];
+        if (sim_access(c, r, key, hash, word & RECORD_WRITE)) r->hits++;
+        else r->misses++;
+    }
+    for (size_t i = 0; i < nshards; i++) {
+        for (size_t j = 0; j < shards[i].used; j++) r->dirty_left += shards[i].dirty[j];
+        sim_destroy(&shards[i]);
+    }
+    free(shards);
+}
+
+static void *sim_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&run_lock);
+        size_t i = next_run++;
+        pthread_mutex_unlock(&run_lock);
+        if (i >= nruns) return NULL;
+        sim_run(&runs[i]);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Trace summary
+// ---------------------------------------------------------------------------
+
+// Distinct blocks of the trace, counted in a table that doubles at half
+// load.
+static size_t count_blocks(unsigned long long *reads, unsigned long long *writes) {
+    size_t mask = (1 << 16) - 1, used = 0;
+    uint64_t *set = calloc(mask + 1, sizeof(uint64_t));
+    if (!set) return 0;
+    for (size_t k = 0; k < trace->n; k++) {
+        uint64_t word = trace->e[k].word;
+        if (skip_entry(word)) continue;
+        if (word & RECORD_WRITE) ++*writes;
+        else ++*reads;
+        // Stored off by one, so that 0 marks an empty slot.
+        uint64_t key = entry_key(word) + 1;
+        size_t i = mix64(key) & mask;
+        while (set[i] && set[i] != key) i = (i + 1) & mask;
+        if (set[i]) continue;
+        set[i] = key;
+        if (++used * 2 <= mask) continue;
+        size_t nmask = 2 * mask + 1;
+        uint64_t *grown = calloc(nmask + 1, sizeof(uint64_t));
+        if (!grown) break;
+        for (size_t j = 0; j <= mask; j++) {
+            if (!set[j]) continue;
+            size_t h = mix64(set[j]) & nmask;
+            while (grown[h]) h = (h + 1) & nmask;
+            grown[h] = set[j];
+        }
+        free(set);
+        set = grown;
+        mask = nmask;
+    }
+    free(set);
+    return used;
+}
+
+static int map_trace(const char *path, Trace *t) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(RecordHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    const RecordHeader *h = p;
+    if (h->magic != RECORD_MAGIC || h->version != RECORD_VERSION) {
+        munmap(p, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    t->e = (const RecordEntry *)(h + 1);
+    t->n = (st.st_size - sizeof(RecordHeader)) / sizeof(RecordEntry);
+    t->block_size = h->block_size;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+
+static int parse_size(const char *s, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s) return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    if (*end) return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+static void format_size(char *buf, size_t len, unsigned long long bytes) {
+    static const char *units[] = { "B", "K", "M", "G", "T" };
+    double v = bytes;
+    int u = 0;
+    while (v >= 1024 && u < 4) {
+        v /= 1024;
+        u++;
+    }
+    snprintf(buf, len, u ? "%.1f%s" : "%.0f%s", v, units[u]);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <trace>\n"
+            "  -p LIST   policies to compare, comma separated (all)\n"
+            "  -c LIST   cache sizes in bytes, K/M/G suffixes, comma separated\n"
+            "            (eight sizes from 1/128 of the trace's footprint to all of it)\n"
+            "  -s N      shards, a power of two (1)\n"
+            "  -D        replay blocks moved by direct I/O as well\n",
+            prog);
+}
+
+static int parse_options(int argc, char *argv[], Options *o) {
+    memset(o, 0, sizeof(*o));
+    o->shards = 1;
+    int c;
+    char *tok, *save;
+    while ((c = getopt(argc, argv, "p:c:s:D")) != -1) {
+        switch (c) {
+        case 'p':
+            for (tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                if (o->npolicies == 16 || policy_parse(tok, &o->policies[o->npolicies]) < 0)
+                    return -1;
+                o->npolicies++;
+            }
+            break;
+        case 'c':
+            for (tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                if (o->nsizes == 64 || parse_size(tok, &o->sizes[o->nsizes]) < 0) return -1;
+                o->nsizes++;
+            }
+            break;
+        case 's':
+            if (parse_size(optarg, &o->shards) < 0 || !o->shards ||
+                (o->shards & (o->shards - 1)))
+                return -1;
+            break;
+        case 'D': o->direct = true; break;
+        default: return -1;
+        }
+    }
+    if (optind != argc - 1) return -1;
+    if (!o->npolicies) {
+        for (int k = LAB2_POLICY_RANDOM; policy_name((lab2_policy)k); k++)
+            o->policies[o->npolicies++] = k;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    Options o;
+    Trace t;
+    if (parse_options(argc, argv, &o) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (map_trace(argv[optind], &t) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    trace = &t;
+    opts = &o;
+
+    unsigned long long reads = 0, writes = 0;
+    size_t footprint = count_blocks(&reads, &writes);
+    char size[32];
+    format_size(size, sizeof(size), (unsigned long long)footprint * t.block_size);
+    printf("trace: %llu accesses, %.1f%% reads, %zu distinct blocks of %zu bytes (%s), %.3f s\n",
+           reads + writes, reads + writes ? 100.0 * reads / (reads + writes) : 0.0, footprint,
+           t.block_size, size, t.n ? t.e[t.n - 1].ns / 1e9 : 0.0);
+    if (!footprint) return 0;
+
+    if (!o.nsizes) {
+        for (int k = 7; k >= 0; k--) {
+            size_t blocks = footprint >> k;
+            if (!blocks || (o.nsizes && o.sizes[o.nsizes - 1] == blocks * t.block_size)) continue;
+            o.sizes[o.nsizes++] = blocks * t.block_size;
+        }
+    }
+
+    nruns = o.npolicies * o.nsizes;
+    runs = calloc(nruns, sizeof(SimRun));
+    if (!runs) return 1;
+    for (size_t i = 0; i < o.npolicies; i++) {
+        for (size_t j = 0; j < o.nsizes; j++) {
+            SimRun *r = &runs[i * o.nsizes + j];
+            r->policy = o.policies[i];
+            r->capacity = o.sizes[j] / t.block_size;
+            if (r->capacity < o.shards) r->capacity = o.shards;
+        }
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    if (nthreads > nruns) nthreads = nruns;
+    pthread_t tid[nthreads];
+    for (size_t i = 0; i < nthreads; i++) pthread_create(&tid[i], NULL, sim_worker, NULL);
+    for (size_t i = 0; i < nthreads; i++) pthread_join(tid[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("%-8s %10s %10s %8s %12s %10s\n", "policy", "cache", "blocks", "hit%", "write-backs",
+           "dirty");
+    for (size_t i = 0; i < nruns; i++) {
+        SimRun *r = &runs[i];
+        format_size(size, sizeof(size), (unsigned long long)r->capacity * t.block_size);
+        if (r->error) {
+            printf("%-8s %10s %10zu %s\n", policy_name(r->policy), size, r->capacity,
+                   strerror(r->error));
+            continue;
+        }
+        unsigned long long lookups = r->hits + r->misses;
+        printf("%-8s %10s %10zu %8.2f %12llu %10llu\n", policy_name(r->policy), size, r->capacity,
+               lookups ? 100.0 * r->hits / lookups : 0.0, r->writebacks, r->dirty_left);
+    }
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%zu runs over %zu entries in %.2f s (%.0f M accesses/s per thread)\n", nruns,
+            t.n, secs, secs > 0 ? (double)nruns * t.n / secs / nthreads / 1e6 : 0.0);
+    free(runs);
+    return 0;
+}